@@ -23,7 +23,34 @@ SOURCES += main.cpp \
     audioringbuffer.cpp \
     gpiofunctions.cpp \
     lcdi2c.cpp \
-    annotatedexception.cpp
+    annotatedexception.cpp \
+    driftcompensator.cpp \
+    settings.cpp \
+    speakerlayout.cpp \
+    gainstage.cpp \
+    outputstage.cpp \
+    decoderselection.cpp \
+    decoderbenchmark.cpp \
+    realtime.cpp \
+    jitterbenchmark.cpp \
+    alsareactor.cpp \
+    samplefifo.cpp \
+    latencyprofile.cpp \
+    latencycalibration.cpp \
+    xrunrecovery.cpp \
+    mixercontrol.cpp \
+    startuptrace.cpp \
+    tracer.cpp \
+    rtpsender.cpp \
+    networksource.cpp \
+    bitstreamrecorder.cpp \
+    replaysource.cpp \
+    replayharness.cpp \
+    controlserver.cpp \
+    runtimeconfig.cpp \
+    shmoutput.cpp \
+    audioblockpool.cpp \
+    alsafanout.cpp
 
 # The following define makes your compiler emit warnings if you use
 # any feature of Qt which as been marked deprecated (the exact warnings
@@ -44,4 +71,35 @@ HEADERS += \
     audioringbuffer.h \
     gpiofunctions.h \
     lcdi2c.h \
-    annotatedexception.h
+    annotatedexception.h \
+    driftcompensator.h \
+    settings.h \
+    speakerlayout.h \
+    gainstage.h \
+    outputstage.h \
+    decoderselection.h \
+    decoderbenchmark.h \
+    realtime.h \
+    jitterbenchmark.h \
+    stoptoken.h \
+    alsareactor.h \
+    samplefifo.h \
+    latencyprofile.h \
+    latencycalibration.h \
+    xrunrecovery.h \
+    lockfreequeue.h \
+    mixercontrol.h \
+    startuptrace.h \
+    tracer.h \
+    outputtap.h \
+    rtpsender.h \
+    networksource.h \
+    bitstreamrecorder.h \
+    capturesource.h \
+    replaysource.h \
+    replayharness.h \
+    controlserver.h \
+    runtimeconfig.h \
+    shmoutput.h \
+    audioblockpool.h \
+    alsafanout.h
@@ -0,0 +1,509 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "alsafanout.h"
+#include <QStringList>
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+extern "C"
+{
+    #include <libavutil/opt.h>
+}
+
+#include "outputstage.h"
+
+/**
+ * @brief hardwareLayout is the layout of the first channels on the TDM bus, which is what the output stage gets.
+ */
+static uint64_t hardwareLayout(int channels)
+{
+    uint64_t layout = 0;
+    for (int bit = 0; bit < 64 && av_get_channel_layout_nb_channels(layout) < channels; bit++)
+        layout |= HARDWARE_CHANNEL_LAYOUT & (1ULL << bit);
+    return layout;
+}
+
+AlsaSink::AlsaSink(const ExtraSinkConfig &config, const ThreadRealtimeSettings &realtime, const QString &threadName) :
+    mConfig(config),
+    mRealtime(realtime),
+    mThreadName(threadName),
+    mDelayFrames(config.delayMs * OUTPUT_SAMPLE_RATE / 1000),
+    mQueuedBlocks(0),
+    mWriterIdle(false),
+    mStop(false),
+    mOpen(false),
+    mFramesPlayed(0),
+    mDroppedBlocks(0),
+    mLostFrames(0),
+    mXruns(0),
+    mDeviceDelayFrames(0)
+{
+
+}
+
+AlsaSink::~AlsaSink()
+{
+    stop();
+}
+
+void AlsaSink::start()
+{
+    mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    mStop = false;
+    mThread = std::thread(&AlsaSink::writerLoop, this);
+}
+
+/**
+ * @brief AlsaSink::stop joins the writer, and gives the blocks that were still queued back to the pool.
+ */
+void AlsaSink::stop()
+{
+    if (mThread.joinable())
+    {
+        mStop = true;
+        const uint64_t one = 1;
+        ssize_t ret = ::write(mWakeFd, &one, sizeof(one));
+        Q_UNUSED(ret)
+        mThread.join();
+    }
+
+    AudioBlock *block = nullptr;
+    while (mQueue.pop(block))
+        AudioBlockRef(block).reset();
+    mQueuedBlocks = 0;
+
+    if (mWakeFd >= 0)
+        close(mWakeFd);
+    mWakeFd = -1;
+}
+
+/**
+ * @brief AlsaSink::push queues a block for the writer, which takes over the reference. Called from the playback thread; never blocks.
+ * @return false when the queue is full, in which case the handle keeps the reference.
+ */
+bool AlsaSink::push(AudioBlockRef &block)
+{
+    if (!mQueue.push(block.get()))
+    {
+        mDroppedBlocks++;
+        return false;
+    }
+
+    block.take();
+
+    mQueuedBlocks++;
+
+    if (mWriterIdle.exchange(false))
+    {
+        const uint64_t one = 1;
+        ssize_t ret = ::write(mWakeFd, &one, sizeof(one));
+        Q_UNUSED(ret)
+    }
+
+    return true;
+}
+
+bool AlsaSink::openDevice()
+{
+    mReopenTimer.start();
+
+    snd_pcm_t *pcm = nullptr;
+    snd_pcm_hw_params_t *hw_params = nullptr;
+    snd_pcm_sw_params_t *sw_params = nullptr;
+    unsigned int rate = OUTPUT_SAMPLE_RATE;
+    unsigned int bufferTimeUs = SINK_BUFFER_US;
+    snd_pcm_uframes_t period_size = 0;
+    int dir = 0;
+
+    int ret = snd_pcm_open(&pcm, qPrintable(mConfig.device), SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+    if (ret >= 0)
+        ret = snd_pcm_hw_params_malloc(&hw_params);
+    if (ret >= 0)
+        ret = snd_pcm_hw_params_any(pcm, hw_params);
+    if (ret >= 0)
+        ret = snd_pcm_hw_params_set_access(pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    if (ret >= 0)
+        ret = snd_pcm_hw_params_set_format(pcm, hw_params, SND_PCM_FORMAT_S16_LE);
+    if (ret >= 0)
+        ret = snd_pcm_hw_params_set_rate_near(pcm, hw_params, &rate, 0);
+    if (ret >= 0 && rate != OUTPUT_SAMPLE_RATE)
+        ret = -EINVAL; // Resampling is for a plug device to do.
+    if (ret >= 0)
+        ret = snd_pcm_hw_params_set_channels(pcm, hw_params, mConfig.channels);
+    if (ret >= 0)
+        ret = setBufferAndPeriods(pcm, hw_params, bufferTimeUs, SINK_PERIODS);
+    if (ret >= 0)
+        ret = snd_pcm_hw_params(pcm, hw_params);
+    if (ret >= 0)
+        ret = snd_pcm_hw_params_get_period_size(hw_params, &period_size, &dir);
+    if (ret >= 0)
+        ret = snd_pcm_sw_params_malloc(&sw_params);
+    if (ret >= 0)
+        ret = snd_pcm_sw_params_current(pcm, sw_params);
+    if (ret >= 0)
+        ret = snd_pcm_sw_params_set_start_threshold(pcm, sw_params, period_size);
+    if (ret >= 0)
+        ret = snd_pcm_sw_params(pcm, sw_params);
+    if (ret >= 0)
+        ret = snd_pcm_prepare(pcm);
+
+    if (sw_params)
+        snd_pcm_sw_params_free(sw_params);
+    if (hw_params)
+        snd_pcm_hw_params_free(hw_params);
+
+    if (ret < 0)
+    {
+        if (!mOpenFailureReported)
+            std::cerr << "Can't open extra sink " << qPrintable(mConfig.device) << ": " << snd_strerror(ret) << ". Trying again every "
+                      << SINK_REOPEN_INTERVAL_MS << " ms." << std::endl;
+        mOpenFailureReported = true;
+        if (pcm)
+            snd_pcm_close(pcm);
+        return false;
+    }
+
+    std::cout << "Extra sink " << qPrintable(mConfig.device) << " opened, buffer " << bufferTimeUs << " us." << std::endl;
+    mOpenFailureReported = false;
+    mPcm = pcm;
+    mOpen = true;
+    mNeedsPrefill = true;
+    return true;
+}
+
+void AlsaSink::closeDevice()
+{
+    if (mPcm)
+    {
+        snd_pcm_close(mPcm);
+        mPcm = nullptr;
+        mOpen = false;
+        mDeviceDelayFrames = 0;
+    }
+}
+
+bool AlsaSink::setupConverter(int inChannels)
+{
+    swr_free(&mSwr);
+    mSwr = swr_alloc();
+    mInChannels = 0;
+
+    av_opt_set_channel_layout(mSwr, "in_channel_layout", hardwareLayout(inChannels), 0);
+    av_opt_set_channel_layout(mSwr, "out_channel_layout", hardwareLayout(mConfig.channels), 0);
+    av_opt_set_sample_fmt(mSwr, "in_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+    av_opt_set_sample_fmt(mSwr, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+    av_opt_set_int(mSwr, "in_sample_rate", OUTPUT_SAMPLE_RATE, 0);
+    av_opt_set_int(mSwr, "out_sample_rate", OUTPUT_SAMPLE_RATE, 0);
+    av_opt_set_int(mSwr, "flags", SWR_FLAG_RESAMPLE, 0); // Always resample, so the clock drift compensation can be applied.
+
+    const int ret = swr_init(mSwr);
+    if (ret < 0)
+    {
+        char error[AV_ERROR_MAX_STRING_SIZE];
+        av_strerror(ret, error, sizeof(error));
+        std::cerr << "Can't convert " << inChannels << " channels for extra sink " << qPrintable(mConfig.device) << ": " << error << std::endl;
+        swr_free(&mSwr);
+        return false;
+    }
+
+    mInChannels = inChannels;
+    mDriftCompensator.applyTo(mSwr);
+    return true;
+}
+
+/**
+ * @brief AlsaSink::writeFrames writes all frames, waiting for the device as long as it takes something now and then.
+ * @return false when the device failed, or stalled, and was closed.
+ */
+bool AlsaSink::writeFrames(const int16_t *samples, int frames)
+{
+    QElapsedTimer stallTimer;
+    stallTimer.start();
+
+    while (frames > 0 && !mStop)
+    {
+        const snd_pcm_sframes_t ret = snd_pcm_writei(mPcm, samples, frames);
+        if (ret == -EAGAIN)
+        {
+            if (stallTimer.hasExpired(SINK_STALL_TIMEOUT_MS))
+            {
+                std::cerr << "Extra sink " << qPrintable(mConfig.device) << " took nothing for " << SINK_STALL_TIMEOUT_MS << " ms. Closing it." << std::endl;
+                closeDevice();
+                return false;
+            }
+            snd_pcm_wait(mPcm, SINK_STALL_TIMEOUT_MS / 10);
+            continue;
+        }
+        else if (ret < 0)
+        {
+            if (ret == -EPIPE)
+                mXruns++;
+
+            const int recovered = snd_pcm_recover(mPcm, static_cast<int>(ret), 1);
+            if (recovered < 0)
+            {
+                std::cerr << "Extra sink " << qPrintable(mConfig.device) << " failed: " << snd_strerror(recovered) << ". Closing it." << std::endl;
+                closeDevice();
+                return false;
+            }
+
+            // It starts again from empty; prefill before the next block, so it doesn't run dry straight away.
+            mNeedsPrefill = true;
+            continue;
+        }
+
+        samples += ret * mConfig.channels;
+        frames -= static_cast<int>(ret);
+        stallTimer.restart();
+    }
+
+    return frames == 0;
+}
+
+bool AlsaSink::writeSilence(int frames)
+{
+    while (frames > 0)
+    {
+        const int chunk = std::min(frames, SINK_CONVERT_FRAMES);
+        if (!writeFrames(mSilence, chunk))
+            return false;
+        frames -= chunk;
+    }
+    return true;
+}
+
+AudioBlockRef AlsaSink::waitForBlock()
+{
+    AudioBlock *block = nullptr;
+
+    if (!mQueue.pop(block))
+    {
+        // Tell the playback thread to wake us, then check once more, so a block queued in between isn't missed.
+        mWriterIdle = true;
+        if (!mQueue.pop(block))
+        {
+            struct pollfd pfd;
+            pfd.fd = mWakeFd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            poll(&pfd, 1, SINK_REOPEN_INTERVAL_MS);
+
+            uint64_t count;
+            ssize_t ret = read(mWakeFd, &count, sizeof(count));
+            Q_UNUSED(ret)
+            return AudioBlockRef();
+        }
+        mWriterIdle = false;
+    }
+
+    mQueuedBlocks--;
+    return AudioBlockRef(block);
+}
+
+void AlsaSink::writerLoop()
+{
+    std::cout << qPrintable(applyRealtimeToCurrentThread(mRealtime, mThreadName)) << std::endl;
+
+    int16_t *converted = new int16_t[SINK_CONVERT_FRAMES * MAX_OUTPUT_CHANNELS];
+    mSilence = new int16_t[SINK_CONVERT_FRAMES * MAX_OUTPUT_CHANNELS];
+    memset(mSilence, 0, SINK_CONVERT_FRAMES * MAX_OUTPUT_CHANNELS * sizeof(int16_t));
+
+    while (!mStop)
+    {
+        AudioBlockRef block = waitForBlock();
+        if (block.isNull())
+            continue;
+
+        if (!mPcm && (!mReopenTimer.isValid() || mReopenTimer.hasExpired(SINK_REOPEN_INTERVAL_MS)))
+            openDevice();
+
+        if (!mPcm || (block->channels != mInChannels && !setupConverter(block->channels)))
+        {
+            mLostFrames += block->frames;
+            continue;
+        }
+
+        // A new path comes after the transition silence and a pause while the primary device is reopened.
+        if (block->path != mPath)
+        {
+            mPath = block->path;
+            mDriftCompensator.reset();
+        }
+
+        if (mNeedsPrefill)
+        {
+            mNeedsPrefill = false;
+            mDriftCompensator.reset();
+            if (!writeSilence(SINK_PREFILL_FRAMES + mDelayFrames))
+            {
+                mLostFrames += block->frames;
+                continue;
+            }
+        }
+
+        const uint8_t *in = block.data();
+        uint8_t *out = reinterpret_cast<uint8_t*>(converted);
+        const int frames = swr_convert(mSwr, &out, SINK_CONVERT_FRAMES, &in, block->frames);
+        block.reset();
+
+        if (frames <= 0 || !writeFrames(converted, frames))
+            continue;
+
+        mFramesPlayed += frames;
+
+        snd_pcm_sframes_t delay = 0;
+        if (snd_pcm_delay(mPcm, &delay) < 0)
+            delay = 0;
+        mDeviceDelayFrames = static_cast<int>(delay);
+
+        const int queued = std::max(0, mQueuedBlocks.load()) * AUDIO_BLOCK_FRAMES + static_cast<int>(delay);
+        if (mDriftCompensator.update(queued, frames))
+            mDriftCompensator.applyTo(mSwr);
+    }
+
+    closeDevice();
+    swr_free(&mSwr);
+    delete[] converted;
+    delete[] mSilence;
+    mSilence = nullptr;
+}
+
+QString AlsaSink::describe() const
+{
+    return QString("Extra sink %1: %2, %3 frames played, %4 blocks dropped, %5 frames lost, %6 xruns, delay %7 ms, drift %8 ppm, correction %9 ppm")
+            .arg(mConfig.device).arg(mOpen ? "open" : "closed").arg(mFramesPlayed).arg(mDroppedBlocks).arg(mLostFrames).arg(mXruns)
+            .arg(mDeviceDelayFrames * 1000 / OUTPUT_SAMPLE_RATE).arg(mDriftCompensator.driftPpm(), 0, 'f', 1)
+            .arg(mDriftCompensator.correctionPpm(), 0, 'f', 1);
+}
+
+/**
+ * @param playbackRealtime the scheduling of the primary playback thread; the writers get one priority below it.
+ * @param threadSuffix to tell the writers of several pipelines apart.
+ */
+AlsaFanout::AlsaFanout(AudioBlockPool &pool, const QList<ExtraSinkConfig> &sinks, const ThreadRealtimeSettings &playbackRealtime,
+                       const QString &threadSuffix) :
+    mPool(pool),
+    mPoolExhaustedFrames(0)
+{
+    ThreadRealtimeSettings realtime = playbackRealtime;
+    realtime.priority = std::max(1, realtime.priority - 1);
+    realtime.cpu = -1;
+
+    for (int i = 0; i < sinks.size(); i++)
+        mSinks.push_back(new AlsaSink(sinks.at(i), realtime, QString("Sink %1%2").arg(i + 1).arg(threadSuffix)));
+}
+
+AlsaFanout::~AlsaFanout()
+{
+    stop();
+    mCurrent.reset();
+
+    for (AlsaSink *sink : mSinks)
+        delete sink;
+}
+
+void AlsaFanout::start()
+{
+    for (AlsaSink *sink : mSinks)
+        sink->start();
+}
+
+void AlsaFanout::stop()
+{
+    for (AlsaSink *sink : mSinks)
+        sink->stop();
+}
+
+QString AlsaFanout::describe() const
+{
+    QStringList lines;
+    for (const AlsaSink *sink : mSinks)
+        lines << sink->describe();
+    if (mPoolExhaustedFrames > 0)
+        lines << QString("Extra sinks: %1 frames dropped because they used their share of the block pool").arg(mPoolExhaustedFrames);
+    return lines.join('\n');
+}
+
+/**
+ * @brief AlsaFanout::publishCurrent hands the block being filled to all sinks. Sinks that take it, take a reference.
+ */
+void AlsaFanout::publishCurrent()
+{
+    if (mCurrent.isNull())
+        return;
+
+    if (mCurrent->frames > 0)
+    {
+        for (AlsaSink *sink : mSinks)
+        {
+            AudioBlockRef reference = mCurrent;
+            sink->push(reference);
+        }
+    }
+
+    mCurrent.reset();
+}
+
+/**
+ * @brief AlsaFanout::beginPath sends what's left of the previous path, so no block has two formats. Called from the playback thread.
+ */
+void AlsaFanout::beginPath(int channels)
+{
+    publishCurrent();
+    mChannels = channels;
+    mPath++;
+}
+
+/**
+ * @brief AlsaFanout::write copies the samples into pooled blocks, and passes them on when full. Never blocks.
+ */
+void AlsaFanout::write(const int16_t *samples, int frames)
+{
+    if (mChannels <= 0)
+        return;
+
+    while (frames > 0)
+    {
+        if (mCurrent.isNull())
+        {
+            mCurrent = mPool.acquire(SINK_POOL_RESERVE_BLOCKS);
+            if (mCurrent.isNull())
+            {
+                mPoolExhaustedFrames += frames;
+                return;
+            }
+            mCurrent->channels = mChannels;
+            mCurrent->path = mPath;
+        }
+
+        const int chunk = std::min(frames, AUDIO_BLOCK_FRAMES - mCurrent->frames);
+        memcpy(mCurrent.samples() + mCurrent->frames * mChannels, samples, chunk * mChannels * sizeof(int16_t));
+        mCurrent->frames += chunk;
+        samples += chunk * mChannels;
+        frames -= chunk;
+
+        if (mCurrent->frames == AUDIO_BLOCK_FRAMES)
+            publishCurrent();
+    }
+}
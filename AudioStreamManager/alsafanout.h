@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef ALSAFANOUT_H
+#define ALSAFANOUT_H
+
+#include <QString>
+#include <QList>
+#include <QElapsedTimer>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <alsa/asoundlib.h>
+
+#include "outputtap.h"
+#include "audioblockpool.h"
+#include "driftcompensator.h"
+#include "runtimeconfig.h"
+#include "realtime.h"
+
+#define SINK_QUEUE_BLOCKS 64 // About 340 ms per sink; must be a power of two.
+#define SINK_BUFFER_US 100000 // USB DACs want more than the TDM output.
+#define SINK_PERIODS 4
+#define SINK_PREFILL_FRAMES 2400 // Silence when the device (re)starts, so the bursts from the primary output don't make it run dry.
+#define SINK_CONVERT_FRAMES (AUDIO_BLOCK_FRAMES * 2) // Drift compensation makes a bit more than went in.
+#define SINK_REOPEN_INTERVAL_MS 1000 // How often an unplugged device is tried again.
+#define SINK_STALL_TIMEOUT_MS 1000 // A device that takes nothing for this long is closed, and tried again later.
+#define SINK_POOL_RESERVE_BLOCKS 16 // Left in the pool for the capture and playback paths; the extra sinks can't have them.
+
+/**
+ * @brief The AlsaSink class plays the fanned out blocks on one extra device, in its own writer thread.
+ *
+ * The device has its own clock, and the blocks come at the pace of the primary output. So, like the primary playback
+ * path, it goes through swresample with a DriftCompensator, which keeps what's queued for the device constant. That
+ * locks it to the primary output, with a fixed offset: the device buffer, the prefill and the configured delay. The
+ * same swresample context mixes the output down (or up) to the channels of the device.
+ */
+class AlsaSink
+{
+    const ExtraSinkConfig mConfig;
+    const ThreadRealtimeSettings mRealtime;
+    const QString mThreadName;
+    const int mDelayFrames;
+
+    LockFreeQueue<AudioBlock*, SINK_QUEUE_BLOCKS> mQueue;
+    std::atomic<int> mQueuedBlocks;
+    int mWakeFd = -1;
+    std::atomic<bool> mWriterIdle;
+    std::atomic<bool> mStop;
+    std::thread mThread;
+
+    // Only touched by the writer thread.
+    snd_pcm_t *mPcm = nullptr;
+    SwrContext *mSwr = nullptr;
+    int16_t *mSilence = nullptr;
+    int mInChannels = 0;
+    uint32_t mPath = 0;
+    bool mNeedsPrefill = false;
+    bool mOpenFailureReported = false;
+    QElapsedTimer mReopenTimer;
+    DriftCompensator mDriftCompensator;
+
+    std::atomic<bool> mOpen;
+    std::atomic<quint64> mFramesPlayed;
+    std::atomic<quint64> mDroppedBlocks;
+    std::atomic<quint64> mLostFrames;
+    std::atomic<quint64> mXruns;
+    std::atomic<int> mDeviceDelayFrames;
+
+    bool openDevice();
+    void closeDevice();
+    bool setupConverter(int inChannels);
+    bool writeFrames(const int16_t *samples, int frames);
+    bool writeSilence(int frames);
+    AudioBlockRef waitForBlock();
+    void writerLoop();
+
+public:
+    AlsaSink(const ExtraSinkConfig &config, const ThreadRealtimeSettings &realtime, const QString &threadName);
+    ~AlsaSink();
+
+    void start();
+    void stop();
+    bool push(AudioBlockRef &block);
+    QString describe() const;
+};
+
+/**
+ * @brief The AlsaFanout class plays the output on extra devices, next to the primary one, like a USB DAC for a second zone.
+ *
+ * The playback thread copies the output once, into blocks from the pipeline's pool, and hands every block to all sinks by
+ * reference. Each sink has its own queue and writer thread. When a sink can't keep up, or its device is gone, its queue
+ * fills up and it loses blocks; the primary output never waits for it.
+ *
+ * A stalled sink holds up to SINK_QUEUE_BLOCKS blocks until its device is closed, so a few of them can hold most of the
+ * pool. The fan-out only gets a block while more than SINK_POOL_RESERVE_BLOCKS are free. When the sinks have the rest,
+ * the audio is dropped for the extra sinks, and the capture and playback paths still get their blocks.
+ */
+class AlsaFanout : public OutputTap
+{
+    AudioBlockPool &mPool;
+    std::vector<AlsaSink*> mSinks;
+
+    // Only touched by the playback thread.
+    AudioBlockRef mCurrent;
+    int mChannels = 0;
+    uint32_t mPath = 0;
+
+    std::atomic<quint64> mPoolExhaustedFrames;
+
+    void publishCurrent();
+
+public:
+    AlsaFanout(AudioBlockPool &pool, const QList<ExtraSinkConfig> &sinks, const ThreadRealtimeSettings &playbackRealtime, const QString &threadSuffix);
+    ~AlsaFanout();
+
+    void start();
+    void stop();
+    QString describe() const;
+
+    void beginPath(int channels) override;
+    void write(const int16_t *samples, int frames) override;
+};
+
+#endif // ALSAFANOUT_H
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "alsareactor.h"
+#include "annotatedexception.h"
+#include <QMutexLocker>
+#include <algorithm>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <time.h>
+
+// The epoll data is the registration id with the index of the descriptor in the lower bits. Id 0 is the wake-up eventfd.
+#define FD_INDEX_BITS 8
+
+static quint64 monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<quint64>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+AlsaReactor::AlsaReactor() :
+    mEpollFd(epoll_create1(EPOLL_CLOEXEC)),
+    mWakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    mWakeups(0),
+    mBusyNs(0),
+    mMaxBusyNs(0)
+{
+    if (mEpollFd < 0 || mWakeFd < 0)
+        throw AnnotatedException(QString("Can't create epoll or eventfd: %1").arg(strerror(errno)));
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeFd, &ev);
+}
+
+AlsaReactor::~AlsaReactor()
+{
+    for (Registration *registration : mRegistrations)
+        delete registration;
+    mRegistrations.clear();
+
+    close(mWakeFd);
+    close(mEpollFd);
+}
+
+void AlsaReactor::add(snd_pcm_t *pcm, Handler handler)
+{
+    QMutexLocker locker(&mMutex);
+
+    Registration *registration = new Registration;
+    registration->id = mNextId++;
+    registration->pcm = pcm;
+    registration->handler = handler;
+    registration->armed = true;
+
+    const int count = snd_pcm_poll_descriptors_count(pcm);
+    registration->pollFds.resize(std::max(0, count));
+    snd_pcm_poll_descriptors(pcm, registration->pollFds.data(), registration->pollFds.size());
+
+    for (int i = 0; i < registration->pollFds.size(); i++)
+    {
+        struct epoll_event ev;
+        ev.events = registration->pollFds.at(i).events;
+        ev.data.u64 = (registration->id << FD_INDEX_BITS) | i;
+        epoll_ctl(mEpollFd, EPOLL_CTL_ADD, registration->pollFds.at(i).fd, &ev);
+    }
+
+    mRegistrations.insert(registration->id, registration);
+}
+
+void AlsaReactor::remove(snd_pcm_t *pcm)
+{
+    QMutexLocker locker(&mMutex);
+
+    for (auto it = mRegistrations.begin(); it != mRegistrations.end(); ++it)
+    {
+        Registration *registration = it.value();
+        if (registration->pcm != pcm)
+            continue;
+
+        for (const struct pollfd &pfd : registration->pollFds)
+            epoll_ctl(mEpollFd, EPOLL_CTL_DEL, pfd.fd, nullptr);
+
+        mRegistrations.erase(it);
+        delete registration;
+        return;
+    }
+}
+
+/**
+ * @brief AlsaReactor::wake makes run() look at all PCMs again. Lock-free, so it can be called from audio threads.
+ */
+void AlsaReactor::wake()
+{
+    const uint64_t one = 1;
+    ssize_t ret = write(mWakeFd, &one, sizeof(one));
+    Q_UNUSED(ret)
+}
+
+void AlsaReactor::setArmed(Registration *registration, bool armed)
+{
+    if (registration->armed == armed)
+        return;
+
+    registration->armed = armed;
+
+    for (int i = 0; i < registration->pollFds.size(); i++)
+    {
+        struct epoll_event ev;
+        ev.events = armed ? registration->pollFds.at(i).events : 0; // Errors and hang-ups are always reported.
+        ev.data.u64 = (registration->id << FD_INDEX_BITS) | i;
+        epoll_ctl(mEpollFd, EPOLL_CTL_MOD, registration->pollFds.at(i).fd, &ev);
+    }
+}
+
+void AlsaReactor::rearmAll()
+{
+    for (Registration *registration : mRegistrations)
+        setArmed(registration, true);
+}
+
+void AlsaReactor::dispatch(quint64 id, int fdIndex, uint32_t events)
+{
+    // Removed after epoll_wait() returned it.
+    Registration *registration = mRegistrations.value(id, nullptr);
+    if (!registration || fdIndex >= registration->pollFds.size())
+        return;
+
+    for (int i = 0; i < registration->pollFds.size(); i++)
+        registration->pollFds[i].revents = i == fdIndex ? static_cast<short>(events) : 0;
+
+    unsigned short revents = 0;
+    snd_pcm_poll_descriptors_revents(registration->pcm, registration->pollFds.data(), registration->pollFds.size(), &revents);
+
+    if (revents == 0)
+        return;
+
+    const bool wantMore = registration->handler(revents);
+    setArmed(registration, wantMore);
+}
+
+void AlsaReactor::run(const StopToken &stop)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (!stop.stopRequested())
+    {
+        const int n = epoll_wait(mEpollFd, events, REACTOR_MAX_EVENTS, REACTOR_TIMEOUT_MS);
+
+        if (n <= 0)
+            continue;
+
+        const quint64 start = monotonicNs();
+
+        QMutexLocker locker(&mMutex);
+
+        for (int i = 0; i < n; i++)
+        {
+            const quint64 data = events[i].data.u64;
+
+            if (data == 0)
+            {
+                uint64_t count;
+                ssize_t ret = read(mWakeFd, &count, sizeof(count));
+                Q_UNUSED(ret)
+                rearmAll();
+                continue;
+            }
+
+            dispatch(data >> FD_INDEX_BITS, static_cast<int>(data & ((1 << FD_INDEX_BITS) - 1)), events[i].events);
+        }
+
+        locker.unlock();
+
+        const quint64 busy = monotonicNs() - start;
+        mWakeups++;
+        mBusyNs += busy;
+        if (busy > mMaxBusyNs)
+            mMaxBusyNs = busy;
+    }
+}
+
+quint64 AlsaReactor::wakeups() const
+{
+    return mWakeups;
+}
+
+quint64 AlsaReactor::busyNs() const
+{
+    return mBusyNs;
+}
+
+/**
+ * @brief AlsaReactor::takeMaxBusyNs returns the longest time spent on one wake-up since the last call.
+ */
+quint64 AlsaReactor::takeMaxBusyNs()
+{
+    return mMaxBusyNs.exchange(0);
+}
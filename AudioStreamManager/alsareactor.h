@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef ALSAREACTOR_H
+#define ALSAREACTOR_H
+
+#include <QMutex>
+#include <QHash>
+#include <QVector>
+#include <atomic>
+#include <functional>
+#include <poll.h>
+#include <alsa/asoundlib.h>
+
+#include "stoptoken.h"
+
+#define REACTOR_MAX_EVENTS 8
+#define REACTOR_TIMEOUT_MS 10 // Just to see a stop request when nobody calls wake().
+
+/**
+ * @brief The AlsaReactor class waits on the poll descriptors of ALSA PCMs with epoll, and calls a handler when one is ready.
+ *
+ * The capture and playback device are both driven from the one thread that runs run(), which wakes up exactly when a period
+ * can be read or written, instead of blocking in snd_pcm_readi() or blindly calling snd_pcm_writei().
+ *
+ * A handler returns whether it wants to be called again when the PCM is ready. A playback handler that has nothing to write
+ * returns false, and its PCM is left out until the next wake(), which producers call when they have new data. Otherwise, an
+ * idle playback device that has room would wake us continuously.
+ *
+ * add() and remove() can be called from any thread. After remove() returns, the handler is not called anymore.
+ */
+class AlsaReactor
+{
+public:
+    typedef std::function<bool(unsigned short revents)> Handler;
+
+private:
+    struct Registration
+    {
+        quint64 id;
+        snd_pcm_t *pcm;
+        Handler handler;
+        QVector<struct pollfd> pollFds;
+        bool armed;
+    };
+
+    int mEpollFd;
+    int mWakeFd;
+    QMutex mMutex; // Guards the registrations; only contended when adding or removing.
+    QHash<quint64, Registration*> mRegistrations;
+    quint64 mNextId = 1;
+
+    std::atomic<quint64> mWakeups;
+    std::atomic<quint64> mBusyNs;
+    std::atomic<quint64> mMaxBusyNs;
+
+    void setArmed(Registration *registration, bool armed);
+    void dispatch(quint64 id, int fd, uint32_t events);
+    void rearmAll();
+
+public:
+    AlsaReactor();
+    ~AlsaReactor();
+
+    void add(snd_pcm_t *pcm, Handler handler);
+    void remove(snd_pcm_t *pcm);
+    void wake();
+    void run(const StopToken &stop);
+
+    quint64 wakeups() const;
+    quint64 busyNs() const;
+    quint64 takeMaxBusyNs();
+};
+
+#endif // ALSAREACTOR_H
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "audioblockpool.h"
+#include <stdlib.h>
+#include <new>
+
+/**
+ * @brief AudioBlockRef::AudioBlockRef takes over a reference the caller has, like one taken out of another handle.
+ */
+AudioBlockRef::AudioBlockRef(AudioBlock *adopted) :
+    mBlock(adopted)
+{
+
+}
+
+AudioBlockRef::AudioBlockRef(const AudioBlockRef &other) :
+    mBlock(other.mBlock)
+{
+    // The other handle keeps its reference while we're here, so relaxed is enough, like for shared pointers.
+    if (mBlock)
+        mBlock->references.fetch_add(1, std::memory_order_relaxed);
+}
+
+AudioBlockRef::AudioBlockRef(AudioBlockRef &&other) :
+    mBlock(other.mBlock)
+{
+    other.mBlock = nullptr;
+}
+
+AudioBlockRef::~AudioBlockRef()
+{
+    reset();
+}
+
+AudioBlockRef &AudioBlockRef::operator=(AudioBlockRef other)
+{
+    AudioBlock *block = other.mBlock;
+    other.mBlock = mBlock;
+    mBlock = block;
+    return *this;
+}
+
+void AudioBlockRef::reset()
+{
+    if (mBlock)
+        mBlock->pool->release(mBlock);
+    mBlock = nullptr;
+}
+
+/**
+ * @brief AudioBlockRef::take gives up the handle's reference without releasing it, so whoever gets the pointer owns it.
+ */
+AudioBlock *AudioBlockRef::take()
+{
+    AudioBlock *block = mBlock;
+    mBlock = nullptr;
+    return block;
+}
+
+AudioBlockPool::AudioBlockPool() :
+    mBlocks(nullptr),
+    mInUse(0),
+    mHighWater(0),
+    mExhausted(0)
+{
+    void *memory = nullptr;
+    if (posix_memalign(&memory, AUDIO_BLOCK_ALIGNMENT, sizeof(AudioBlock) * AUDIO_BLOCK_POOL_BLOCKS) != 0)
+        throw std::bad_alloc();
+
+    mBlocks = static_cast<AudioBlock*>(memory);
+
+    // Zeroing all blocks also makes the pages resident, so they're locked along with the rest when mlockall() is on.
+    for (int i = 0; i < AUDIO_BLOCK_POOL_BLOCKS; i++)
+    {
+        AudioBlock *block = new (&mBlocks[i]) AudioBlock();
+        block->pool = this;
+        mFree.push(block);
+    }
+}
+
+/**
+ * @brief AudioBlockPool::~AudioBlockPool must come after all handles are gone.
+ */
+AudioBlockPool::~AudioBlockPool()
+{
+    free(mBlocks);
+}
+
+/**
+ * @param reserve blocks to leave in the pool for others; a block is only handed out when more than this are free.
+ * @return a handle with the only reference to a block, or a null handle when they're all in use, or the rest is reserved.
+ */
+AudioBlockRef AudioBlockPool::acquire(int reserve)
+{
+    // Counted before taking the block, so two threads can't both take the last one above the reserve.
+    const int inUse = ++mInUse;
+    if (inUse > AUDIO_BLOCK_POOL_BLOCKS - reserve)
+    {
+        mInUse--;
+        return AudioBlockRef();
+    }
+
+    AudioBlock *block = nullptr;
+    if (!mFree.pop(block))
+    {
+        mInUse--;
+        mExhausted++;
+        return AudioBlockRef();
+    }
+
+    block->references.store(1, std::memory_order_relaxed);
+    block->channels = 0;
+    block->frames = 0;
+    block->path = 0;
+
+    int highWater = mHighWater;
+    while (inUse > highWater && !mHighWater.compare_exchange_weak(highWater, inUse))
+    {
+    }
+
+    return AudioBlockRef(block);
+}
+
+/**
+ * @brief AudioBlockPool::release drops a reference; the last one puts the block back. AudioBlockRef does this.
+ */
+void AudioBlockPool::release(AudioBlock *block)
+{
+    // Acquire-release, so the last user's reads are done before the block can be written again.
+    if (block->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        mInUse--;
+        mFree.push(block);
+    }
+}
+
+int AudioBlockPool::capacity() const
+{
+    return AUDIO_BLOCK_POOL_BLOCKS;
+}
+
+int AudioBlockPool::inUse() const
+{
+    return mInUse;
+}
+
+/**
+ * @brief AudioBlockPool::highWater is the most blocks that were in use at the same time.
+ */
+int AudioBlockPool::highWater() const
+{
+    return mHighWater;
+}
+
+/**
+ * @brief AudioBlockPool::exhaustedCount counts the times there was no block to give.
+ */
+quint64 AudioBlockPool::exhaustedCount() const
+{
+    return mExhausted;
+}
+
+QString AudioBlockPool::describe() const
+{
+    return QString("Block pool: %1 of %2 blocks in use, at most %3, ran out %4 times").arg(mInUse).arg(AUDIO_BLOCK_POOL_BLOCKS)
+            .arg(mHighWater).arg(mExhausted);
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef AUDIOBLOCKPOOL_H
+#define AUDIOBLOCKPOOL_H
+
+#include <QString>
+#include <atomic>
+#include <stdint.h>
+
+#include "lockfreequeue.h"
+#include "speakerlayout.h"
+
+#define AUDIO_BLOCK_ALIGNMENT 64 // Cache line of the Cortex-A8, and of most other CPUs.
+#define AUDIO_BLOCK_FRAMES 256 // Of output, at the maximum channel count.
+#define AUDIO_BLOCK_SAMPLES (AUDIO_BLOCK_FRAMES * MAX_OUTPUT_CHANNELS)
+#define AUDIO_BLOCK_BYTES (AUDIO_BLOCK_SAMPLES * 2)
+#define AUDIO_BLOCK_POOL_BLOCKS 256 // Per pipeline; must be a power of two.
+
+class AudioBlockPool;
+
+/**
+ * @brief A block of audio, shared by reference between the threads that need it. Use it through AudioBlockRef.
+ *
+ * The header has a cache line of its own, so updating the references doesn't disturb the threads that use the samples.
+ */
+struct alignas(AUDIO_BLOCK_ALIGNMENT) AudioBlock
+{
+    AudioBlockPool *pool;
+    std::atomic<int> references;
+    int channels;
+    int frames;
+    uint32_t path; // Counts playback paths, so users know when the format may have changed.
+    alignas(AUDIO_BLOCK_ALIGNMENT) int16_t samples[AUDIO_BLOCK_SAMPLES];
+};
+
+/**
+ * @brief The AudioBlockRef class holds one reference to a pooled block; copies share the block, and the last one gives it back.
+ *
+ * To pass a block through a queue of pointers, take() the reference out of the handle, and adopt it again on the other side.
+ */
+class AudioBlockRef
+{
+    AudioBlock *mBlock = nullptr;
+
+public:
+    AudioBlockRef() {}
+    explicit AudioBlockRef(AudioBlock *adopted);
+    AudioBlockRef(const AudioBlockRef &other);
+    AudioBlockRef(AudioBlockRef &&other);
+    ~AudioBlockRef();
+
+    AudioBlockRef &operator=(AudioBlockRef other);
+
+    void reset();
+    AudioBlock *take();
+    bool isNull() const { return !mBlock; }
+    AudioBlock *get() const { return mBlock; }
+    AudioBlock *operator->() const { return mBlock; }
+    int16_t *samples() const { return mBlock->samples; }
+    uint8_t *data() const { return reinterpret_cast<uint8_t*>(mBlock->samples); }
+};
+
+/**
+ * @brief The AudioBlockPool class hands out fixed size audio blocks, for the buffers between the stages of a pipeline.
+ *
+ * All blocks are allocated, aligned and touched up front, so with the memory locked, no audio thread allocates or takes a
+ * page fault for them. Getting and giving back blocks doesn't lock, so any thread can do it. Optional users, like the extra
+ * sinks, ask with a reserve, so they can't take the last blocks the stages of the pipeline itself need. The amount in use
+ * and the most ever in use are kept, to see how close to running out it gets.
+ */
+class AudioBlockPool
+{
+    AudioBlock *mBlocks;
+    LockFreeQueue<AudioBlock*, AUDIO_BLOCK_POOL_BLOCKS> mFree;
+
+    std::atomic<int> mInUse;
+    std::atomic<int> mHighWater;
+    std::atomic<quint64> mExhausted;
+
+public:
+    AudioBlockPool();
+    ~AudioBlockPool();
+
+    AudioBlockRef acquire(int reserve = 0);
+    void release(AudioBlock *block);
+
+    int capacity() const;
+    int inUse() const;
+    int highWater() const;
+    quint64 exhaustedCount() const;
+    QString describe() const;
+};
+
+#endif // AUDIOBLOCKPOOL_H
@@ -18,63 +18,216 @@
  */
 
 #include <QMutexLocker>
+#include <QFile>
 
 #include "audioringbuffer.h"
+#include "decoderselection.h"
+#include "startuptrace.h"
+#include "tracer.h"
+#include "annotatedexception.h"
 #include <iostream>
 #include <time.h>
 #include <sys/sysinfo.h>
+#include <cmath>
+#include <algorithm>
+
+static std::atomic<int> playbackWorkersAlive(0);
+static std::atomic<unsigned int> playbackWorkersCreated(0);
+
+static qint64 monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<qint64>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
 
 int readFromCircularBuffer(void *opaque, uint8_t *buf, int buf_size)
 {
     PlaybackWorker *a = (PlaybackWorker*)opaque;
 
+    if (a->mStop.stopRequested())
+        return AVERROR_EXIT;
+
     // If you don't do this, ffmpeg will keep reading PCM and waiting until it sees valid codec frames again.
-    if (!a->mRingBuffer.DIR9001SeesEncodedAudio())
+    if (!a->mRingBuffer.sourceSeesEncodedAudio())
         return -1;
 
-    int bytesRead = a->mRingBuffer.circularBufferToDecodeBuffer(buf, buf_size);
+    int bytesRead = a->mRingBuffer.circularBufferToDecodeBuffer(buf, buf_size, a->mStop);
+    if (bytesRead < 0)
+        return AVERROR_EXIT;
     return bytesRead;
 }
 
+/**
+ * @brief interruptFFMpeg makes ffmpeg's own loops, like in avformat_find_stream_info(), stop when the worker must stop.
+ */
+static int interruptFFMpeg(void *opaque)
+{
+    PlaybackWorker *a = static_cast<PlaybackWorker*>(opaque);
+    return a->mStop.stopRequested() ? 1 : 0;
+}
+
 CaptureWorker::CaptureWorker(AudioRingBuffer &ringBuffer) :
     mRingBuffer(ringBuffer)
 {
 
 }
 
-AudioRingBuffer::AudioRingBuffer(GpIOFunctions &gpIOFunctions, QObject *parent) : QObject(parent),
+AudioRingBuffer::AudioRingBuffer(GpIOFunctions &gpIOFunctions, const Settings &settings, QObject *parent) : QObject(parent),
     mGpPIOFunctions(gpIOFunctions),
+    mConfig(settings.runtime),
+    mFramesInBuffer(settings.runtime.framesInBuffer),
+    mRingBufferSize(settings.runtime.ringBufferSize),
     capture_handle(NULL),
-    playback_handle(NULL),
     mCaptureWorker(*this),
     mCaptureThread(),
-    buffer(new char[RING_BUFFER_SIZE]),
-    freeBytes(RING_BUFFER_SIZE),
+    buffer(new char[mRingBufferSize]),
+    mConsumedBytes(0),
+    freeBytes(mRingBufferSize),
     usedBytes(),
     captureFrameSize(snd_pcm_format_width(SND_PCM_FORMAT_S16_LE) / 8 * 2),
     mPlaybackWorker(NULL),
-    mPlaybackThread(new QThread())
+    mPlaybackThread(new QThread()),
+    mOutputStage(mReactor, mXrunRecovery, settings.runtime.playbackDevice, settings.fadeMs, settings.transitionSilenceMs, settings.runtime.latency.periods),
+    mCaptureDroppedFrames(0),
+    mSpeakerLayout(SpeakerLayout::fromName(settings.speakerLayout)),
+    mPreferFixedPointDecoders(settings.preferFixedPointDecoders),
+    mCaptureRealtime(settings.captureRealtime),
+    mPlaybackRealtime(settings.playbackRealtime),
+    mSwitchStartedNs(0),
+    mLastSwitchUs(0),
+    mMaxSwitchUs(0),
+    mSwitches(0),
+    mSlowSwitches(0),
+    mMixerControl(settings.runtime.mixerCard, QStringList() << "Ch 1/2" << "Ch 3/4" << "Ch 5/6" << "Ch 7/8"),
+    mUserMuted(false),
+    mVolume(settings.runtime.volume),
+    mStartupTargetMs(settings.startupTargetMs),
+    mTraceDirectory(settings.traceDirectory),
+    mTraceSeconds(settings.traceSeconds)
 {
-    this->selem_name << "Ch 1/2" << "Ch 3/4" << "Ch 5/6" << "Ch 7/8";
+    StartupPhase phase("audio setup");
+
+    // The devices are checked before any thread starts, so a device that isn't there fails the whole build, and a reload
+    // can go back to the previous config.
+    try
+    {
+        if (settings.replayScript.isEmpty())
+            mOutputStage.checkDevice(mSpeakerLayout.outputChannels(), mConfig.latency.decodedPlaybackBufferUs);
+        if (settings.replayScript.isEmpty() && mConfig.networkSource.isEmpty())
+            initCaptureDevice();
+    }
+    catch (AnnotatedException &)
+    {
+        delete[] buffer;
+        throw;
+    }
 
-    mPlaybackThread.setObjectName("Decode/Playback");
-    mCaptureThread.setObjectName("Capture");
+    if (!settings.rtpDestination.isEmpty())
+    {
+        mRtpSender.reset(new RtpSender(settings.rtpDestination, settings.rtpFormat, settings.rtpMtu, settings.rtpTtl, settings.rtpInterface,
+                                       mSpeakerLayout.outputChannels(), [this]() { return consumedCaptureFrames(); }));
+        mRtpSender->start();
+        mOutputStage.addTap(mRtpSender.data());
+
+        const QString sdp = mRtpSender->sdp();
+        std::cout << "Sending RTP, SDP:" << std::endl << sdp.toLatin1().data();
+        if (!settings.rtpSdpFile.isEmpty())
+        {
+            QFile sdpFile(settings.rtpSdpFile);
+            if (sdpFile.open(QIODevice::WriteOnly | QIODevice::Truncate))
+                sdpFile.write(sdp.toLatin1());
+            else
+                std::cerr << "Can't write SDP to " << settings.rtpSdpFile.toLatin1().data() << std::endl;
+        }
+    }
+
+    if (!settings.replayScript.isEmpty())
+    {
+        // Take the switch time from the format change itself, and stop the worker the way the GPIO signal does.
+        auto formatChanged = [this](bool encoded)
+        {
+            markSwitchStart();
+            QMetaObject::invokeMethod(this, "onAudioFormatChanged", Qt::QueuedConnection, Q_ARG(bool, encoded));
+        };
+
+        mOutputStage.setNullDevice(true);
+        mCaptureSource.reset(new ReplaySource(settings.replayScript, settings.replaySeconds, settings.replaySpeed,
+                                              [this](const char *data, int bytes) { return writeToCircularBuffer(data, bytes); },
+                                              [this]() { return freeBytes.available(); }, formatChanged));
+    }
+    else if (!mConfig.networkSource.isEmpty())
+    {
+        mCaptureSource.reset(new NetworkSource(mConfig.networkSource, settings.networkProtocol, settings.networkJitterMs,
+                                               [this](const char *data, int bytes) { return writeToCircularBuffer(data, bytes); }));
+    }
+
+    if (settings.recordEnabled || !settings.recordDirectory.isEmpty())
+    {
+        QString directory = settings.recordDirectory.isEmpty() ? RECORDER_DEFAULT_DIRECTORY : settings.recordDirectory;
+        if (!settings.pipelineName.isEmpty())
+            directory += "/" + settings.pipelineName;
+        mRecorder.reset(new BitstreamRecorder(directory, settings.recordFileMb, settings.recordMaxMb, settings.recordOutput));
+        mRecorder->start(settings.recordEnabled, settings.lockMemory);
+        mOutputStage.addTap(mRecorder.data());
+        std::cout << "Recorder " << (settings.recordEnabled ? "on" : "off") << ", in " << directory.toLatin1().data() << "; SIGRTMIN switches it." << std::endl;
+    }
+
+    if (!settings.shmOutput.isEmpty())
+    {
+        mShmOutput.reset(new ShmOutput(settings.shmOutput));
+        mShmOutput->start();
+        mOutputStage.addTap(mShmOutput.data());
+        std::cout << "Publishing the output in shared memory " << settings.shmOutput.toLatin1().data() << std::endl;
+    }
+
+    // Replays run faster than real time, so they'd only make the extra sinks drop.
+    if (!mConfig.extraSinks.isEmpty() && settings.replayScript.isEmpty())
+    {
+        mFanout.reset(new AlsaFanout(mBlockPool, mConfig.extraSinks, settings.playbackRealtime,
+                                     settings.pipelineName.isEmpty() ? QString() : " " + settings.pipelineName));
+        mFanout->start();
+        mOutputStage.addTap(mFanout.data());
+        for (const ExtraSinkConfig &sink : mConfig.extraSinks)
+            std::cout << "Also playing on " << qPrintable(sink.describe()) << std::endl;
+    }
+
+    mMixerControl.start();
+    connect(&mMixerControl, &MixerControl::muteChanged, this, &AudioRingBuffer::alsaMuteChanged);
+    connect(&mMixerControl, &MixerControl::muteApplied, this, &AudioRingBuffer::alsaMuteApplied);
+
+    // Thread names are cut off at 15 characters, so those of named pipelines are short.
+    mPlaybackThread.setObjectName(settings.pipelineName.isEmpty() ? QString("Decode/Playback") : "Play " + settings.pipelineName);
+    mCaptureThread.setObjectName(settings.pipelineName.isEmpty() ? QString("Capture") : "Capture " + settings.pipelineName);
     mPlaybackThread.start();
     mCaptureThread.start();
 
     avcodec_register_all();
     av_register_all();
 
-    mCaptureBuffer = malloc(FRAMES_IN_BUFFER * captureFrameSize);
+    std::cout << (settings.latencyProfileLoaded ? "Calibrated latency: " : "Default latency: ") << qPrintable(settings.latency.describe()) << std::endl;
+    std::cout << "Config" << (settings.runtimeConfigLoaded ? QString(" from %1").arg(settings.configPath) : QString()).toLatin1().data()
+              << ": " << qPrintable(mConfig.describe()) << std::endl;
+
+    applyVolume();
+    mCaptureBlock = mBlockPool.acquire();
+    mCaptureChunkFrames = std::min(mFramesInBuffer, AUDIO_BLOCK_BYTES / captureFrameSize);
+
+    // With the memory locked, this makes sure the pages are actually there before the audio threads use them. The block
+    // pool already touched its memory.
+    if (settings.lockMemory)
+        prefault(buffer, mRingBufferSize);
 
     makePlaybackWorker();
 
-    initCaptureDevice();
+    if (mCaptureSource)
+        std::cout << "Not capturing from S/PDIF, but from the network or a replay." << std::endl;
     mCaptureWorker.moveToThread(&mCaptureThread);
 
     // This line, weirdly enough, causes the debugger to say SIGILL on every statement I break,
     // but the code itself seems to work.
     connect(&mGpPIOFunctions, &GpIOFunctions::signalAudioFormatChanged, this, &AudioRingBuffer::onAudioFormatChanged);
+    connect(&mOutputStage, &OutputStage::pathStarted, this, &AudioRingBuffer::onOutputPathStarted);
 
     printStatusTimer.setInterval(1000);
     connect(&printStatusTimer, &QTimer::timeout, this, &AudioRingBuffer::onStatusTimer);
@@ -83,40 +236,50 @@ AudioRingBuffer::AudioRingBuffer(GpIOFunctions &gpIOFunctions, QObject *parent)
     sampeRateCalculatorTimer.setInterval(1000);
     connect(&sampeRateCalculatorTimer, &QTimer::timeout, this, &AudioRingBuffer::onSampleRateCalculatorTimer);
     sampeRateCalculatorTimer.start();
-
-    giveUpOnMixer = false;
-    checkMixerError(snd_mixer_open(&mixer_handle, 0));
-    checkMixerError(snd_mixer_attach(mixer_handle, card));
-    checkMixerError(snd_mixer_selem_register(mixer_handle, nullptr, nullptr));
-    checkMixerError(snd_mixer_load(mixer_handle));
 }
 
 AudioRingBuffer::~AudioRingBuffer()
 {
-    free(mCaptureBuffer);
+    stopThreads();
+
+    // Otherwise the next pipeline, after a reload, can't open it.
+    if (capture_handle)
+        snd_pcm_close(capture_handle);
+
     delete[] buffer;
 
     if (mPlaybackWorker)
         mPlaybackWorker->deleteLater();
 
-    if (!giveUpOnMixer)
-    {
-        snd_mixer_close(mixer_handle);
-        mixer_handle = nullptr;
-    }
+    mMixerControl.stop();
 }
 
-void AudioRingBuffer::captureBufferToCircularBuffer(int bytes)
+/**
+ * @brief AudioRingBuffer::writeToCircularBuffer copies captured audio to the ring buffer, if it fits.
+ *
+ * This is the producer side, for both the capture device and the network source. The former runs in the reactor, which
+ * also feeds the playback device, so it can't wait for room.
+ */
+bool AudioRingBuffer::writeToCircularBuffer(const char *data, int bytes)
 {
-    char * captureBuffer = (char*)mCaptureBuffer;
-    freeBytes.acquire(bytes);
+    if (mRecorder)
+        mRecorder->recordCapture(data, bytes);
+
+    if (!freeBytes.tryAcquire(bytes))
+    {
+        mCaptureDroppedFrames += bytes / captureFrameSize;
+        return false;
+    }
+
     for (int i = 0; i < bytes; ++i)
     {
 
-        buffer[indexProducer++ % RING_BUFFER_SIZE] = captureBuffer[i];
+        buffer[indexProducer++ % mRingBufferSize] = data[i];
 
     }
     usedBytes.release(bytes);
+    StartupTrace::markFirstCapturedByte();
+    return true;
 }
 
 void AudioRingBuffer::onStatusTimer()
@@ -124,8 +287,69 @@ void AudioRingBuffer::onStatusTimer()
     QString line = QString("Buf size: %1").arg(usedBytes.available());
 #ifdef QT_DEBUG
     std::cout << line.toLatin1().data() << std::endl;
+    std::cout << "Clock drift: " << mDriftCompensator.driftPpm() << " ppm, correction: " << mDriftCompensator.correctionPpm() << " ppm" << std::endl;
+    std::cout << "Playback switches: " << mSwitches << ", last: " << mLastSwitchUs << " us, max: " << mMaxSwitchUs << " us, over "
+              << PLAYBACK_SWITCH_BOUND_MS << " ms: " << mSlowSwitches << std::endl;
+    std::cout << "Transitions: " << mOutputStage.transitionCount() << ", last: " << mOutputStage.lastTransitionMs() << " ms, max: " << mOutputStage.maxTransitionMs() << " ms" << std::endl;
+    std::cout << "Playback short writes: " << mOutputStage.shortWrites() << ", EAGAIN: " << mOutputStage.eagainCount()
+              << ", lost frames: " << mOutputStage.lostFrames() << std::endl;
+#endif
+
+    const quint64 xruns = mXrunRecovery.xrunCount();
+    const bool newXruns = xruns != mPrintedXruns;
+    if (newXruns)
+    {
+        for (const XrunEvent &event : mXrunRecovery.history(static_cast<int>(std::min<quint64>(xruns - mPrintedXruns, XRUN_HISTORY_SIZE))))
+            std::cerr << "Xrun: " << qPrintable(XrunRecovery::describe(event)) << std::endl;
+        mPrintedXruns = xruns;
+    }
+
+    const unsigned int toggleRequests = BitstreamRecorder::toggleRequests();
+    if (toggleRequests != mToggleRequestsSeen)
+    {
+        // An even number of requests since the last look leaves it as it was.
+        if (mRecorder && (toggleRequests - mToggleRequestsSeen) % 2)
+            mRecorder->setEnabled(!mRecorder->enabled());
+        mToggleRequestsSeen = toggleRequests;
+    }
+
+    // Dumping is done here, so the audio threads never do file I/O for it.
+    const bool dumpRequested = Tracer::takeDumpRequest();
+    if (dumpRequested || (newXruns && Tracer::enabled()))
+    {
+        const QString path = Tracer::dump(mTraceDirectory, dumpRequested ? "request" : "xrun", mTraceSeconds);
+        std::cout << (path.isEmpty() ? QString("Can't write trace to %1").arg(mTraceDirectory) : QString("Trace written to %1").arg(path)).toLatin1().data() << std::endl;
+    }
+
+    // The timer runs every second, so the differences are per second.
+    const quint64 wakeups = mReactor.wakeups();
+    const quint64 busyNs = mReactor.busyNs();
+    const quint64 newWakeups = wakeups - mLastReactorWakeups;
+    const quint64 avgUs = newWakeups > 0 ? (busyNs - mLastReactorBusyNs) / newWakeups / 1000 : 0;
+    const quint64 maxUs = mReactor.takeMaxBusyNs() / 1000;
+    mLastReactorWakeups = wakeups;
+    mLastReactorBusyNs = busyNs;
+#ifdef QT_DEBUG
+    std::cout << "Reactor: " << newWakeups << " wake-ups/s, " << avgUs << " us avg, " << maxUs << " us max per wake-up. Capture frames dropped: "
+              << mCaptureDroppedFrames << std::endl;
+    if (mRtpSender)
+        std::cout << mRtpSender->describe().toLatin1().data() << std::endl;
+    if (mCaptureSource)
+        std::cout << mCaptureSource->describe().toLatin1().data() << std::endl;
+    if (mRecorder)
+        std::cout << mRecorder->describe().toLatin1().data() << std::endl;
+    if (mShmOutput)
+        std::cout << mShmOutput->describe().toLatin1().data() << std::endl;
+    if (mFanout)
+        std::cout << mFanout->describe().toLatin1().data() << std::endl;
+    std::cout << mBlockPool.describe().toLatin1().data() << std::endl;
+#else
+    Q_UNUSED(avgUs)
+    Q_UNUSED(maxUs)
 #endif
     emit bufferBytesInfo(line);
+
+    StartupTrace::report(mStartupTargetMs);
 }
 
 /*!
@@ -142,7 +366,11 @@ void AudioRingBuffer::onSampleRateCalculatorTimer()
     QMutexLocker locker(&sampleRateCounterMutex);
     const uint samples = this->byteCounter / 4;
     this->byteCounter = 0;
-    this->phaseLocked = samples > 36000;
+    const bool wasLocked = this->phaseLocked;
+    this->phaseLocked = samples > static_cast<uint>(mConfig.lockThresholdSamples);
+
+    if (this->phaseLocked != wasLocked)
+        emit phaseLockChanged(this->phaseLocked);
 
 #ifdef QT_DEBUG
     QString line = QString("Samples: %1").arg(samples);
@@ -153,6 +381,10 @@ void AudioRingBuffer::onSampleRateCalculatorTimer()
 void AudioRingBuffer::onDecodingAborted()
 {
     std::cout << "Decoding loop stopped." << std::endl;
+
+    if (mShuttingDown)
+        return;
+
     makePlaybackWorker();
     QMetaObject::invokeMethod(mPlaybackWorker, "doWork");
 }
@@ -162,12 +394,78 @@ void AudioRingBuffer::onAudioFormatChanged(bool encoded)
     Q_UNUSED(encoded)
     std::cout << "Aborting, because we got signal AudioFormatChanged." << std::endl;
 
+    restartPlayback();
+}
+
+/**
+ * @brief AudioRingBuffer::restartPlayback stops the current playback worker; a new one is made when it has stopped.
+ */
+void AudioRingBuffer::restartPlayback()
+{
     if (mPlaybackWorker)
     {
-        mPlaybackWorker->mThisThreadAbort = true;
+        markSwitchStart();
+        mPlaybackWorker->requestStop();
+    }
+}
+
+void AudioRingBuffer::markSwitchStart()
+{
+    Tracer::instant(TraceEvent::FormatSwitch, 0);
+
+    qint64 expected = 0;
+    mSwitchStartedNs.compare_exchange_strong(expected, monotonicNs());
+}
+
+/**
+ * @brief AudioRingBuffer::markSwitchDone records how long it took from stopping one playback path to starting the next.
+ */
+void AudioRingBuffer::markSwitchDone()
+{
+    const qint64 started = mSwitchStartedNs.exchange(0);
+    if (started == 0)
+        return;
+
+    Tracer::instant(TraceEvent::FormatSwitch, 1);
+
+    const int us = static_cast<int>((monotonicNs() - started) / 1000);
+    mSwitches++;
+    mLastSwitchUs = us;
+    if (us > mMaxSwitchUs)
+        mMaxSwitchUs = us;
+
+    if (us > PLAYBACK_SWITCH_BOUND_MS * 1000)
+    {
+        mSlowSwitches++;
+        std::cerr << "Switching playback path took " << us << " us, more than " << PLAYBACK_SWITCH_BOUND_MS << " ms." << std::endl;
     }
 }
 
+unsigned int AudioRingBuffer::switchCount() const
+{
+    return mSwitches;
+}
+
+int AudioRingBuffer::maxSwitchUs() const
+{
+    return mMaxSwitchUs;
+}
+
+unsigned int AudioRingBuffer::slowSwitchCount() const
+{
+    return mSlowSwitches;
+}
+
+quint64 AudioRingBuffer::captureDroppedFrames() const
+{
+    return mCaptureDroppedFrames;
+}
+
+const CaptureSource *AudioRingBuffer::captureSource() const
+{
+    return mCaptureSource.data();
+}
+
 void AudioRingBuffer::makePlaybackWorker()
 {
     if (mPlaybackWorker)
@@ -175,269 +473,404 @@ void AudioRingBuffer::makePlaybackWorker()
         mPlaybackWorker = 0;
     }
 
-    closePlaybackDevice();
-    mPlaybackWorker = new PlaybackWorker(*this);
+    mPlaybackWorker = new PlaybackWorker(*this, mConfig);
     mPlaybackWorker->moveToThread(&mPlaybackThread);
     connect(mPlaybackWorker, &PlaybackWorker::signalDecodingAborted, this, &AudioRingBuffer::onDecodingAborted);
     connect(mPlaybackWorker, &PlaybackWorker::signalDecodingAborted, mPlaybackWorker, &PlaybackWorker::deleteLater);
     connect(mPlaybackWorker, &PlaybackWorker::newCodecName, this, &AudioRingBuffer::newCodecName);
 }
 
-int AudioRingBuffer::circularBufferToDecodeBuffer(uint8_t * buf, int nbytes)
+/**
+ * @brief AudioRingBuffer::circularBufferToDecodeBuffer waits for nbytes and copies them to buf.
+ * @return nbytes, or -1 when a stop was requested while waiting.
+ */
+int AudioRingBuffer::circularBufferToDecodeBuffer(uint8_t * buf, int nbytes, const StopToken &stop)
 {
+    TraceScope trace(TraceEvent::RingAcquire);
+    trace.setArg(nbytes);
+
     //if (bytesStored >= 2048)
     //{
         //QString e = QString("We have %1 bytes in the buffer. This is >= 2048. We're getting too far behind.").arg(bytesStored);
         //std::cerr << e.toLatin1().data() << std::endl;
     //}
 
-    usedBytes.acquire(nbytes);
+    while (!usedBytes.tryAcquire(nbytes, RING_WAIT_SLICE_MS))
+    {
+        if (stop.stopRequested())
+            return -1;
+    }
+
     for (int i = 0; i < nbytes; ++i)
     {
-        buf[i] = buffer[indexConsumer++ % RING_BUFFER_SIZE];
+        buf[i] = buffer[indexConsumer++ % mRingBufferSize];
     }
+    mConsumedBytes += nbytes;
     freeBytes.release(nbytes);
 
     return nbytes;
 }
 
+int AudioRingBuffer::ringFillFrames()
+{
+    return usedBytes.available() / captureFrameSize;
+}
+
+/**
+ * @brief AudioRingBuffer::latencyMs estimates the current latency from capture to speaker: the ring buffer plus the output.
+ *
+ * What the decoder holds is not counted; it's small compared to the rest, and the decoder doesn't tell.
+ */
+int AudioRingBuffer::latencyMs()
+{
+    return (ringFillFrames() + mOutputStage.queuedFrames()) * 1000 / OUTPUT_SAMPLE_RATE;
+}
+
+bool AudioRingBuffer::isPhaseLocked()
+{
+    QMutexLocker locker(&sampleRateCounterMutex);
+    return phaseLocked;
+}
+
+/**
+ * @brief AudioRingBuffer::sourceSeesEncodedAudio says whether the input is IEC 61937, from the DIR9001 or the network source.
+ */
+bool AudioRingBuffer::sourceSeesEncodedAudio()
+{
+    if (mCaptureSource)
+        return mCaptureSource->seesEncodedAudio();
+    return mGpPIOFunctions.DIR9001SeesEncodedAudio();
+}
+
+quint64 AudioRingBuffer::consumedCaptureFrames() const
+{
+    return mConsumedBytes / captureFrameSize;
+}
+
+double AudioRingBuffer::driftPpm() const
+{
+    return mDriftCompensator.driftPpm();
+}
+
+GainStage &AudioRingBuffer::gainStage()
+{
+    return mOutputStage.gainStage();
+}
+
+const OutputStage &AudioRingBuffer::outputStage() const
+{
+    return mOutputStage;
+}
+
+const AudioBlockPool &AudioRingBuffer::blockPool() const
+{
+    return mBlockPool;
+}
+
+/**
+ * @brief CaptureWorker::doWork runs the reactor, which reads the capture device and writes the playback device.
+ */
 void CaptureWorker::doWork()
 {
+    const QString name = mRingBuffer.mCaptureThread.objectName();
+    std::cout << qPrintable(applyRealtimeToCurrentThread(mRingBuffer.mCaptureRealtime, name)) << std::endl;
+    Tracer::registerCurrentThread(qPrintable(name));
+
+    if (mRingBuffer.capture_handle)
+    {
+        mRingBuffer.mReactor.add(mRingBuffer.capture_handle, [this](unsigned short revents) {
+            return mRingBuffer.onCaptureReady(revents);
+        });
+    }
+
+    mRingBuffer.mReactor.run(mStop);
+
+    if (mRingBuffer.capture_handle)
+        mRingBuffer.mReactor.remove(mRingBuffer.capture_handle);
+}
+
+/**
+ * @brief AudioRingBuffer::onCaptureReady reads everything the capture device has, in the reactor thread.
+ *
+ * The DIR9001 clocks the McASP, so without input, this is simply never called.
+ */
+bool AudioRingBuffer::onCaptureReady(unsigned short revents)
+{
+    TraceScope trace(TraceEvent::CapturePeriod);
+
+    if (revents & POLLERR)
+    {
+        mXrunRecovery.recover(capture_handle, -EPIPE, "capture", true, false);
+        return true;
+    }
+
     while (true)
     {
-        const int framesFreeInBuffer = (mRingBuffer.freeBytes.available()) / mRingBuffer.captureFrameSize;
-        const int framesToRead = std::min(framesFreeInBuffer, FRAMES_IN_BUFFER);
+        int noOfFramesRread = snd_pcm_readi(capture_handle, mCaptureBlock.data(), mCaptureChunkFrames);
 
-        if (framesToRead == 0)
+        if (noOfFramesRread > 0)
         {
-            std::cerr << "Buffer full. What to do?" << std::endl;
-            continue;
+            writeToCircularBuffer(reinterpret_cast<const char*>(mCaptureBlock.data()), noOfFramesRread * captureFrameSize);
+        }
+        else if (noOfFramesRread == -EAGAIN || noOfFramesRread == 0)
+        {
+            break;
         }
         else
         {
-            int noOfFramesRread = snd_pcm_readi(mRingBuffer.capture_handle, mRingBuffer.mCaptureBuffer, framesToRead);
-
-            if (noOfFramesRread > 0)
-            {
-                //std::cout << "Feeding no of frames: " << noOfFrames << std::endl;
-                mRingBuffer.captureBufferToCircularBuffer(noOfFramesRread * mRingBuffer.captureFrameSize);
-            }
-            else if (noOfFramesRread == -EPIPE)
-            {
-                std::cerr << "Broken read pipe; an overrun occurred. Re-preparing PCM" << std::endl;
-                snd_pcm_prepare(mRingBuffer.capture_handle);
-            }
-            else if (noOfFramesRread == -ESTRPIPE)
-            {
-                std::cerr << "a suspend event occurred (stream is suspended and waiting for an application recovery)" << std::endl;
-            }
-            else
-            {
-                std::cerr << "Unkown error code in capture thread: " << noOfFramesRread << std::endl;
-            }
+            // Overrun (-EPIPE), suspend (-ESTRPIPE) or something else snd_pcm_recover() will report as not recovered.
+            mXrunRecovery.recover(capture_handle, noOfFramesRread, "capture", true, false);
+            break;
         }
     }
+
+    return true;
 }
 
+/**
+ * @brief AudioRingBuffer::initCaptureDevice opens and starts the capture device, or throws saying what failed.
+ */
 void AudioRingBuffer::initCaptureDevice()
 {
     unsigned int rate = 48000; // Actually unnecessary, because my hacked mcasp davinci driver ignores it, because it's clocked externally.
-    snd_pcm_hw_params_t *hw_params;
-
-    checkError(snd_pcm_hw_params_malloc(&hw_params));
-    checkError(snd_pcm_open(&capture_handle, "hw:0", SND_PCM_STREAM_CAPTURE, 0));
-    checkError(snd_pcm_hw_params_any(capture_handle, hw_params));
-    checkError(snd_pcm_hw_params_set_access(capture_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED));
-    checkError(snd_pcm_hw_params_set_format(capture_handle, hw_params, SND_PCM_FORMAT_S16_LE));
-    checkError(snd_pcm_hw_params_set_rate_near(capture_handle, hw_params, &rate, 0));
-    checkError(snd_pcm_hw_params_set_channels(capture_handle, hw_params, 2));
-
-    unsigned int buffer_time_us = 10000;
-    int dir = 0; checkError(snd_pcm_hw_params_set_buffer_time_near(capture_handle, hw_params, &buffer_time_us, &dir)); // low latency
+    snd_pcm_hw_params_t *hw_params = nullptr;
+    snd_pcm_sw_params_t *sw_params = nullptr;
+
+    try
+    {
+        checkError(snd_pcm_open(&capture_handle, qPrintable(mConfig.captureDevice), SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK), "open");
+        checkError(snd_pcm_hw_params_malloc(&hw_params), "hw params");
+        checkError(snd_pcm_hw_params_any(capture_handle, hw_params), "hw params");
+        checkError(snd_pcm_hw_params_set_access(capture_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED), "access");
+        checkError(snd_pcm_hw_params_set_format(capture_handle, hw_params, SND_PCM_FORMAT_S16_LE), "format");
+        checkError(snd_pcm_hw_params_set_rate_near(capture_handle, hw_params, &rate, 0), "rate");
+        checkError(snd_pcm_hw_params_set_channels(capture_handle, hw_params, 2), "channels");
+
+        unsigned int buffer_time_us = mConfig.latency.captureBufferUs;
+        int dir = 0; checkError(setBufferAndPeriods(capture_handle, hw_params, buffer_time_us, mConfig.latency.periods), "buffer time"); // low latency
 #ifdef QT_DEBUG
-    printf("Capture device buffer set to: %d us, rounding direction: %d\n", buffer_time_us, dir);
+        printf("Capture device buffer set to: %d us\n", buffer_time_us);
 #endif
 
-    checkError(snd_pcm_hw_params(capture_handle, hw_params));
-    checkError(snd_pcm_prepare(capture_handle));
+        checkError(snd_pcm_hw_params(capture_handle, hw_params), "hw params");
+
+        // Wake the reactor once per period.
+        snd_pcm_uframes_t period_size = 0;
+        checkError(snd_pcm_hw_params_get_period_size(hw_params, &period_size, &dir), "period size");
+        checkError(snd_pcm_sw_params_malloc(&sw_params), "sw params");
+        checkError(snd_pcm_sw_params_current(capture_handle, sw_params), "sw params");
+        checkError(snd_pcm_sw_params_set_avail_min(capture_handle, sw_params, period_size), "avail min");
+        checkError(snd_pcm_sw_params(capture_handle, sw_params), "sw params");
+
+        checkError(snd_pcm_prepare(capture_handle), "prepare");
+        checkError(snd_pcm_start(capture_handle), "start"); // Reads are non-blocking, so they would never start the stream themselves.
+    }
+    catch (AnnotatedException &)
+    {
+        if (sw_params)
+            snd_pcm_sw_params_free(sw_params);
+        if (hw_params)
+            snd_pcm_hw_params_free(hw_params);
+        if (capture_handle)
+            snd_pcm_close(capture_handle);
+        capture_handle = NULL;
+        throw;
+    }
 
+    snd_pcm_sw_params_free(sw_params);
     snd_pcm_hw_params_free(hw_params);
 }
 
-void AudioRingBuffer::openPlaybackDevice(int numberOfChannels, unsigned int buffer_time_us)
+/**
+ * @brief AudioRingBuffer::onOutputPathStarted unmutes the mixer when the output starts playing something new.
+ *
+ * The output stage lives in the playback thread; the mixer thread does the actual work.
+ */
+void AudioRingBuffer::onOutputPathStarted()
 {
-    unsigned int rate = 48000; // Actually unnecessary, because my hacked mcasp davinci driver ignores it, because it's clocked externally.
-    snd_pcm_hw_params_t *hw_params;
-
-    checkError(snd_pcm_hw_params_malloc(&hw_params));
-    checkError(snd_pcm_open(&playback_handle, "hw:0", SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK));
-    checkError(snd_pcm_hw_params_any(playback_handle, hw_params));
-    checkError(snd_pcm_hw_params_set_access(playback_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED));
-    checkError(snd_pcm_hw_params_set_format(playback_handle, hw_params, SND_PCM_FORMAT_S16_LE));
-    checkError(snd_pcm_hw_params_set_rate_near(playback_handle, hw_params, &rate, 0));
-    checkError(snd_pcm_hw_params_set_channels(playback_handle, hw_params, numberOfChannels));
+    setAlsaMute(false);
+}
 
-    int dir = 0; checkError(snd_pcm_hw_params_set_buffer_time_near(playback_handle, hw_params, &buffer_time_us, &dir));
-#ifdef QT_DEBUG
-    printf("Playback device buffer set to: %d us, rounding direction: %d\n", buffer_time_us, dir);
-#endif
+/**
+ * @brief AudioRingBuffer::setAlsaMute queues the hardware mute for the mixer thread, so it's safe from the audio threads.
+ */
+void AudioRingBuffer::setAlsaMute(bool mute)
+{
+    mMixerControl.setMute(mute || mUserMuted);
+}
 
-    checkError(snd_pcm_hw_params(playback_handle, hw_params));
-    checkError(snd_pcm_prepare(playback_handle));
+bool AudioRingBuffer::getAlsaMute()
+{
+    return mMixerControl.isMuted();
+}
 
-    snd_pcm_hw_params_free(hw_params);
+/**
+ * @brief AudioRingBuffer::setUserMute mutes on request of the user, on top of the muting we do ourselves on silence.
+ *
+ * The software gain ramps down, so the hardware mute that follows doesn't click.
+ */
+void AudioRingBuffer::setUserMute(bool mute)
+{
+    mUserMuted = mute;
+    applyVolume();
+    setAlsaMute(mute);
+}
 
-    setAlsaMute(false);
+bool AudioRingBuffer::userMuted() const
+{
+    return mUserMuted;
 }
 
-void AudioRingBuffer::setAlsaMute(bool mute)
+/**
+ * @brief AudioRingBuffer::setVolume sets the volume, 0 to 100, as software gain, so we never fight the mixer over it.
+ *
+ * Like the other runtime config changes, this is for the main thread.
+ */
+void AudioRingBuffer::setVolume(int volume)
 {
-    // The PCM1690 DAC driver I wrote is not a proper one that exposes a multi-channel DAC that ALSA
-    // understands, nor does it have a master control. So, we're hacking a bit (like my drivers
-    // themselves :/ ).
+    mVolume = std::max(0, std::min(100, volume));
+    mConfig.volume = mVolume;
+    applyVolume();
+}
 
-    // TODO: some error handling if it can't find it.
+int AudioRingBuffer::volume() const
+{
+    return mVolume;
+}
 
-    if (giveUpOnMixer)
-        return;
+void AudioRingBuffer::applyVolume()
+{
+    const int volume = mVolume;
+    float gain = 0;
+    if (volume > 0 && !mUserMuted)
+        gain = std::pow(10.0, VOLUME_RANGE_DB * (volume - 100) / 100.0 / 20.0);
+    mOutputStage.gainStage().setMasterGain(gain);
+}
 
-    if (mixer_handle == nullptr)
+/**
+ * @brief AudioRingBuffer::setUpmixStereo changes whether raw PCM stereo is spread over all speakers, by restarting playback.
+ */
+void AudioRingBuffer::setUpmixStereo(bool upmix)
+{
+    if (mConfig.upmixStereo == upmix)
         return;
 
-    int m = static_cast<int>(!mute);
-
-    for(QString selem : this->selem_name)
-    {
-        snd_mixer_selem_id_t *sid;
-        snd_mixer_selem_id_alloca(&sid);
-        snd_mixer_selem_id_set_index(sid, 0);
-        snd_mixer_selem_id_set_name(sid, qPrintable(selem));
-        snd_mixer_elem_t* elem = snd_mixer_find_selem(mixer_handle, sid);
+    mConfig.upmixStereo = upmix;
+    restartPlayback();
+}
 
-        if (snd_mixer_selem_has_playback_switch(elem))
-        {
-            snd_mixer_selem_set_playback_switch_all(elem, m);
-        }
-    }
+bool AudioRingBuffer::upmixStereo() const
+{
+    return mConfig.upmixStereo;
 }
 
-bool AudioRingBuffer::getAlsaMute()
+/**
+ * @brief AudioRingBuffer::config is the effective runtime config, including changes made through the control socket.
+ */
+const RuntimeConfig &AudioRingBuffer::config() const
 {
-    if (giveUpOnMixer)
-        return false;
+    return mConfig;
+}
 
-    // For our purposes, we need to make a local mixer, because otherwise we
-    // don't see changes to the device made by other/external mixers.
-    snd_mixer_t *local_mixer_handle = nullptr;
-    snd_mixer_open(&local_mixer_handle, 0);
-    snd_mixer_attach(local_mixer_handle, card);
-    snd_mixer_selem_register(local_mixer_handle, nullptr, nullptr);
-    snd_mixer_load(local_mixer_handle);
+/**
+ * @brief AudioRingBuffer::applyConfig applies what can be applied without building the pipeline again.
+ * @return what it takes; when that's ConfigChange::Pipeline, nothing is applied, and the caller must build a new ring buffer.
+ *
+ * Playback changes are picked up by the next playback worker, which is started by stopping the current one at a block boundary.
+ */
+ConfigChange AudioRingBuffer::applyConfig(const RuntimeConfig &config)
+{
+    const ConfigChange change = mConfig.changeTo(config);
+    if (change == ConfigChange::Pipeline || change == ConfigChange::None)
+        return change;
 
-    for(QString selem : this->selem_name)
-    {
-        snd_mixer_selem_id_t *sid;
-        snd_mixer_selem_id_alloca(&sid);
-        snd_mixer_selem_id_set_index(sid, 0);
-        snd_mixer_selem_id_set_name(sid, qPrintable(selem));
-        snd_mixer_elem_t* elem = snd_mixer_find_selem(local_mixer_handle, sid);
+    mConfig = config;
+    setVolume(config.volume);
 
-        if (snd_mixer_selem_has_playback_switch(elem))
-        {
-            // Idea of going over 32 channels taken from alsa-lib source code for snd_mixer_selem_set_playback_switch_all()
-            for (int i = 0; i < 32; i++)
-            {
-                snd_mixer_selem_channel_id_t chn = static_cast<snd_mixer_selem_channel_id_t>(i);
-                if (!snd_mixer_selem_has_playback_channel(elem, chn))
-                    continue;
-
-                int value = 0;
-                int ret = checkMixerError(snd_mixer_selem_get_playback_switch(elem, chn, &value));
-
-                if (ret == 0 && value == 0)
-                {
-                    snd_mixer_close(local_mixer_handle);
-                    return true;
-                }
-            }
-        }
-    }
+    if (change == ConfigChange::Playback)
+        restartPlayback();
 
-    snd_mixer_close(local_mixer_handle);
-    return false;
+    return change;
 }
 
 /**
- * @brief AudioRingBuffer::sleepUntilMutedOrMax waits to prevent the mute race condition on boot.
- * @param msecMax
+ * @brief AudioRingBuffer::bootMuteRacePossible says whether to wait for the mute race before starting playback.
  *
  * There is some weird race condition on boot, where something outside our softare mutes the playback.
  * This resulted in the sound playing for half a second and then being muted when the sound souce was
- * on before the decoder. This is a hack to prevent it.
+ * on before the decoder. Playback is held back until that mute has happened, or a timeout.
  */
-void AudioRingBuffer::sleepUntilMutedOrMax(int msecMax)
+bool AudioRingBuffer::bootMuteRacePossible()
 {
     struct sysinfo info;
     sysinfo(&info);
+    return info.uptime <= 60;
+}
 
-    if (info.uptime > 60)
-        return;
-
-    const int sleepTime = 100;
-    const int sleepMaxCount = msecMax / sleepTime;
-    for (int i = 0; i <= sleepMaxCount ; i++)
-    {
-        QThread::msleep(sleepTime);
-        if (getAlsaMute())
-            break;
-    }
+void AudioRingBuffer::checkError(int ret, const char *step)
+{
+    if (ret < 0)
+        throw AnnotatedException(QString("Can't set up capture device '%1', %2 failed: %3").arg(mConfig.captureDevice).arg(step).arg(snd_strerror(ret)));
 }
 
-void AudioRingBuffer::closePlaybackDevice()
+/**
+ * @brief AudioRingBuffer::startCapture starts filling the ring buffer; it doesn't have to wait for the mute race like playback.
+ */
+void AudioRingBuffer::startCapture()
 {
-    if (playback_handle)
-    {
-        checkError(snd_pcm_close(playback_handle));
-        playback_handle = NULL;
-    }
+    QMetaObject::invokeMethod(&mCaptureWorker, "doWork");
+
+    if (mCaptureSource)
+        mCaptureSource->start(mCaptureRealtime);
 }
 
-void AudioRingBuffer::checkError(int ret)
+void AudioRingBuffer::startPlayback()
 {
-    if (ret < 0)
-        std::cerr << "Something went wrong initing the audio device and I'm too lazy to figure out what" << std::endl;
+    QMetaObject::invokeMethod(mPlaybackWorker, "doWork");
 }
 
-int AudioRingBuffer::checkMixerError(int ret)
+void AudioRingBuffer::stopThreads()
 {
-    if (ret < 0)
+    mShuttingDown = true;
+
+    if (mCaptureSource)
+        mCaptureSource->stop();
+    mCaptureWorker.mStop.requestStop();
+    mReactor.wake();
+    if (mPlaybackWorker)
     {
-        giveUpOnMixer = true;
-        mixer_handle = nullptr;
-        std::cerr << "Something went wrong with the alser mixer and I'm too lazy to figure out what. Error code: " << ret << std::endl;
+        disconnect(mPlaybackWorker, &PlaybackWorker::signalDecodingAborted, mPlaybackWorker, &PlaybackWorker::deleteLater);
+        mPlaybackWorker->requestStop();
     }
 
-    return ret;
-}
+    mCaptureThread.quit();
+    mPlaybackThread.quit();
+    mCaptureThread.wait();
+    mPlaybackThread.wait();
 
-void AudioRingBuffer::startThreads()
-{
-    QMetaObject::invokeMethod(&mCaptureWorker, "doWork");
-    QMetaObject::invokeMethod(mPlaybackWorker, "doWork");
+    // The threads are gone, so the worker can be deleted from here, if it didn't delete itself already.
+    delete mPlaybackWorker.data();
+    mPlaybackWorker = nullptr;
 }
 
 
-PlaybackWorker::PlaybackWorker(AudioRingBuffer &ringBuffer) :
+PlaybackWorker::PlaybackWorker(AudioRingBuffer &ringBuffer, const RuntimeConfig &config) :
+    mConfig(config),
     context(0),
     frame(av_frame_alloc()),
     swr_ctx(swr_alloc()),
     avFormatContext(avformat_alloc_context()),
-    avIO_ctx_buffer((uint8_t*)av_malloc(AVIO_CTX_BUFFER_SIZE)),
-    avIOContext(avio_alloc_context(avIO_ctx_buffer, AVIO_CTX_BUFFER_SIZE, 0, this, readFromCircularBuffer, NULL, NULL)),
+    avIO_ctx_buffer((uint8_t*)av_malloc(mConfig.avioBufferSize)),
+    avIOContext(avio_alloc_context(avIO_ctx_buffer, mConfig.avioBufferSize, 0, this, readFromCircularBuffer, NULL, NULL)),
     mRingBuffer(ringBuffer)
 {
     avFormatContext->pb = avIOContext; // I need to create the AVFormatContext manually and assign pb because I'm using my own IO system.
+    avFormatContext->interrupt_callback.callback = interruptFFMpeg;
+    avFormatContext->interrupt_callback.opaque = this;
     av_init_packet(&pkt);
+
+    playbackWorkersAlive++;
+    playbackWorkersCreated++;
 }
 
 PlaybackWorker::~PlaybackWorker()
@@ -454,17 +887,41 @@ PlaybackWorker::~PlaybackWorker()
     av_frame_free(&frame);
     avcodec_free_context(&context);
 
-    if (converted_samples)
-    {
-        av_freep(&converted_samples[0]);
-        av_freep(&converted_samples);
-    }
+    playbackWorkersAlive--;
     std::cerr << "Last line of ~PlaybackWorker" << std::endl;
 }
 
+/**
+ * @brief PlaybackWorker::aliveCount is how many workers exist; more than one for long means they leak.
+ */
+int PlaybackWorker::aliveCount()
+{
+    return playbackWorkersAlive;
+}
+
+unsigned int PlaybackWorker::createdCount()
+{
+    return playbackWorkersCreated;
+}
+
+void PlaybackWorker::requestStop()
+{
+    mStop.requestStop();
+}
+
 void PlaybackWorker::doWork()
 {
-    if (mRingBuffer.mGpPIOFunctions.DIR9001SeesEncodedAudio())
+    mRingBuffer.markSwitchDone();
+
+    if (!mRingBuffer.mPlaybackRealtimeApplied)
+    {
+        const QString name = mRingBuffer.mPlaybackThread.objectName();
+        std::cout << qPrintable(applyRealtimeToCurrentThread(mRingBuffer.mPlaybackRealtime, name)) << std::endl;
+        Tracer::registerCurrentThread(qPrintable(name));
+        mRingBuffer.mPlaybackRealtimeApplied = true;
+    }
+
+    if (mRingBuffer.sourceSeesEncodedAudio())
     {
         decodeWithFFMpeg();
     }
@@ -472,12 +929,20 @@ void PlaybackWorker::doWork()
     {
         writeDirectlyToOutput();
     }
+
+    mRingBuffer.markSwitchStart();
+
+    // Whatever stopped the path, the output stage still has the last bit of good audio to fade out.
+    mRingBuffer.mOutputStage.endPath();
+
+    std::cout << "About to emit signal 'decodingAborted'" << std::endl;
+    emit signalDecodingAborted();
 }
 
 void PlaybackWorker::decodeWithFFMpeg()
 {
     emit newCodecName("Detecting codec...");
-    avFormatContext->probesize = 4096; // increase speed of codec detection with avformat_find_stream_info() below.
+    avFormatContext->probesize = mConfig.probeSize; // increase speed of codec detection with avformat_find_stream_info() below.
 
     AVInputFormat *spdif = av_find_input_format("spdif");
     int ret = avformat_open_input(&avFormatContext, NULL, spdif, NULL);
@@ -490,7 +955,6 @@ void PlaybackWorker::decodeWithFFMpeg()
         av_strerror(ret, ffmpegError, 255);
         std::cerr << ffmpegError << std::endl;
 
-        emit signalDecodingAborted();
         return;
     }
 
@@ -509,20 +973,34 @@ void PlaybackWorker::decodeWithFFMpeg()
     if (stream < 0)
     {
         std::cerr << "No stream found." << std::endl;
-        emit signalDecodingAborted();
         return;
     }
     AVStream *st = avFormatContext->streams[stream];
 
+    codec = selectDecoder(codec, mRingBuffer.mPreferFixedPointDecoders);
+    std::cout << "Using decoder " << codec->name << std::endl;
+
     context = avcodec_alloc_context3(codec);
     av_opt_set_double(context, "drc_scale", 0, AV_OPT_SEARCH_CHILDREN); // Want to hear the long story? E-mail me.
     avcodec_parameters_to_context(context, st->codecpar);
+    context->request_channel_layout = mRingBuffer.mSpeakerLayout.decoderDownmixLayout();
     avcodec_open2(context, codec, NULL);
 
+    const SpeakerLayout &speakers = mRingBuffer.mSpeakerLayout;
+    const int outputChannels = speakers.outputChannels();
+
     av_opt_set_channel_layout(swr_ctx, "in_channel_layout", context->channel_layout, 0);
-    av_opt_set_channel_layout(swr_ctx, "out_channel_layout", AV_CH_LAYOUT_7POINT1, 0); // To match the hardware. I hope ffmpeg will always upmix by adding silent channels when they're not in the source.
+    if ((ret = speakers.configureDownmix(swr_ctx, context->channel_layout)) < 0)
+    {
+        std::cerr << "Can't make mixing matrix for speaker layout " << qPrintable(speakers.name()) << ", error: " << ret << std::endl;
+        return;
+    }
     av_opt_set_sample_fmt(swr_ctx, "in_sample_fmt", context->sample_fmt, 0);
     av_opt_set_sample_fmt(swr_ctx, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+    av_opt_set_int(swr_ctx, "in_sample_rate", context->sample_rate, 0);
+    av_opt_set_int(swr_ctx, "out_sample_rate", context->sample_rate, 0);
+    av_opt_set_int(swr_ctx, "flags", SWR_FLAG_RESAMPLE, 0); // Always resample, so the clock drift compensation can be applied.
+    avoidFloatConversion(swr_ctx, context->sample_fmt);
 
     if ((ret = swr_init(swr_ctx)) < 0)
     {
@@ -531,20 +1009,17 @@ void PlaybackWorker::decodeWithFFMpeg()
         av_strerror(ret, bla, 255);
         std::cerr << bla << std::endl;
 
-        emit signalDecodingAborted();
         return;
     }
 
-    // AC3 results in AV_SAMPLE_FMT_FLTP (8), 4 bytes per sample
-
-    // Allocating more sample space than necessary. I will never change the number of samples, and so I can prevent having to allocate in the loop.
-    ret = av_samples_alloc_array_and_samples(&converted_samples, NULL, context->channels, 65536, AV_SAMPLE_FMT_S16, 0);
+    // AC3 results in AV_SAMPLE_FMT_FLTP (8), 4 bytes per sample; ac3_fixed in AV_SAMPLE_FMT_S16P.
 
-    if (ret  < 0)
+    // The converted output goes into a pooled block, so nothing is allocated for it, not even per worker.
+    AudioBlockRef converted = mRingBuffer.mBlockPool.acquire();
+    if (converted.isNull())
     {
-        char ffmpegError[255];
-        av_strerror(ret, ffmpegError, 255);
-        std::cerr << ffmpegError << std::endl;
+        std::cerr << "No block for the converted output: " << qPrintable(mRingBuffer.mBlockPool.describe()) << std::endl;
+        return;
     }
 
     const AVCodecDescriptor *descriptor = avcodec_descriptor_get(context->codec_id);
@@ -552,7 +1027,8 @@ void PlaybackWorker::decodeWithFFMpeg()
     emit newCodecName(name);
     std::cout << name.toLatin1().data() << std::endl;
 
-    mRingBuffer.openPlaybackDevice(8, 50000);
+    mRingBuffer.mOutputStage.beginPath(outputChannels, mConfig.latency.decodedPlaybackBufferUs, mStop);
+    mRingBuffer.mDriftCompensator.reset();
 
     bool initialPileUpSkipped = false;
 
@@ -561,16 +1037,23 @@ void PlaybackWorker::decodeWithFFMpeg()
     AVCodecID previousCodecID = context->codec_id;
 
 
-    while (!mThisThreadAbort)
+    while (!mStop.stopRequested())
     {
         // This keeps reading data but only return once a complete frame is present. So for example when paused and receiving zeroes,
-        // this statement hangs. Note: some devices send zeroes when paused, other stop sending encoded audio, and the DIR9001 will report
-        // raw PCM again.
-        ret = av_read_frame(avFormatContext, &pkt);
+        // this statement hangs, until a stop is requested. Note: some devices send zeroes when paused, other stop sending encoded audio,
+        // and the DIR9001 will report raw PCM again.
+        {
+            TraceScope trace(TraceEvent::Demux);
+            ret = av_read_frame(avFormatContext, &pkt);
+        }
 
         // When we have received an abort, this frame is likely corrupt, because likely the audio format changed. Don't try to decode it.
-        if (mThisThreadAbort)
-            continue;
+        if (mStop.stopRequested())
+        {
+            if (ret >= 0)
+                av_packet_unref(&pkt);
+            break;
+        }
 
         if (ret < 0)
         {
@@ -583,14 +1066,19 @@ void PlaybackWorker::decodeWithFFMpeg()
             if (usedBytes > 4096)
             {
                 std::cerr << "Initial buffer pile-up too big: " << usedBytes << ". Not writing frame to output to catch up with input and prevent garble output" << std::endl;
+                av_packet_unref(&pkt);
                 continue;
             }
             initialPileUpSkipped = true;
         }
 
-        avcodec_send_packet(context, &pkt);
-        avcodec_receive_frame(context, frame);
-        av_packet_unref(&pkt);
+        {
+            TraceScope trace(TraceEvent::Decode);
+            trace.setArg(pkt.size);
+            avcodec_send_packet(context, &pkt);
+            avcodec_receive_frame(context, frame);
+            av_packet_unref(&pkt);
+        }
 
         // I noticed that channel count and layout can change dynamically, after which swr_convert would crash. I'm not sure what dynamic changes I could
         // make work, so I just break, so that ffmpeg is reinitialized.
@@ -599,7 +1087,7 @@ void PlaybackWorker::decodeWithFFMpeg()
             break;
         }
 
-        ret = swr_convert(swr_ctx, converted_samples, frame->nb_samples, (const uint8_t**)frame->data, frame->nb_samples);
+        ret = convertToOutput(frame->extended_data, frame->nb_samples, context->sample_fmt, context->channels, converted, outputChannels);
 
         if (ret < 0)
         {
@@ -607,33 +1095,106 @@ void PlaybackWorker::decodeWithFFMpeg()
             break;
         }
 
+        const int convertedFrames = ret;
+
         previousChannelLayout = context->channel_layout;
         previousChannels = context->channels;
         previousCodecID = context->codec_id;
 
-        // Because we converted from planar to interleaved, all samples are in the first element of the array.
-        ret = snd_pcm_writei(mRingBuffer.playback_handle, converted_samples[0], frame->nb_samples);
-        if (ret == -EPIPE)
-        {
-            std::cerr << "Broken write pipe because the ALSA playback buffer ran out. Re-preparing PCM" << std::endl;
-            QThread::msleep(50);
-            snd_pcm_prepare(mRingBuffer.playback_handle);
-        }
-        else if (ret < 0)
+        if (mRingBuffer.mDriftCompensator.update(mRingBuffer.ringFillFrames(), convertedFrames))
+            mRingBuffer.mDriftCompensator.applyTo(swr_ctx);
+    }
+
+    std::cout << "Clock drift estimate: " << mRingBuffer.driftPpm() << " ppm" << std::endl;
+}
+
+/**
+ * @brief PlaybackWorker::convertToOutput converts through swresample into a pooled block, and writes that to the output stage.
+ * @return the frames written, or a negative swresample error.
+ *
+ * A block holds less than a big decoded frame, so the input goes in in pieces whose output surely fits.
+ */
+int PlaybackWorker::convertToOutput(uint8_t **in, int frames, AVSampleFormat format, int inChannels, AudioBlockRef &block, int outChannels)
+{
+    const bool planar = av_sample_fmt_is_planar(format);
+    const int planes = planar ? inChannels : 1;
+    const int frameBytes = av_get_bytes_per_sample(format) * (planar ? 1 : inChannels);
+    const int capacity = AUDIO_BLOCK_SAMPLES / outChannels;
+    const uint8_t *pieceIn[SWR_CH_MAX];
+    uint8_t *out = block.data();
+    int done = 0;
+    int written = 0;
+
+    if (planes > SWR_CH_MAX)
+        return AVERROR(EINVAL);
+
+    while (done < frames)
+    {
+        // The compensation, and what swresample still has, make the output a bit more than the input.
+        int piece = frames - done;
+        while (piece > 1 && swr_get_out_samples(swr_ctx, piece) > capacity)
+            piece /= 2;
+
+        for (int p = 0; p < planes; p++)
+            pieceIn[p] = in[p] + done * frameBytes;
+
+        int converted = 0;
         {
-            std::cerr << "Unknown ALSA snd_pcm_writei error: " << ret << std::endl;
+            TraceScope trace(TraceEvent::Convert);
+            trace.setArg(piece);
+            converted = swr_convert(swr_ctx, &out, capacity, pieceIn, piece);
         }
+        if (converted < 0)
+            return converted;
+
+        // Converted to interleaved, so all samples are in the one buffer.
+        if (converted > 0)
+            mRingBuffer.mOutputStage.write(block.samples(), converted);
+
+        written += converted;
+        done += piece;
     }
 
-    emit signalDecodingAborted();
+    return written;
 }
 
 void PlaybackWorker::writeDirectlyToOutput()
 {
     emit newCodecName("No signal");
 
-    const uint totalBytes = FRAMES_IN_BUFFER * mRingBuffer.captureFrameSize;
-    uint8_t buf[totalBytes];
+    // Captured chunks and the converted output are pooled blocks; a chunk is at most what fits in one.
+    const int framesInBuffer = std::min(mRingBuffer.mFramesInBuffer, AUDIO_BLOCK_BYTES / mRingBuffer.captureFrameSize);
+    const uint totalBytes = framesInBuffer * mRingBuffer.captureFrameSize;
+    AudioBlockRef captured = mRingBuffer.mBlockPool.acquire();
+    AudioBlockRef converted = mRingBuffer.mBlockPool.acquire();
+    if (captured.isNull() || converted.isNull())
+    {
+        std::cerr << "No blocks for raw PCM: " << qPrintable(mRingBuffer.mBlockPool.describe()) << std::endl;
+        return;
+    }
+    uint8_t *buf = captured.data();
+
+    // Raw PCM also goes through swresample, to be able to compensate clock drift and upmix.
+    int outputChannels = 2;
+    av_opt_set_channel_layout(swr_ctx, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+    av_opt_set_channel_layout(swr_ctx, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+    if (mConfig.upmixStereo)
+    {
+        mRingBuffer.mSpeakerLayout.configureStereoUpmix(swr_ctx);
+        outputChannels = mRingBuffer.mSpeakerLayout.outputChannels();
+    }
+    av_opt_set_sample_fmt(swr_ctx, "in_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+    av_opt_set_sample_fmt(swr_ctx, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+    av_opt_set_int(swr_ctx, "in_sample_rate", 48000, 0);
+    av_opt_set_int(swr_ctx, "out_sample_rate", 48000, 0);
+    av_opt_set_int(swr_ctx, "flags", SWR_FLAG_RESAMPLE, 0);
+
+    int ret = swr_init(swr_ctx);
+    if (ret < 0)
+    {
+        std::cerr << "Failed to initialize the resampling context for raw PCM, error :" << ret << std::endl;
+        return;
+    }
 
     bool playbackOpened = false;
     uint number_of_silent_buffers = 0;
@@ -642,13 +1203,14 @@ void PlaybackWorker::writeDirectlyToOutput()
     QString pcm_normal = "Raw PCM";
     QString pcm_muted = "Raw PCM (muted)";
 
-    while (!mThisThreadAbort)
+    while (!mStop.stopRequested())
     {
-        // Because of the semaphores, this hangs until enough frames are available.
-        mRingBuffer.circularBufferToDecodeBuffer(buf, totalBytes);
+        // Because of the semaphores, this hangs until enough frames are available, or we must stop.
+        if (mRingBuffer.circularBufferToDecodeBuffer(buf, totalBytes, mStop) < 0)
+            break;
 
         // Check if we are seeing encoded audio before writing to Alsa. This fixes getting garble audio on resume-after-pause on some hardware.
-        if (mRingBuffer.mGpPIOFunctions.DIR9001SeesEncodedAudio())
+        if (mRingBuffer.sourceSeesEncodedAudio())
         {
             break;
         }
@@ -661,7 +1223,8 @@ void PlaybackWorker::writeDirectlyToOutput()
         {
             if (!playbackOpened)
             {
-                mRingBuffer.openPlaybackDevice(2, 10000);
+                mRingBuffer.mOutputStage.beginPath(outputChannels, mConfig.latency.rawPlaybackBufferUs, mStop);
+                mRingBuffer.mDriftCompensator.reset();
                 playbackOpened = true;
                 continue; // Don't play bytes captured during opening device, to avoid delay.
             }
@@ -676,18 +1239,17 @@ void PlaybackWorker::writeDirectlyToOutput()
             continue; // Continue reading the buffer and waiting for bytes.
         }
 
-        int ret = snd_pcm_writei(mRingBuffer.playback_handle, buf, FRAMES_IN_BUFFER); // non-blocking
-        if (ret == -EPIPE)
-        {
-            std::cerr << "Broken write pipe because the ALSA playback buffer ran out. Re-preparing PCM" << std::endl;
-            QThread::msleep(10);
-            snd_pcm_prepare(mRingBuffer.playback_handle);
-        }
-        else if (ret < 0)
+        uint8_t *in[] = { buf };
+        const int convertedFrames = convertToOutput(in, framesInBuffer, AV_SAMPLE_FMT_S16, 2, converted, outputChannels);
+        if (convertedFrames < 0)
         {
-            std::cerr << "Unknown ALSA snd_pcm_writei error: " << ret << std::endl;
+            std::cerr << "Sample conversion error in raw PCM: " << convertedFrames << std::endl;
+            break;
         }
 
+        if (mRingBuffer.mDriftCompensator.update(mRingBuffer.ringFillFrames(), convertedFrames))
+            mRingBuffer.mDriftCompensator.applyTo(swr_ctx);
+
         // We have some time until our capture buffer has more data, to do some processing.
 
         uint8_t num_different_bytes = 0;
@@ -707,8 +1269,7 @@ void PlaybackWorker::writeDirectlyToOutput()
 
         uint8_t mute_mode = number_of_silent_buffers < 5000 ? MUTE_MODE_UNMUTED : MUTE_MODE_MUTED;
 
-        // Be sure not do this too often. It causes too much time, messing up the byte counting of mRingBuffer.byteCounter
-        // and decoding will be stuck in stoping/starting all the time.
+        // Be sure not do this too often, to prevent flapping between muted and unmuted on quiet passages.
         if (last_mute_change + 1 < time(nullptr) && mute_mode != current_mute_mode)
         {
             last_mute_change = time(nullptr);
@@ -718,13 +1279,14 @@ void PlaybackWorker::writeDirectlyToOutput()
             if (mute_mode == MUTE_MODE_UNMUTED)
                 emit newCodecName(pcm_normal);
 
-            this->mRingBuffer.setAlsaMute(mute_mode == MUTE_MODE_MUTED);
+            // The software gain ramps, and the hardware mute follows from the mixer thread, so we don't wait on the mixer here.
+            const bool mute = mute_mode == MUTE_MODE_MUTED;
+            this->mRingBuffer.mOutputStage.gainStage().setMuted(mute);
+            this->mRingBuffer.setAlsaMute(mute);
             current_mute_mode = mute_mode;
         }
     }
 
-    std::cout << "About to emit signal 'decodingAborted'" << std::endl;
-    emit signalDecodingAborted();
 }
 
 
@@ -26,6 +26,7 @@
 #include <QSemaphore>
 #include <QTimer>
 #include <QScopedPointer>
+#include <QPointer>
 #include <alsa/asoundlib.h>
 
 extern "C"
@@ -39,15 +40,30 @@ extern "C"
 }
 
 #include "gpiofunctions.h"
-
-#define FRAMES_IN_BUFFER 64
-#define RING_BUFFER_SIZE 10485760
-#define AVIO_CTX_BUFFER_SIZE 4096
+#include "driftcompensator.h"
+#include "speakerlayout.h"
+#include "outputstage.h"
+#include "alsareactor.h"
+#include "xrunrecovery.h"
+#include "mixercontrol.h"
+#include "settings.h"
+#include "stoptoken.h"
+#include "rtpsender.h"
+#include "networksource.h"
+#include "bitstreamrecorder.h"
+#include "replaysource.h"
+#include "shmoutput.h"
+#include "audioblockpool.h"
+#include "alsafanout.h"
+
+#define PLAYBACK_SWITCH_BOUND_MS 20
 
 #define MUTE_MODE_UNDEFINED 0
 #define MUTE_MODE_UNMUTED 1
 #define MUTE_MODE_MUTED 2
 
+#define VOLUME_RANGE_DB 60.0 // Volume 1 is this much below 100; 0 is silent.
+
 class AudioRingBuffer;
 
 class CaptureWorker : public QObject
@@ -59,6 +75,8 @@ class CaptureWorker : public QObject
 public:
     CaptureWorker(AudioRingBuffer &ringBuffer);
 
+    StopToken mStop;
+
 public slots:
     void doWork();
 
@@ -69,11 +87,11 @@ class PlaybackWorker : public QObject
 {
     Q_OBJECT
 
+    const RuntimeConfig mConfig; // A copy, so a reload never changes things halfway through a path.
 
     AVCodecContext *context = 0;
     AVFrame *frame;
     struct SwrContext *swr_ctx;
-    uint8_t **converted_samples = 0;
 
     AVFormatContext *avFormatContext;
     uint8_t *avIO_ctx_buffer;
@@ -82,12 +100,18 @@ class PlaybackWorker : public QObject
 
     AVPacket pkt;
 
+    int convertToOutput(uint8_t **in, int frames, AVSampleFormat format, int inChannels, AudioBlockRef &block, int outChannels);
+
 public:
-    PlaybackWorker(AudioRingBuffer &ringBuffer);
+    PlaybackWorker(AudioRingBuffer &ringBuffer, const RuntimeConfig &config);
     ~PlaybackWorker();
 
     AudioRingBuffer &mRingBuffer;
-    bool mThisThreadAbort = false; // This bool and the old system of signals to detect format change is deprecated and can actually be removed.
+    StopToken mStop;
+
+    void requestStop();
+    static int aliveCount();
+    static unsigned int createdCount();
 
 public slots:
     void doWork();
@@ -108,21 +132,27 @@ class AudioRingBuffer : public QObject
     friend class CaptureWorker;
     friend class PlaybackWorker;
 
-    snd_pcm_t *capture_handle;
-    snd_pcm_t *playback_handle;
-    void *mCaptureBuffer; // For snd_pcm_readi to read into
+    RuntimeConfig mConfig; // Only used by the main thread; playback workers get a copy.
+    const int mFramesInBuffer;
+    const quint32 mRingBufferSize;
+    AudioBlockPool mBlockPool; // For the buffers between the stages; before everything that holds blocks.
+
+    snd_pcm_t *capture_handle; // Stays NULL when capturing from the network.
+    AudioBlockRef mCaptureBlock; // For snd_pcm_readi to read into
+    int mCaptureChunkFrames = 0; // What fits in the block; bigger reads are split up.
     CaptureWorker mCaptureWorker;
     QThread mCaptureThread;
 
     char * buffer; // The circular FIFO buffer that connects everything together: TODO: ffmpeg also has a FIFO buffer, should I use that?
     quint32 indexProducer = 0;
     quint32 indexConsumer = 0;
+    std::atomic<quint64> mConsumedBytes; // Doesn't wrap, so it's a position on the capture clock.
     QSemaphore freeBytes;
     QSemaphore usedBytes;
 
     const int captureFrameSize;
 
-    PlaybackWorker *mPlaybackWorker;
+    QPointer<PlaybackWorker> mPlaybackWorker;
     QThread mPlaybackThread;
 
     QTimer printStatusTimer;
@@ -132,40 +162,101 @@ class AudioRingBuffer : public QObject
     uint byteCounter = 0;
     bool phaseLocked = false; // See onSampleRateCalculatorTimer()
 
-    snd_mixer_t *mixer_handle = nullptr;
-    const char *card = "default";
-    QList<QString> selem_name;
-    bool giveUpOnMixer = false;
+    DriftCompensator mDriftCompensator;
+    AlsaReactor mReactor; // Run by the capture thread; drives both capture and playback.
+    XrunRecovery mXrunRecovery;
+    quint64 mPrintedXruns = 0;
+    unsigned int mToggleRequestsSeen = BitstreamRecorder::toggleRequests();
+    OutputStage mOutputStage;
+    std::atomic<quint64> mCaptureDroppedFrames;
+    quint64 mLastReactorWakeups = 0;
+    quint64 mLastReactorBusyNs = 0;
+
+    const SpeakerLayout mSpeakerLayout;
+    const bool mPreferFixedPointDecoders;
+
+    const ThreadRealtimeSettings mCaptureRealtime;
+    const ThreadRealtimeSettings mPlaybackRealtime;
+    bool mPlaybackRealtimeApplied = false; // Only touched by the playback thread.
+
+    bool mShuttingDown = false;
+    std::atomic<qint64> mSwitchStartedNs;
+    std::atomic<int> mLastSwitchUs;
+    std::atomic<int> mMaxSwitchUs;
+    std::atomic<unsigned int> mSwitches;
+    std::atomic<unsigned int> mSlowSwitches;
+
+    void markSwitchStart();
+    void markSwitchDone();
+
+    MixerControl mMixerControl;
+    std::atomic<bool> mUserMuted;
+    std::atomic<int> mVolume;
+    const int mStartupTargetMs;
+    const QString mTraceDirectory;
+    const int mTraceSeconds;
+    QScopedPointer<RtpSender> mRtpSender;
+    QScopedPointer<CaptureSource> mCaptureSource; // Replaces the capture device when set.
+    QScopedPointer<BitstreamRecorder> mRecorder;
+    QScopedPointer<ShmOutput> mShmOutput;
+    QScopedPointer<AlsaFanout> mFanout;
 
     void initCaptureDevice();
-    void openPlaybackDevice(int numberOfChannels, unsigned int buffer_time_us);
-    void closePlaybackDevice();
-    void checkError(int ret);
-    int checkMixerError(int ret);
+    bool writeToCircularBuffer(const char *data, int bytes);
+    bool onCaptureReady(unsigned short revents);
+    void checkError(int ret, const char *step);
     void makePlaybackWorker();
+    void applyVolume();
 public:
-    explicit AudioRingBuffer(GpIOFunctions &gpIOFunctions, QObject *parent = nullptr);
+    explicit AudioRingBuffer(GpIOFunctions &gpIOFunctions, const Settings &settings, QObject *parent = nullptr);
     ~AudioRingBuffer();
 
-    int circularBufferToDecodeBuffer(uint8_t *buf, int nbytes);
-    inline bool DIR9001SeesEncodedAudio() { return mGpPIOFunctions.DIR9001SeesEncodedAudio(); }
-    void startThreads();
+    int circularBufferToDecodeBuffer(uint8_t *buf, int nbytes, const StopToken &stop);
+    int ringFillFrames();
+    int latencyMs();
+    bool isPhaseLocked();
+    quint64 consumedCaptureFrames() const;
+    double driftPpm() const;
+    GainStage &gainStage();
+    const OutputStage &outputStage() const;
+    const AudioBlockPool &blockPool() const;
+    bool sourceSeesEncodedAudio();
+    void startCapture();
+    void startPlayback();
+    void stopThreads();
+    unsigned int switchCount() const;
+    int maxSwitchUs() const;
+    unsigned int slowSwitchCount() const;
+    quint64 captureDroppedFrames() const;
+    const CaptureSource *captureSource() const;
     void setAlsaMute(bool mute);
     bool getAlsaMute();
-    void sleepUntilMutedOrMax(int msecMax);
+    void setUserMute(bool mute);
+    bool userMuted() const;
+    void setVolume(int volume);
+    int volume() const;
+    void setUpmixStereo(bool upmix);
+    bool upmixStereo() const;
+    ConfigChange applyConfig(const RuntimeConfig &config);
+    const RuntimeConfig &config() const;
+    static bool bootMuteRacePossible();
 
 signals:
     void newCodecName(const QString &name);
     void bufferBytesInfo(const QString &line);
+    void alsaMuteChanged(bool muted);
+    void alsaMuteApplied(bool muted);
+    void phaseLockChanged(bool locked);
 
 private slots:
-    void captureBufferToCircularBuffer(int bytes);
     void onStatusTimer();
     void onDecodingAborted();
     void onAudioFormatChanged(bool encoded);
     void onSampleRateCalculatorTimer();
+    void onOutputPathStarted();
 
 public slots:
+    void restartPlayback();
 };
 
 #endif // AUDIORINGBUFFER_H
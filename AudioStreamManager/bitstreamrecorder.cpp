@@ -0,0 +1,401 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "bitstreamrecorder.h"
+#include <QDateTime>
+#include <QDir>
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "realtime.h"
+
+static std::atomic<unsigned int> toggleRequestCount(0);
+
+static quint64 monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<quint64>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+RecorderStream::RecorderStream(const QString &name, quint64 capacity, int channels) :
+    mName(name),
+    mBuffer(new char[capacity]),
+    mCapacity(capacity),
+    mWritePos(0),
+    mReadPos(0),
+    mChannels(channels),
+    mWrittenBytes(0),
+    mDroppedBytes(0),
+    mDroppedSplits(0),
+    mPushes(0),
+    mPushNs(0),
+    mMaxPushNs(0),
+    mMaxWriteNs(0)
+{
+
+}
+
+RecorderStream::~RecorderStream()
+{
+    closeFile();
+    delete[] mBuffer;
+}
+
+void RecorderStream::prefault()
+{
+    ::prefault(mBuffer, mCapacity);
+}
+
+/**
+ * @brief RecorderStream::push copies the bytes into the ring, or drops them when there's no room. Never blocks.
+ */
+bool RecorderStream::push(const void *data, int bytes)
+{
+    const quint64 startNs = monotonicNs();
+
+    const quint64 write = mWritePos.load(std::memory_order_relaxed);
+    const quint64 read = mReadPos.load(std::memory_order_acquire);
+    if (bytes <= 0 || mCapacity - (write - read) < static_cast<quint64>(bytes))
+    {
+        mDroppedBytes += std::max(bytes, 0);
+        return false;
+    }
+
+    const quint64 offset = write & (mCapacity - 1);
+    const quint64 first = std::min<quint64>(bytes, mCapacity - offset);
+    memcpy(mBuffer + offset, data, first);
+    memcpy(mBuffer, static_cast<const char*>(data) + first, bytes - first);
+    mWritePos.store(write + bytes, std::memory_order_release);
+
+    const quint64 ns = monotonicNs() - startNs;
+    mPushes++;
+    mPushNs += ns;
+    if (ns > mMaxPushNs)
+        mMaxPushNs = ns;
+    return true;
+}
+
+/**
+ * @brief RecorderStream::split makes what's pushed from now on go to a new file, with the given channel count.
+ *
+ * Splits are queued, because a flapping source changes paths faster than the writer runs. When the queue is full, the
+ * split is lost and counted, and that audio ends up in the file of the format before it.
+ */
+void RecorderStream::split(int channels)
+{
+    Split split;
+    split.position = mWritePos.load(std::memory_order_relaxed);
+    split.channels = channels;
+    if (!mSplits.push(split))
+        mDroppedSplits++;
+}
+
+quint64 RecorderStream::available() const
+{
+    return mWritePos.load(std::memory_order_acquire) - mReadPos.load(std::memory_order_relaxed);
+}
+
+bool RecorderStream::openFile(const QString &directory)
+{
+    QDir().mkpath(directory);
+
+    const QString path = QString("%1/%2-%3-%4-%5ch.raw").arg(directory).arg(mName)
+            .arg(QDateTime::currentDateTime().toString("yyyyMMdd-HHmmss")).arg(mFileIndex++).arg(mChannels);
+    mFd = open(path.toLocal8Bit().constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (mFd < 0)
+    {
+        std::cerr << "Can't open recording " << path.toLocal8Bit().constData() << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    mFiles << path;
+    mFileSizes << 0;
+    mFileBytes = 0;
+    mLastSyncOffset = 0;
+    mLastSyncBytes = 0;
+    return true;
+}
+
+void RecorderStream::closeFile()
+{
+    if (mFd < 0)
+        return;
+
+    close(mFd);
+    mFd = -1;
+}
+
+/**
+ * @brief RecorderStream::writeOut writes what the ring has in chunks; the remainder too when all is set. For the writer thread.
+ * @return whether something was written.
+ */
+bool RecorderStream::writeOut(const QString &directory, quint64 fileBytes, quint64 maxBytes, bool all)
+{
+    bool wrote = false;
+
+    while (true)
+    {
+        const quint64 read = mReadPos.load(std::memory_order_relaxed);
+        quint64 available = mWritePos.load(std::memory_order_acquire) - read;
+
+        if (!mHasNextSplit)
+            mHasNextSplit = mSplits.pop(mNextSplit);
+        if (mHasNextSplit && mNextSplit.position <= read)
+        {
+            mHasNextSplit = false;
+            mChannels = mNextSplit.channels;
+            closeFile();
+            continue;
+        }
+        if (mHasNextSplit)
+            available = std::min(available, mNextSplit.position - read);
+
+        if (available == 0 || (!all && available < RECORDER_WRITE_CHUNK_BYTES))
+            break;
+
+        const quint64 offset = read & (mCapacity - 1);
+        const quint64 bytes = std::min(std::min<quint64>(available, RECORDER_WRITE_CHUNK_BYTES), mCapacity - offset);
+
+        if (mFd < 0 && !openFile(directory))
+        {
+            mDroppedBytes += bytes;
+            mReadPos.store(read + bytes, std::memory_order_release);
+            continue;
+        }
+
+        const quint64 startNs = monotonicNs();
+        const ssize_t written = ::write(mFd, mBuffer + offset, bytes);
+        const quint64 ns = monotonicNs() - startNs;
+        if (ns > mMaxWriteNs)
+            mMaxWriteNs = ns;
+
+        if (written <= 0)
+        {
+            std::cerr << "Writing recording failed: " << strerror(errno) << std::endl;
+            closeFile();
+            mDroppedBytes += bytes;
+            mReadPos.store(read + bytes, std::memory_order_release);
+            continue;
+        }
+
+        // Start the writeback of this chunk now, and drop the previous one from the page cache once it's on the card.
+        sync_file_range(mFd, mFileBytes, written, SYNC_FILE_RANGE_WRITE);
+        if (mLastSyncBytes > 0)
+        {
+            sync_file_range(mFd, mLastSyncOffset, mLastSyncBytes, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(mFd, mLastSyncOffset, mLastSyncBytes, POSIX_FADV_DONTNEED);
+        }
+        mLastSyncOffset = mFileBytes;
+        mLastSyncBytes = written;
+
+        mReadPos.store(read + written, std::memory_order_release);
+        mFileBytes += written;
+        mFileSizes.last() += written;
+        mFilesBytes += written;
+        mWrittenBytes += written;
+        wrote = true;
+
+        if (mFileBytes >= fileBytes)
+            closeFile();
+
+        while (mFilesBytes > maxBytes && mFiles.size() > 1)
+        {
+            unlink(mFiles.first().toLocal8Bit().constData());
+            mFilesBytes -= mFileSizes.first();
+            mFiles.removeFirst();
+            mFileSizes.removeFirst();
+        }
+    }
+
+    return wrote;
+}
+
+void RecorderStream::finish()
+{
+    closeFile();
+}
+
+QString RecorderStream::describe() const
+{
+    const quint64 pushes = mPushes;
+    QString result = QString("%1: %2 MB written, %3 KB dropped, push %4 ns avg, %5 us max, write %6 ms max").arg(mName)
+            .arg(mWrittenBytes / (1024 * 1024)).arg(mDroppedBytes / 1024).arg(pushes > 0 ? mPushNs / pushes : 0)
+            .arg(mMaxPushNs / 1000).arg(mMaxWriteNs / 1000000);
+    if (mDroppedSplits > 0)
+        result += QString(", %1 format changes lost").arg(mDroppedSplits);
+    return result;
+}
+
+/**
+ * @param fileMb size at which a file is closed and the next one started.
+ * @param maxMb total size of the files of each stream; the oldest are deleted to stay under it.
+ */
+BitstreamRecorder::BitstreamRecorder(const QString &directory, int fileMb, int maxMb, bool recordOutput) :
+    mDirectory(directory),
+    mFileBytes(static_cast<quint64>(std::max(1, fileMb)) * 1024 * 1024),
+    mMaxBytes(static_cast<quint64>(std::max(fileMb, maxMb)) * 1024 * 1024),
+    mRecordOutput(recordOutput),
+    mCapture("capture", RECORDER_CAPTURE_BUFFER_BYTES, 2),
+    mOutput("output", recordOutput ? RECORDER_OUTPUT_BUFFER_BYTES : 0, 0),
+    mEnabled(false),
+    mStop(false)
+{
+
+}
+
+BitstreamRecorder::~BitstreamRecorder()
+{
+    stop();
+}
+
+void BitstreamRecorder::start(bool enabled, bool lockMemory)
+{
+    if (lockMemory)
+    {
+        mCapture.prefault();
+        if (mRecordOutput)
+            mOutput.prefault();
+    }
+
+    mEnabled = enabled;
+    mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    mStop = false;
+    mThread = std::thread(&BitstreamRecorder::writerLoop, this);
+}
+
+void BitstreamRecorder::stop()
+{
+    if (mThread.joinable())
+    {
+        mStop = true;
+        const uint64_t one = 1;
+        ssize_t ret = ::write(mWakeFd, &one, sizeof(one));
+        Q_UNUSED(ret)
+        mThread.join();
+    }
+
+    if (mWakeFd >= 0)
+        close(mWakeFd);
+    mWakeFd = -1;
+}
+
+void BitstreamRecorder::setEnabled(bool enabled)
+{
+    mEnabled = enabled;
+    std::cout << "Recording " << (enabled ? "started" : "stopped") << ", in " << mDirectory.toLocal8Bit().constData() << std::endl;
+}
+
+bool BitstreamRecorder::enabled() const
+{
+    return mEnabled;
+}
+
+/**
+ * @brief BitstreamRecorder::requestToggle asks for switching the recording on or off. It only counts, so it's async-signal-safe.
+ */
+void BitstreamRecorder::requestToggle()
+{
+    toggleRequestCount++;
+}
+
+/**
+ * @brief BitstreamRecorder::toggleRequests is a count, so every pipeline can see a new request by comparing with what it saw last.
+ */
+unsigned int BitstreamRecorder::toggleRequests()
+{
+    return toggleRequestCount;
+}
+
+void BitstreamRecorder::recordCapture(const char *data, int bytes)
+{
+    if (mEnabled.load(std::memory_order_relaxed))
+        mCapture.push(data, bytes);
+}
+
+void BitstreamRecorder::beginPath(int channels)
+{
+    mOutputChannels = channels;
+    if (mRecordOutput)
+        mOutput.split(channels);
+}
+
+void BitstreamRecorder::write(const int16_t *samples, int frames)
+{
+    if (mRecordOutput && mEnabled.load(std::memory_order_relaxed))
+        mOutput.push(samples, frames * mOutputChannels * sizeof(int16_t));
+}
+
+void BitstreamRecorder::writerLoop()
+{
+    // The audio threads may be real-time, but the rest of the system isn't; this stays out of everybody's way.
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), RECORDER_NICE);
+    syscall(SYS_ioprio_set, 1, 0, (RECORDER_IOPRIO_CLASS_BE << 13) | RECORDER_IOPRIO_LOWEST); // IOPRIO_WHO_PROCESS, this thread
+
+    quint64 lastFlushNs = monotonicNs();
+    bool wasEnabled = false;
+
+    while (!mStop)
+    {
+        struct pollfd pfd;
+        pfd.fd = mWakeFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, RECORDER_WRITE_INTERVAL_MS);
+
+        const bool enabled = mEnabled;
+        const quint64 now = monotonicNs();
+        const bool flush = !enabled || now - lastFlushNs >= RECORDER_FLUSH_INTERVAL_MS * 1000000ULL;
+        if (flush)
+            lastFlushNs = now;
+
+        mCapture.writeOut(mDirectory, mFileBytes, mMaxBytes, flush);
+        if (mRecordOutput)
+            mOutput.writeOut(mDirectory, mFileBytes, mMaxBytes, flush);
+
+        if (wasEnabled && !enabled)
+        {
+            mCapture.finish();
+            mOutput.finish();
+        }
+        wasEnabled = enabled;
+    }
+
+    mCapture.writeOut(mDirectory, mFileBytes, mMaxBytes, true);
+    if (mRecordOutput)
+        mOutput.writeOut(mDirectory, mFileBytes, mMaxBytes, true);
+    mCapture.finish();
+    mOutput.finish();
+}
+
+QString BitstreamRecorder::describe() const
+{
+    QString result = QString("Recorder %1; %2").arg(mEnabled ? "on" : "off").arg(mCapture.describe());
+    if (mRecordOutput)
+        result += "; " + mOutput.describe();
+    return result;
+}
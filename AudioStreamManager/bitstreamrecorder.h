@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef BITSTREAMRECORDER_H
+#define BITSTREAMRECORDER_H
+
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <atomic>
+#include <thread>
+
+#include "outputtap.h"
+#include "lockfreequeue.h"
+
+#define RECORDER_DEFAULT_DIRECTORY "/var/lib/audiostreammanager/recordings"
+#define RECORDER_CAPTURE_BUFFER_BYTES (4 * 1024 * 1024) // 20 s of S/PDIF; must be a power of two.
+#define RECORDER_OUTPUT_BUFFER_BYTES (8 * 1024 * 1024) // 10 s of 7.1; must be a power of two.
+#define RECORDER_WRITE_CHUNK_BYTES (256 * 1024)
+#define RECORDER_WRITE_INTERVAL_MS 250
+#define RECORDER_FLUSH_INTERVAL_MS 2000 // Less than a chunk is written when it has been waiting this long.
+#define RECORDER_IOPRIO_CLASS_BE 2
+#define RECORDER_IOPRIO_LOWEST 7
+#define RECORDER_NICE 10
+#define RECORDER_SPLIT_QUEUE 16 // Pending format changes; must be a power of two.
+
+/**
+ * @brief The RecorderStream class is one recorded stream: a lock-free single producer ring, and the files it's written to.
+ *
+ * push() and split() are for the audio thread; the rest is for the writer thread.
+ */
+class RecorderStream
+{
+    struct Split
+    {
+        quint64 position; // Where the next file must start, because the format changed.
+        int channels;
+    };
+
+    const QString mName;
+    char *mBuffer;
+    const quint64 mCapacity;
+    std::atomic<quint64> mWritePos; // Free-running byte counters.
+    std::atomic<quint64> mReadPos;
+    LockFreeQueue<Split, RECORDER_SPLIT_QUEUE> mSplits;
+
+    // Only touched by the writer thread.
+    Split mNextSplit;
+    bool mHasNextSplit = false;
+    int mChannels;
+    int mFd = -1;
+    quint64 mFileBytes = 0;
+    quint64 mLastSyncOffset = 0;
+    quint64 mLastSyncBytes = 0;
+    int mFileIndex = 0;
+    QStringList mFiles;
+    QList<quint64> mFileSizes;
+    quint64 mFilesBytes = 0;
+
+    std::atomic<quint64> mWrittenBytes;
+    std::atomic<quint64> mDroppedBytes;
+    std::atomic<quint64> mDroppedSplits;
+    std::atomic<quint64> mPushes;
+    std::atomic<quint64> mPushNs;
+    std::atomic<quint64> mMaxPushNs;
+    std::atomic<quint64> mMaxWriteNs;
+
+    bool openFile(const QString &directory);
+    void closeFile();
+
+public:
+    RecorderStream(const QString &name, quint64 capacity, int channels);
+    ~RecorderStream();
+
+    void prefault();
+    bool push(const void *data, int bytes);
+    void split(int channels);
+
+    quint64 available() const;
+    bool writeOut(const QString &directory, quint64 fileBytes, quint64 maxBytes, bool all);
+    void finish();
+    QString describe() const;
+};
+
+/**
+ * @brief The BitstreamRecorder class records the captured bytes, and optionally the output, to disk, for diagnosing sources.
+ *
+ * The captured stream is S16LE stereo, as it comes from the DIR9001 (IEC 61937 included), so recordings can be given to
+ * --benchmark-decoders. The output stream is S16LE with the channel count in the file name; it starts a new file when that
+ * changes.
+ *
+ * The audio threads only copy into a ring, or drop and count when it's full. A writer thread with low CPU and I/O priority
+ * writes large chunks, and starts the writeback of each chunk right away while dropping the previous one from the page cache,
+ * so the SD card gets a steady stream instead of periodic flushes of lots of dirty pages. Files are rotated at a size limit,
+ * and the oldest are deleted when the total exceeds its limit.
+ */
+class BitstreamRecorder : public OutputTap
+{
+    const QString mDirectory;
+    const quint64 mFileBytes;
+    const quint64 mMaxBytes;
+    const bool mRecordOutput;
+    RecorderStream mCapture;
+    RecorderStream mOutput;
+    int mOutputChannels = 0; // Only touched by the playback thread.
+
+    std::atomic<bool> mEnabled;
+    std::atomic<bool> mStop;
+    int mWakeFd = -1;
+    std::thread mThread;
+
+    void writerLoop();
+
+public:
+    BitstreamRecorder(const QString &directory, int fileMb, int maxMb, bool recordOutput);
+    ~BitstreamRecorder();
+
+    void start(bool enabled, bool lockMemory);
+    void stop();
+    void setEnabled(bool enabled);
+    bool enabled() const;
+    static void requestToggle();
+    static unsigned int toggleRequests();
+
+    void recordCapture(const char *data, int bytes);
+    void beginPath(int channels) override;
+    void write(const int16_t *samples, int frames) override;
+
+    QString describe() const;
+};
+
+#endif // BITSTREAMRECORDER_H
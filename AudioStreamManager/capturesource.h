@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef CAPTURESOURCE_H
+#define CAPTURESOURCE_H
+
+#include <QString>
+#include <functional>
+
+#include "realtime.h"
+
+/**
+ * @brief The CaptureSource class is an input that replaces the S/PDIF capture, like the network or a replayed recording.
+ *
+ * It writes S16LE stereo into the ring buffer with the producer it's given, from its own thread, and takes over the role of
+ * the DIR9001 format GPIO.
+ */
+class CaptureSource
+{
+public:
+    typedef std::function<bool(const char *data, int bytes)> Producer;
+
+    virtual ~CaptureSource() {}
+
+    virtual void start(const ThreadRealtimeSettings &realtime) = 0;
+    virtual void stop() = 0;
+    virtual bool seesEncodedAudio() const = 0;
+    virtual QString describe() const = 0;
+    virtual bool finished() const { return false; } // For sources that end, like a replay.
+};
+
+#endif // CAPTURESOURCE_H
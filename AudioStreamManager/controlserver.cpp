@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+#include "controlserver.h"
+#include <iostream>
+
+const QStringList ControlServer::keys = QStringList() << "codec" << "channels" << "lock" << "fill" << "latency"
+                                                      << "volume" << "mute" << "hwmute" << "mode" << "blocks" << "blocks_high";
+
+static bool parseBool(const QString &value, bool &ok)
+{
+    ok = true;
+    if (value == "1" || value == "on" || value == "true")
+        return true;
+    if (value == "0" || value == "off" || value == "false")
+        return false;
+    ok = false;
+    return false;
+}
+
+ControlServer::ControlServer(AudioRingBuffer &ringBuffer, const QString &path, QObject *parent) : QObject(parent),
+    mPath(path)
+{
+    connect(&mServer, &QLocalServer::newConnection, this, &ControlServer::onNewConnection);
+    setRingBuffer(ringBuffer);
+}
+
+ControlServer::~ControlServer()
+{
+    // The clients are children of the server, and would otherwise report their disconnect to a half destroyed us.
+    for (QLocalSocket *client : mServer.findChildren<QLocalSocket*>())
+        client->disconnect(this);
+    mServer.close();
+}
+
+/**
+ * @brief ControlServer::setRingBuffer switches to a new pipeline, after a restart for a config change. Clients stay connected.
+ */
+void ControlServer::setRingBuffer(AudioRingBuffer &ringBuffer)
+{
+    mRingBuffer = &ringBuffer;
+    mCodecName.clear();
+
+    connect(mRingBuffer, &AudioRingBuffer::newCodecName, this, &ControlServer::onNewCodecName);
+    connect(mRingBuffer, &AudioRingBuffer::phaseLockChanged, this, &ControlServer::onPhaseLockChanged);
+    connect(mRingBuffer, &AudioRingBuffer::alsaMuteChanged, this, &ControlServer::onAlsaMuteChanged);
+    connect(&mRingBuffer->outputStage(), &OutputStage::pathStarted, this, &ControlServer::onOutputPathStarted);
+}
+
+/**
+ * @brief ControlServer::listen opens the socket, replacing one left behind by a previous run.
+ *
+ * Not being controllable is no reason not to play, so failing is only reported.
+ */
+bool ControlServer::listen()
+{
+    QLocalServer::removeServer(mPath);
+    mServer.setSocketOptions(QLocalServer::UserAccessOption | QLocalServer::GroupAccessOption);
+
+    if (!mServer.listen(mPath))
+    {
+        std::cerr << "Can't listen on control socket " << mPath.toLatin1().data() << ": " << mServer.errorString().toLatin1().data() << std::endl;
+        return false;
+    }
+
+    std::cout << "Control socket: " << mPath.toLatin1().data() << std::endl;
+    return true;
+}
+
+void ControlServer::onNewConnection()
+{
+    while (QLocalSocket *client = mServer.nextPendingConnection())
+    {
+        connect(client, &QLocalSocket::readyRead, this, &ControlServer::onReadyRead);
+        connect(client, &QLocalSocket::disconnected, this, &ControlServer::onDisconnected);
+    }
+}
+
+void ControlServer::onReadyRead()
+{
+    QLocalSocket *client = qobject_cast<QLocalSocket*>(sender());
+    if (!client)
+        return;
+
+    while (client->canReadLine() || client->bytesAvailable() > CONTROL_MAX_LINE)
+    {
+        const QByteArray line = client->readLine(CONTROL_MAX_LINE + 1);
+        if (!line.endsWith('\n'))
+        {
+            client->write("error line too long\n");
+            client->disconnectFromServer();
+            return;
+        }
+
+        const QString request = QString::fromLatin1(line).trimmed();
+        if (request.isEmpty())
+            continue;
+
+        client->write(handleRequest(client, request).toLatin1().append('\n'));
+    }
+}
+
+void ControlServer::onDisconnected()
+{
+    QLocalSocket *client = qobject_cast<QLocalSocket*>(sender());
+    if (!client)
+        return;
+
+    mSubscribers.removeAll(client);
+    client->deleteLater();
+}
+
+QString ControlServer::handleRequest(QLocalSocket *client, const QString &request)
+{
+    QStringList words = request.split(' ', QString::SkipEmptyParts);
+    const QString command = words.takeFirst().toLower();
+
+    if (command == "get")
+    {
+        if (words.isEmpty())
+            words = keys;
+
+        QStringList pairs;
+        for (const QString &key : words)
+        {
+            if (!keys.contains(key))
+                return QString("error unknown key '%1'").arg(key);
+            pairs << pair(key);
+        }
+        return QString("ok %1").arg(pairs.join(' '));
+    }
+
+    if (command == "set")
+    {
+        if (words.size() != 2)
+            return "error usage: set <key> <value>";
+        return handleSet(words.at(0), words.at(1));
+    }
+
+    if (command == "subscribe")
+    {
+        if (!mSubscribers.contains(client))
+            mSubscribers.append(client);
+        return "ok";
+    }
+
+    if (command == "unsubscribe")
+    {
+        mSubscribers.removeAll(client);
+        return "ok";
+    }
+
+    return QString("error unknown request '%1'").arg(command);
+}
+
+QString ControlServer::handleSet(const QString &key, const QString &value)
+{
+    bool ok = false;
+
+    if (key == "volume")
+    {
+        const int volume = value.toInt(&ok);
+        if (!ok || volume < 0 || volume > 100)
+            return "error volume is 0 to 100";
+        mRingBuffer->setVolume(volume);
+    }
+    else if (key == "mute")
+    {
+        const bool mute = parseBool(value, ok);
+        if (!ok)
+            return "error mute is on or off";
+        mRingBuffer->setUserMute(mute);
+    }
+    else if (key == "mode")
+    {
+        if (value != "direct" && value != "upmix")
+            return "error mode is direct or upmix";
+        mRingBuffer->setUpmixStereo(value == "upmix");
+    }
+    else
+    {
+        return QString("error can't set '%1'").arg(key);
+    }
+
+    publish(key);
+    return QString("ok %1").arg(pair(key));
+}
+
+QString ControlServer::value(const QString &key)
+{
+    if (key == "codec")
+        return mCodecName;
+    if (key == "channels")
+        return QString::number(mRingBuffer->outputStage().channels());
+    if (key == "lock")
+        return mRingBuffer->isPhaseLocked() ? "1" : "0";
+    if (key == "fill")
+        return QString::number(mRingBuffer->ringFillFrames());
+    if (key == "latency")
+        return QString::number(mRingBuffer->latencyMs());
+    if (key == "volume")
+        return QString::number(mRingBuffer->volume());
+    if (key == "mute")
+        return mRingBuffer->userMuted() ? "1" : "0";
+    if (key == "hwmute")
+        return mRingBuffer->getAlsaMute() ? "1" : "0";
+    if (key == "mode")
+        return mRingBuffer->upmixStereo() ? "upmix" : "direct";
+    if (key == "blocks")
+        return QString::number(mRingBuffer->blockPool().inUse());
+    if (key == "blocks_high")
+        return QString::number(mRingBuffer->blockPool().highWater());
+    return QString();
+}
+
+QString ControlServer::pair(const QString &key)
+{
+    QString v = value(key);
+    if (v.isEmpty() || v.contains(' '))
+        v = QString("\"%1\"").arg(v);
+    return QString("%1=%2").arg(key).arg(v);
+}
+
+void ControlServer::publish(const QString &key)
+{
+    if (mSubscribers.isEmpty())
+        return;
+
+    const QByteArray line = QString("event %1\n").arg(pair(key)).toLatin1();
+    for (QLocalSocket *client : mSubscribers)
+        client->write(line);
+}
+
+void ControlServer::onNewCodecName(const QString &name)
+{
+    mCodecName = name;
+    publish("codec");
+}
+
+void ControlServer::onPhaseLockChanged(bool locked)
+{
+    Q_UNUSED(locked)
+    publish("lock");
+}
+
+void ControlServer::onOutputPathStarted()
+{
+    publish("channels");
+}
+
+void ControlServer::onAlsaMuteChanged(bool muted)
+{
+    Q_UNUSED(muted)
+    publish("hwmute");
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+#ifndef CONTROLSERVER_H
+#define CONTROLSERVER_H
+
+#include <QObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QList>
+#include <QStringList>
+
+#include "audioringbuffer.h"
+
+#define CONTROL_DEFAULT_SOCKET "/run/audiostreammanager.sock"
+#define CONTROL_MAX_LINE 256 // Clients that send longer lines are disconnected.
+
+/**
+ * @brief The ControlServer class offers state queries, volume, mute and mode commands, and state change events on a Unix socket.
+ *
+ * The protocol is line based. Requests are 'get [key...]', 'set <key> <value>', 'subscribe' and 'unsubscribe'. Answers are
+ * 'ok' followed by the key=value pairs asked for or changed, or 'error <reason>'. Subscribers also get 'event key=value' lines
+ * when something changes. Values with spaces are quoted.
+ *
+ * Keys: codec, channels, lock, fill (frames in the ring buffer), latency (ms), volume (0-100), mute, hwmute (the mixer
+ * switches, read only), mode (direct or upmix, for raw PCM stereo), and blocks and blocks_high (audio blocks in use, now and
+ * at most, out of AUDIO_BLOCK_POOL_BLOCKS; not evented). Volume and mute are done in software with ramps, followed by the
+ * mixer, so clients don't have to touch the mixer anymore.
+ *
+ * It lives in the main thread, like the rest of the non-audio work.
+ */
+class ControlServer : public QObject
+{
+    Q_OBJECT
+
+    AudioRingBuffer *mRingBuffer = nullptr;
+    const QString mPath;
+    QLocalServer mServer;
+    QList<QLocalSocket*> mSubscribers;
+    QString mCodecName;
+
+    QString handleRequest(QLocalSocket *client, const QString &request);
+    QString handleSet(const QString &key, const QString &value);
+    QString value(const QString &key);
+    QString pair(const QString &key);
+    void publish(const QString &key);
+
+public:
+    static const QStringList keys;
+
+    ControlServer(AudioRingBuffer &ringBuffer, const QString &path, QObject *parent = nullptr);
+    ~ControlServer();
+
+    void setRingBuffer(AudioRingBuffer &ringBuffer);
+    bool listen();
+
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+    void onDisconnected();
+    void onNewCodecName(const QString &name);
+    void onPhaseLockChanged(bool locked);
+    void onOutputPathStarted();
+    void onAlsaMuteChanged(bool muted);
+};
+
+#endif // CONTROLSERVER_H
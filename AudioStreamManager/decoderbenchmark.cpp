@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "decoderbenchmark.h"
+#include "decoderselection.h"
+#include <QElapsedTimer>
+#include <iostream>
+#include <time.h>
+
+extern "C"
+{
+    #include <libavutil/opt.h>
+    #include <libswresample/swresample.h>
+}
+
+static double threadCpuSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+DecoderBenchmark::DecoderBenchmark(const SpeakerLayout &speakers) :
+    mSpeakers(speakers)
+{
+
+}
+
+bool DecoderBenchmark::benchmarkVariant(const QString &file, const AVCodecParameters *codecpar, AVCodec *codec, const QList<AVPacket *> &packets)
+{
+    AVCodecContext *context = avcodec_alloc_context3(codec);
+    av_opt_set_double(context, "drc_scale", 0, AV_OPT_SEARCH_CHILDREN);
+    avcodec_parameters_to_context(context, codecpar);
+    context->request_channel_layout = mSpeakers.decoderDownmixLayout();
+
+    if (avcodec_open2(context, codec, NULL) < 0)
+    {
+        std::cerr << "Can't open decoder " << codec->name << std::endl;
+        avcodec_free_context(&context);
+        return false;
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    SwrContext *swr = nullptr;
+    uint8_t **converted = nullptr;
+    int64_t samples = 0;
+    bool ok = true;
+
+    QElapsedTimer wallTimer;
+    wallTimer.start();
+    const double cpuStart = threadCpuSeconds();
+
+    for (int i = 0; i <= packets.size() && ok; i++)
+    {
+        // The last round sends a null packet, to flush the decoder.
+        avcodec_send_packet(context, i < packets.size() ? packets.at(i) : nullptr);
+
+        while (avcodec_receive_frame(context, frame) == 0)
+        {
+            if (!swr)
+            {
+                const uint64_t inLayout = frame->channel_layout ? frame->channel_layout : av_get_default_channel_layout(frame->channels);
+
+                swr = swr_alloc();
+                av_opt_set_channel_layout(swr, "in_channel_layout", inLayout, 0);
+                mSpeakers.configureDownmix(swr, inLayout);
+                av_opt_set_sample_fmt(swr, "in_sample_fmt", static_cast<AVSampleFormat>(frame->format), 0);
+                av_opt_set_sample_fmt(swr, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+                av_opt_set_int(swr, "in_sample_rate", frame->sample_rate, 0);
+                av_opt_set_int(swr, "out_sample_rate", frame->sample_rate, 0);
+                av_opt_set_int(swr, "flags", SWR_FLAG_RESAMPLE, 0);
+                avoidFloatConversion(swr, static_cast<AVSampleFormat>(frame->format));
+
+                if (swr_init(swr) < 0 || av_samples_alloc_array_and_samples(&converted, NULL, mSpeakers.outputChannels(), 65536, AV_SAMPLE_FMT_S16, 0) < 0)
+                {
+                    std::cerr << "Can't set up conversion for " << codec->name << std::endl;
+                    ok = false;
+                    break;
+                }
+            }
+
+            swr_convert(swr, converted, 65536, (const uint8_t**)frame->data, frame->nb_samples);
+            samples += frame->nb_samples;
+        }
+    }
+
+    const double cpuSeconds = threadCpuSeconds() - cpuStart;
+    const double wallSeconds = wallTimer.nsecsElapsed() / 1e9;
+
+    if (ok && samples > 0 && context->sample_rate > 0)
+    {
+        const double audioSeconds = static_cast<double>(samples) / context->sample_rate;
+        const double rtf = cpuSeconds / audioSeconds;
+
+        QString line = QString("%1 | %2 | %3 | %4 | %5 s audio | %6 s CPU | %7 s wall | RTF %8 | %9x real-time")
+                .arg(file)
+                .arg(avcodec_get_name(codec->id))
+                .arg(codec->name)
+                .arg(av_get_sample_fmt_name(context->sample_fmt))
+                .arg(audioSeconds, 0, 'f', 1)
+                .arg(cpuSeconds, 0, 'f', 3)
+                .arg(wallSeconds, 0, 'f', 3)
+                .arg(rtf, 0, 'f', 4)
+                .arg(rtf > 0 ? 1.0 / rtf : 0, 0, 'f', 1);
+        std::cout << qPrintable(line) << std::endl;
+    }
+    else if (ok)
+    {
+        std::cerr << "Decoder " << codec->name << " didn't produce any audio from " << qPrintable(file) << std::endl;
+        ok = false;
+    }
+
+    if (converted)
+    {
+        av_freep(&converted[0]);
+        av_freep(&converted);
+    }
+    swr_free(&swr);
+    av_frame_free(&frame);
+    avcodec_free_context(&context);
+
+    return ok;
+}
+
+/**
+ * @brief DecoderBenchmark::run benchmarks all decoder variants for each file.
+ * @return exit code for the program: 0 when all benchmarks ran.
+ */
+int DecoderBenchmark::run(const QStringList &files)
+{
+    avcodec_register_all();
+    av_register_all();
+
+    int failures = 0;
+    AVInputFormat *spdif = av_find_input_format("spdif");
+
+    std::cout << "file | codec | decoder | sample format | duration | CPU time | wall time | real-time factor | speed" << std::endl;
+
+    for (const QString &file : files)
+    {
+        AVFormatContext *formatContext = nullptr;
+        if (avformat_open_input(&formatContext, qPrintable(file), spdif, NULL) < 0)
+        {
+            std::cerr << "Can't open " << qPrintable(file) << " as IEC 61937 capture." << std::endl;
+            failures++;
+            continue;
+        }
+
+        avformat_find_stream_info(formatContext, NULL);
+
+        AVCodec *codec = nullptr;
+        const int stream = av_find_best_stream(formatContext, AVMediaType::AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+        if (stream < 0 || !codec)
+        {
+            std::cerr << "No decodable audio stream in " << qPrintable(file) << std::endl;
+            avformat_close_input(&formatContext);
+            failures++;
+            continue;
+        }
+
+        QList<AVPacket*> packets;
+        AVPacket pkt;
+        av_init_packet(&pkt);
+        pkt.data = nullptr;
+        pkt.size = 0;
+        while (av_read_frame(formatContext, &pkt) >= 0)
+        {
+            if (pkt.stream_index == stream)
+                packets.append(av_packet_clone(&pkt));
+            av_packet_unref(&pkt);
+        }
+
+        const AVCodecParameters *codecpar = formatContext->streams[stream]->codecpar;
+
+        if (!benchmarkVariant(file, codecpar, codec, packets))
+            failures++;
+
+        AVCodec *fixed = findFixedPointDecoder(codec);
+        if (fixed)
+        {
+            if (!benchmarkVariant(file, codecpar, fixed, packets))
+                failures++;
+        }
+        else
+        {
+            std::cout << qPrintable(file) << " | " << avcodec_get_name(codec->id) << " | no fixed-point decoder available" << std::endl;
+        }
+
+        for (AVPacket *packet : packets)
+            av_packet_free(&packet);
+        avformat_close_input(&formatContext);
+    }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef DECODERBENCHMARK_H
+#define DECODERBENCHMARK_H
+
+#include <QStringList>
+#include <QList>
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+#include "speakerlayout.h"
+
+/**
+ * @brief The DecoderBenchmark class measures the CPU cost of decoding recorded captures with each decoder variant.
+ *
+ * The captures are the raw bytes as they come from the DIR9001, so IEC 61937 in S16LE stereo. Packets are read into memory
+ * first, so only decoding and the conversion to the output format, as the real decoding path does it, are measured.
+ */
+class DecoderBenchmark
+{
+    const SpeakerLayout mSpeakers;
+
+    bool benchmarkVariant(const QString &file, const AVCodecParameters *codecpar, AVCodec *codec, const QList<AVPacket*> &packets);
+
+public:
+    DecoderBenchmark(const SpeakerLayout &speakers);
+    int run(const QStringList &files);
+};
+
+#endif // DECODERBENCHMARK_H
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "decoderselection.h"
+#include <QString>
+
+extern "C"
+{
+    #include <libavutil/opt.h>
+}
+
+/**
+ * @brief findFixedPointDecoder finds the fixed-point variant of a decoder, which ffmpeg names '<name>_fixed'.
+ * @return the decoder, or nullptr if there isn't one.
+ */
+AVCodec *findFixedPointDecoder(const AVCodec *codec)
+{
+    if (!codec)
+        return nullptr;
+
+    const QString name = QString("%1_fixed").arg(codec->name);
+    AVCodec *fixed = avcodec_find_decoder_by_name(qPrintable(name));
+
+    if (fixed && fixed->id == codec->id)
+        return fixed;
+    return nullptr;
+}
+
+AVCodec *selectDecoder(AVCodec *codec, bool preferFixedPoint)
+{
+    if (!preferFixedPoint)
+        return codec;
+
+    AVCodec *fixed = findFixedPointDecoder(codec);
+    return fixed ? fixed : codec;
+}
+
+bool isIntegerSampleFormat(AVSampleFormat format)
+{
+    switch (av_get_packed_sample_fmt(format))
+    {
+    case AV_SAMPLE_FMT_U8:
+    case AV_SAMPLE_FMT_S16:
+    case AV_SAMPLE_FMT_S32:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief avoidFloatConversion makes swresample mix and resample in integers, for integer input.
+ *
+ * Left to itself, swresample uses float internally when there is a matrix, which would undo the gain of a fixed-point decoder.
+ * Call before swr_init().
+ */
+void avoidFloatConversion(SwrContext *swr, AVSampleFormat inFormat)
+{
+    if (!isIntegerSampleFormat(inFormat))
+        return;
+
+    const AVSampleFormat internal = av_get_bytes_per_sample(inFormat) > 2 ? AV_SAMPLE_FMT_S32P : AV_SAMPLE_FMT_S16P;
+    av_opt_set_sample_fmt(swr, "internal_sample_fmt", internal, 0);
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef DECODERSELECTION_H
+#define DECODERSELECTION_H
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libswresample/swresample.h>
+}
+
+/*
+ * The Cortex-A8 of the BBB has a slow VFP, and only single precision NEON. The float decoders, and the conversion of their
+ * FLTP output to S16, take a large share of the CPU. FFmpeg has fixed-point variants of some decoders, like ac3_fixed, which
+ * output integer samples directly.
+ */
+
+AVCodec *findFixedPointDecoder(const AVCodec *codec);
+AVCodec *selectDecoder(AVCodec *codec, bool preferFixedPoint);
+bool isIntegerSampleFormat(AVSampleFormat format);
+void avoidFloatConversion(SwrContext *swr, AVSampleFormat inFormat);
+
+#endif // DECODERSELECTION_H
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "driftcompensator.h"
+#include <algorithm>
+#include <cmath>
+
+DriftCompensator::DriftCompensator() :
+    mDriftPpm(0),
+    mCorrectionPpm(0)
+{
+
+}
+
+/**
+ * @brief DriftCompensator::reset starts a new measurement of the target fill level, but keeps the drift estimate.
+ */
+void DriftCompensator::reset()
+{
+    mFilteredFill = 0;
+    mTargetFill = 0;
+    mUpdates = 0;
+    mFramesSinceUpdate = 0;
+    mFirstMeasurement = true;
+}
+
+/**
+ * @brief DriftCompensator::update feeds the current ring buffer fill level after playing some frames.
+ * @param ringFillFrames frames (not bytes) in the ring buffer.
+ * @param framesPlayed frames written to the output since the last call.
+ * @return true when the correction changed and should be applied with applyTo().
+ */
+bool DriftCompensator::update(int ringFillFrames, int framesPlayed)
+{
+    if (mFirstMeasurement)
+    {
+        mFilteredFill = ringFillFrames;
+        mFirstMeasurement = false;
+    }
+
+    // First order low-pass, with the coefficient depending on the amount of time that passed.
+    const double alpha = static_cast<double>(framesPlayed) / (framesPlayed + DRIFT_FILTER_FRAMES);
+    mFilteredFill += alpha * (ringFillFrames - mFilteredFill);
+
+    mFramesSinceUpdate += framesPlayed;
+    if (mFramesSinceUpdate < DRIFT_UPDATE_INTERVAL_FRAMES)
+        return false;
+    mFramesSinceUpdate = 0;
+
+    // Until settled, we only apply the drift we already know of. The initial fill level is what we'll keep as latency.
+    if (mUpdates < DRIFT_SETTLE_UPDATES)
+    {
+        mUpdates++;
+        mTargetFill = mFilteredFill;
+        mCorrectionPpm = mIntegral;
+        return true;
+    }
+
+    // Positive error means the buffer is filling up, so we have to play faster.
+    const double error = mFilteredFill - mTargetFill;
+
+    mIntegral += DRIFT_KI * error;
+    mIntegral = std::max(-DRIFT_MAX_CORRECTION_PPM, std::min(DRIFT_MAX_CORRECTION_PPM, mIntegral)); // anti wind-up
+
+    double correction = DRIFT_KP * error + mIntegral;
+    correction = std::max(-DRIFT_MAX_CORRECTION_PPM, std::min(DRIFT_MAX_CORRECTION_PPM, correction));
+
+    mDriftPpm = mIntegral;
+    mCorrectionPpm = correction;
+    return true;
+}
+
+/**
+ * @brief DriftCompensator::applyTo sets the current correction as compensation on a resampler.
+ * @return the return value of swr_set_compensation().
+ *
+ * Playing faster means making fewer output samples out of the input, hence the negative delta.
+ */
+int DriftCompensator::applyTo(SwrContext *swr)
+{
+    const int sampleDelta = static_cast<int>(-std::lround(mCorrectionPpm.load()));
+    return swr_set_compensation(swr, sampleDelta, DRIFT_COMPENSATION_DISTANCE);
+}
+
+double DriftCompensator::driftPpm() const
+{
+    return mDriftPpm;
+}
+
+double DriftCompensator::correctionPpm() const
+{
+    return mCorrectionPpm;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef DRIFTCOMPENSATOR_H
+#define DRIFTCOMPENSATOR_H
+
+#include <atomic>
+
+extern "C"
+{
+    #include <libswresample/swresample.h>
+}
+
+// With a distance of a million samples, the sample delta given to swr_set_compensation() is simply the correction in ppm.
+#define DRIFT_COMPENSATION_DISTANCE 1000000
+#define DRIFT_UPDATE_INTERVAL_FRAMES 4800 // Run the controller every 100 ms of output.
+#define DRIFT_FILTER_FRAMES 24000 // Time constant of the fill level low-pass filter; decoded audio is read in bursts.
+#define DRIFT_SETTLE_UPDATES 10 // Updates to wait before taking the fill level as target.
+#define DRIFT_MAX_CORRECTION_PPM 1000.0
+#define DRIFT_KP 0.2 // ppm per frame of fill error
+#define DRIFT_KI 0.005 // ppm per frame of fill error, per update
+
+/**
+ * @brief The DriftCompensator class keeps the ring buffer fill level, and therefore the latency, constant.
+ *
+ * Capture is clocked by the DIR9001 PLL and playback by the McASP/PCM1690 clock. They are never exactly the same, so
+ * without correction the ring buffer slowly fills up, or runs empty and causes an xrun. A PI controller on the low-pass
+ * filtered fill level calculates how much faster or slower to play, which is applied with swresample's compensation.
+ *
+ * Once settled, the integral term is the actual clock drift, which is what driftPpm() reports. It's kept when the
+ * controller is reset for a new playback path, because the clocks don't change when the audio format does.
+ */
+class DriftCompensator
+{
+    double mFilteredFill = 0;
+    double mTargetFill = 0;
+    double mIntegral = 0;
+    int mUpdates = 0;
+    int mFramesSinceUpdate = 0;
+    bool mFirstMeasurement = true;
+
+    std::atomic<double> mDriftPpm;
+    std::atomic<double> mCorrectionPpm;
+
+public:
+    DriftCompensator();
+
+    void reset();
+    bool update(int ringFillFrames, int framesPlayed);
+    int applyTo(SwrContext *swr);
+    double driftPpm() const;
+    double correctionPpm() const;
+};
+
+#endif // DRIFTCOMPENSATOR_H
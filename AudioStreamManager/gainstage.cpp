@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "gainstage.h"
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+static inline int16_t applyGain(int16_t sample, float gain)
+{
+    int32_t v = static_cast<int32_t>(sample * gain);
+    if (v > INT16_MAX)
+        v = INT16_MAX;
+    if (v < INT16_MIN)
+        v = INT16_MIN;
+    return static_cast<int16_t>(v);
+}
+
+GainStage::GainStage() :
+    mMuted(false),
+    mTargetVersion(0)
+{
+    for (int i = 0; i < MAX_OUTPUT_CHANNELS; i++)
+    {
+        mTargetGain[i] = 1.0f;
+        mCurrentGain[i] = 1.0f;
+        mRampStep[i] = 0;
+        mRampTarget[i] = 1.0f;
+    }
+
+    makePattern();
+}
+
+void GainStage::setGain(int channel, float gain)
+{
+    if (channel < 0 || channel >= MAX_OUTPUT_CHANNELS)
+        return;
+
+    mTargetGain[channel] = gain;
+    mTargetVersion++;
+}
+
+void GainStage::setMasterGain(float gain)
+{
+    for (int i = 0; i < MAX_OUTPUT_CHANNELS; i++)
+        mTargetGain[i] = gain;
+    mTargetVersion++;
+}
+
+void GainStage::setMuted(bool muted)
+{
+    if (mMuted == muted)
+        return;
+
+    mMuted = muted;
+    mTargetVersion++;
+}
+
+bool GainStage::isMuted() const
+{
+    return mMuted;
+}
+
+float GainStage::gain(int channel) const
+{
+    if (channel < 0 || channel >= MAX_OUTPUT_CHANNELS)
+        return 0;
+    return mTargetGain[channel];
+}
+
+/**
+ * @brief GainStage::setChannels sets the number of interleaved channels process() gets. Call it from the audio thread.
+ */
+void GainStage::setChannels(int channels)
+{
+    if (channels < 1 || channels > MAX_OUTPUT_CHANNELS)
+        return;
+
+    mChannels = channels;
+    makePattern();
+}
+
+void GainStage::startRamp()
+{
+    const bool muted = mMuted;
+
+    for (int c = 0; c < MAX_OUTPUT_CHANNELS; c++)
+    {
+        mRampTarget[c] = muted ? 0.0f : mTargetGain[c].load();
+        mRampStep[c] = (mRampTarget[c] - mCurrentGain[c]) / GAIN_RAMP_FRAMES;
+    }
+
+    mRampFramesLeft = GAIN_RAMP_FRAMES;
+}
+
+/**
+ * @brief GainStage::makePattern lays out the channel gains as they repeat over the interleaved samples.
+ *
+ * This way, the constant gain can be applied four samples at a time, regardless of the channel count.
+ */
+void GainStage::makePattern()
+{
+    static_assert(GAIN_PATTERN_SIZE >= 4 * MAX_OUTPUT_CHANNELS, "The pattern must fit lcm(channels, 4) gains for every channel count");
+
+    mPatternSize = mChannels;
+    while (mPatternSize % 4 != 0)
+        mPatternSize += mChannels;
+
+    for (int i = 0; i < mPatternSize; i++)
+        mPattern[i] = mCurrentGain[i % mChannels];
+}
+
+void GainStage::applyRamp(int16_t *samples, int frames)
+{
+    for (int f = 0; f < frames; f++)
+    {
+        for (int c = 0; c < mChannels; c++)
+        {
+            mCurrentGain[c] += mRampStep[c];
+            samples[c] = applyGain(samples[c], mCurrentGain[c]);
+        }
+        samples += mChannels;
+    }
+}
+
+void GainStage::applyConstant(int16_t *samples, int frames)
+{
+    bool unity = true;
+    bool silent = true;
+    for (int c = 0; c < mChannels; c++)
+    {
+        unity &= mCurrentGain[c] == 1.0f;
+        silent &= mCurrentGain[c] == 0.0f;
+    }
+
+    if (unity)
+        return;
+
+    const int count = frames * mChannels;
+
+    if (silent)
+    {
+        memset(samples, 0, count * sizeof(int16_t));
+        return;
+    }
+
+    int i = 0;
+    int p = 0;
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; i + 4 <= count; i += 4)
+    {
+        float32x4_t f = vcvtq_f32_s32(vmovl_s16(vld1_s16(samples + i)));
+        f = vmulq_f32(f, vld1q_f32(mPattern + p));
+        vst1_s16(samples + i, vqmovn_s32(vcvtq_s32_f32(f)));
+
+        p += 4;
+        if (p == mPatternSize)
+            p = 0;
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        samples[i] = applyGain(samples[i], mPattern[p]);
+
+        if (++p == mPatternSize)
+            p = 0;
+    }
+}
+
+/**
+ * @brief GainStage::process applies the gain in place, to interleaved samples of the amount of channels given to setChannels().
+ */
+void GainStage::process(int16_t *samples, int frames)
+{
+    const unsigned int version = mTargetVersion;
+    if (version != mAppliedVersion)
+    {
+        mAppliedVersion = version;
+        startRamp();
+    }
+
+    if (mRampFramesLeft > 0)
+    {
+        const int rampFrames = frames < mRampFramesLeft ? frames : mRampFramesLeft;
+        applyRamp(samples, rampFrames);
+        mRampFramesLeft -= rampFrames;
+        samples += rampFrames * mChannels;
+        frames -= rampFrames;
+
+        if (mRampFramesLeft == 0)
+        {
+            // Prevent rounding errors of the steps from lingering.
+            for (int c = 0; c < MAX_OUTPUT_CHANNELS; c++)
+                mCurrentGain[c] = mRampTarget[c];
+            makePattern();
+        }
+    }
+
+    if (frames > 0)
+        applyConstant(samples, frames);
+}
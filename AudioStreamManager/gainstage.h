@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef GAINSTAGE_H
+#define GAINSTAGE_H
+
+#include <atomic>
+#include <stdint.h>
+
+#include "speakerlayout.h"
+
+#define GAIN_RAMP_FRAMES 480 // 10 ms at 48 kHz
+// Room for the per-sample gains of a whole number of frames that is also a multiple of 4 samples. That's lcm(channels, 4),
+// which is at most 4 * channels; 28 for 7 channels.
+#define GAIN_PATTERN_SIZE (4 * MAX_OUTPUT_CHANNELS)
+
+/**
+ * @brief The GainStage class applies per-channel gain and mute to interleaved S16 samples, with ramps for every change.
+ *
+ * The setters can be called from any thread; they only store the new target. The audio thread picks up the change at the
+ * start of the next process() call and ramps to it, one step per frame, so changes are sample accurate and click-free.
+ * Nothing is allocated, and there are no locks or syscalls in process().
+ */
+class GainStage
+{
+    std::atomic<float> mTargetGain[MAX_OUTPUT_CHANNELS];
+    std::atomic<bool> mMuted;
+    std::atomic<unsigned int> mTargetVersion;
+
+    // Only used by the audio thread.
+    unsigned int mAppliedVersion = 0;
+    int mChannels = 2;
+    float mCurrentGain[MAX_OUTPUT_CHANNELS];
+    float mRampStep[MAX_OUTPUT_CHANNELS];
+    float mRampTarget[MAX_OUTPUT_CHANNELS];
+    int mRampFramesLeft = 0;
+    float mPattern[GAIN_PATTERN_SIZE];
+    int mPatternSize = 4;
+
+    void startRamp();
+    void makePattern();
+    void applyRamp(int16_t *samples, int frames);
+    void applyConstant(int16_t *samples, int frames);
+
+public:
+    GainStage();
+
+    void setGain(int channel, float gain);
+    void setMasterGain(float gain);
+    void setMuted(bool muted);
+    bool isMuted() const;
+    float gain(int channel) const;
+
+    void setChannels(int channels);
+    void process(int16_t *samples, int frames);
+};
+
+#endif // GAINSTAGE_H
@@ -18,27 +18,34 @@
  */
 
 #include "gpiofunctions.h"
+#include "startuptrace.h"
 
-GpIOFunctions::GpIOFunctions() : QObject(0),
-    mGpIODIR9001AudioPin(DIR9001_GPIO_FORMAT_PATH)
+GpIOFunctions::GpIOFunctions(int line) : QObject(0),
+    mLine(line),
+    mGpIODIR9001AudioPin(QString("/sys/class/gpio/gpio%1/value").arg(line))
 {
-    QFile DIR9001AudioGpio("/sys/class/gpio/gpio51");
+    if (mLine < 0)
+        return;
+
+    StartupPhase phase("GPIO setup");
+
+    QFile DIR9001AudioGpio(QString("/sys/class/gpio/gpio%1").arg(mLine));
     if (!DIR9001AudioGpio.exists())
     {
-        std::cout << "Exporting GPIO 51 for DIR9001 format detection." << std::endl;
+        std::cout << "Exporting GPIO " << mLine << " for DIR9001 format detection." << std::endl;
 
         QFile exportFile("/sys/class/gpio/export");
         exportFile.open(QFile::WriteOnly);
-        exportFile.write("51");
+        exportFile.write(QByteArray::number(mLine));
         exportFile.close();
 
-        // The loop doesn't seem necessary in tests, but seems like a good safe-guard.
-        QFile directionFile("/sys/class/gpio/gpio51/direction");
-        int tries = 0;
-        while (!directionFile.exists() && tries < 10)
+        // The loop doesn't seem necessary in tests, but seems like a good safe-guard. It's short steps, to not delay boot.
+        QFile directionFile(QString("/sys/class/gpio/gpio%1/direction").arg(mLine));
+        int waitedMs = 0;
+        while (!directionFile.exists() && waitedMs < GPIO_EXPORT_TIMEOUT_MS)
         {
-            QThread::msleep(100);
-            tries++;
+            QThread::msleep(GPIO_EXPORT_POLL_MS);
+            waitedMs += GPIO_EXPORT_POLL_MS;
         }
         directionFile.open(QFile::WriteOnly);
         directionFile.write("in");
@@ -46,7 +53,7 @@ GpIOFunctions::GpIOFunctions() : QObject(0),
     }
     if (!mGpIODIR9001AudioPin.exists())
     {
-        emit signalError(QString("Can't find '%1', for determing DIR9001 audio format.").arg(DIR9001_GPIO_FORMAT_PATH));
+        emit signalError(QString("Can't find '%1', for determing DIR9001 audio format.").arg(mGpIODIR9001AudioPin.fileName()));
     }
 
     mGpIODIR9001AudioPin.open(QFile::ReadOnly);
@@ -60,6 +67,9 @@ GpIOFunctions::GpIOFunctions() : QObject(0),
 
 bool GpIOFunctions::DIR9001SeesEncodedAudio()
 {
+    if (mLine < 0)
+        return false;
+
     mGpIODIR9001AudioPin.seek(0);
     char data;
     mGpIODIR9001AudioPin.read(&data, 1);
@@ -25,17 +25,19 @@
 #include <QThread>
 #include <QTimer>
 
-#define DIR9001_GPIO_FORMAT_PATH "/sys/class/gpio/gpio51/value"
+#define GPIO_EXPORT_POLL_MS 2
+#define GPIO_EXPORT_TIMEOUT_MS 1000
 
 class GpIOFunctions : public QObject
 {
     Q_OBJECT
 
+    const int mLine; // -1 when there is no DIR9001.
     QFile mGpIODIR9001AudioPin;
     QTimer mWatchDIRGpioFileTimer;
     bool mLastAudioFormat = false;
 public:
-    GpIOFunctions();
+    GpIOFunctions(int line);
 
     /**
      * The DIR9001 has a pin AUDIO-active-low, which means it's low when the data is PCM audio and high when it's encoded.
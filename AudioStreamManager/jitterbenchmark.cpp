@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "jitterbenchmark.h"
+#include <iostream>
+#include <thread>
+#include <algorithm>
+#include <time.h>
+
+static int64_t toNs(const struct timespec &ts)
+{
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+JitterBenchmark::JitterBenchmark(const ThreadRealtimeSettings &capture, const ThreadRealtimeSettings &playback, int seconds) :
+    mCaptureSettings(capture),
+    mPlaybackSettings(playback),
+    mSeconds(seconds)
+{
+
+}
+
+void JitterBenchmark::measure(const ThreadRealtimeSettings *settings, const QString name, int seconds, Result *result)
+{
+    result->report = applyRealtimeToCurrentThread(*settings, name);
+
+    const int64_t periodNs = JITTER_PERIOD_US * 1000LL;
+    const int periods = static_cast<int>(seconds * 1000000LL / JITTER_PERIOD_US);
+    result->latenciesUs.reserve(periods);
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (int i = 0; i < periods; i++)
+    {
+        int64_t targetNs = toNs(next) + periodNs;
+        next.tv_sec = targetNs / 1000000000LL;
+        next.tv_nsec = targetNs % 1000000000LL;
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        result->latenciesUs.push_back(static_cast<int>((toNs(now) - targetNs) / 1000));
+    }
+}
+
+void JitterBenchmark::runRound(bool realtime)
+{
+    const ThreadRealtimeSettings defaults;
+    Result capture;
+    Result playback;
+
+    std::thread captureThread(&JitterBenchmark::measure, realtime ? &mCaptureSettings : &defaults, QString("Capture"), mSeconds, &capture);
+    std::thread playbackThread(&JitterBenchmark::measure, realtime ? &mPlaybackSettings : &defaults, QString("Decode/Playback"), mSeconds, &playback);
+    captureThread.join();
+    playbackThread.join();
+
+    std::cout << (realtime ? "With real-time settings:" : "Without real-time settings:") << std::endl;
+
+    for (Result *result : {&capture, &playback})
+    {
+        std::vector<int> &l = result->latenciesUs;
+        if (l.empty())
+            continue;
+
+        std::sort(l.begin(), l.end());
+        int64_t sum = 0;
+        for (int v : l)
+            sum += v;
+
+        std::cout << "  " << qPrintable(result->report) << std::endl;
+        std::cout << "    wake-up latency: avg " << sum / static_cast<int64_t>(l.size()) << " us, p99 " << l.at(l.size() * 99 / 100)
+                  << " us, p99.9 " << l.at(l.size() * 999 / 1000) << " us, max " << l.back() << " us, over one period: "
+                  << std::count_if(l.begin(), l.end(), [](int v) { return v > JITTER_PERIOD_US; }) << std::endl;
+    }
+}
+
+int JitterBenchmark::run()
+{
+    std::cout << "Measuring wake-up latency of " << JITTER_PERIOD_US << " us periods for " << mSeconds << " seconds per round." << std::endl;
+    runRound(false);
+    runRound(true);
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef JITTERBENCHMARK_H
+#define JITTERBENCHMARK_H
+
+#include <QString>
+#include <vector>
+
+#include "realtime.h"
+
+#define JITTER_PERIOD_US 1333 // One capture period of FRAMES_IN_BUFFER frames at 48 kHz.
+
+/**
+ * @brief The JitterBenchmark class measures how late the audio threads wake up, with and without the real-time settings.
+ *
+ * It runs a thread per audio thread, with the same settings, that sleeps until the next period with clock_nanosleep() and
+ * measures how late it woke up. Run it while loading the box the way that causes xruns, like an SSH login.
+ */
+class JitterBenchmark
+{
+    const ThreadRealtimeSettings mCaptureSettings;
+    const ThreadRealtimeSettings mPlaybackSettings;
+    const int mSeconds;
+
+    struct Result
+    {
+        QString report;
+        std::vector<int> latenciesUs;
+    };
+
+    static void measure(const ThreadRealtimeSettings *settings, const QString name, int seconds, Result *result);
+    void runRound(bool realtime);
+
+public:
+    JitterBenchmark(const ThreadRealtimeSettings &capture, const ThreadRealtimeSettings &playback, int seconds);
+    int run();
+};
+
+#endif // JITTERBENCHMARK_H
@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "latencycalibration.h"
+#include <QElapsedTimer>
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#define CALIBRATION_SAMPLE_RATE 48000
+#define CALIBRATION_CHANNELS 2
+#define CALIBRATION_UNSUPPORTED -1
+#define CALIBRATION_NO_CLOCK -2
+
+LatencyCalibration::LatencyCalibration(const ThreadRealtimeSettings &realtime, int soakSeconds, int marginPercent, bool tone, const QString &profilePath,
+                                       const QString &captureDevice, const QString &playbackDevice) :
+    mRealtime(realtime),
+    mSoakSeconds(soakSeconds),
+    mMarginPercent(marginPercent),
+    mTone(tone),
+    mProfilePath(profilePath),
+    mCaptureDevice(captureDevice),
+    mPlaybackDevice(playbackDevice)
+{
+
+}
+
+snd_pcm_t *LatencyCalibration::openDevice(snd_pcm_stream_t stream, Candidate &candidate, snd_pcm_uframes_t &periodFrames)
+{
+    snd_pcm_t *pcm = nullptr;
+    snd_pcm_hw_params_t *hw_params = nullptr;
+    unsigned int rate = CALIBRATION_SAMPLE_RATE;
+    int dir = 0;
+
+    const QString &device = stream == SND_PCM_STREAM_CAPTURE ? mCaptureDevice : mPlaybackDevice;
+    if (snd_pcm_open(&pcm, qPrintable(device), stream, 0) < 0)
+        return nullptr;
+
+    snd_pcm_hw_params_malloc(&hw_params);
+
+    bool ok = snd_pcm_hw_params_any(pcm, hw_params) >= 0
+              && snd_pcm_hw_params_set_access(pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED) >= 0
+              && snd_pcm_hw_params_set_format(pcm, hw_params, SND_PCM_FORMAT_S16_LE) >= 0
+              && snd_pcm_hw_params_set_rate_near(pcm, hw_params, &rate, 0) >= 0
+              && snd_pcm_hw_params_set_channels(pcm, hw_params, CALIBRATION_CHANNELS) >= 0
+              && setBufferAndPeriods(pcm, hw_params, candidate.bufferTimeUs, candidate.periods) >= 0
+              && snd_pcm_hw_params(pcm, hw_params) >= 0
+              && snd_pcm_hw_params_get_period_size(hw_params, &periodFrames, &dir) >= 0
+              && snd_pcm_hw_params_get_periods(hw_params, &candidate.periods, &dir) >= 0
+              && snd_pcm_prepare(pcm) >= 0;
+
+    snd_pcm_hw_params_free(hw_params);
+
+    if (!ok)
+    {
+        snd_pcm_close(pcm);
+        return nullptr;
+    }
+
+    return pcm;
+}
+
+void LatencyCalibration::fillTone(int16_t *samples, int frames)
+{
+    const double step = 2 * M_PI * CALIBRATION_TONE_HZ / CALIBRATION_SAMPLE_RATE;
+    for (int f = 0; f < frames; f++)
+    {
+        const int16_t value = static_cast<int16_t>(std::sin(mTonePhase) * 3276); // -20 dBFS
+        for (int c = 0; c < CALIBRATION_CHANNELS; c++)
+            samples[f * CALIBRATION_CHANNELS + c] = value;
+        mTonePhase = std::fmod(mTonePhase + step, 2 * M_PI);
+    }
+}
+
+/**
+ * @brief LatencyCalibration::soak streams with one configuration until the soak time is over, or the first xrun.
+ * @return the amount of xruns (0 or 1), CALIBRATION_UNSUPPORTED or CALIBRATION_NO_CLOCK.
+ */
+int LatencyCalibration::soak(Candidate candidate, QString &report)
+{
+    Candidate captureConfig = candidate;
+    Candidate playbackConfig = candidate;
+    snd_pcm_uframes_t capturePeriod = 0;
+    snd_pcm_uframes_t playbackPeriod = 0;
+
+    snd_pcm_t *capture = openDevice(SND_PCM_STREAM_CAPTURE, captureConfig, capturePeriod);
+    snd_pcm_t *playback = openDevice(SND_PCM_STREAM_PLAYBACK, playbackConfig, playbackPeriod);
+
+    report = QString("buffer %1 us (capture %2 us, playback %3 us), %4 periods: ").arg(candidate.bufferTimeUs)
+            .arg(captureConfig.bufferTimeUs).arg(playbackConfig.bufferTimeUs).arg(candidate.periods);
+
+    if (!capture || !playback)
+    {
+        report += "not supported";
+        if (capture)
+            snd_pcm_close(capture);
+        if (playback)
+            snd_pcm_close(playback);
+        return CALIBRATION_UNSUPPORTED;
+    }
+
+    const snd_pcm_uframes_t period = capturePeriod;
+    std::vector<int16_t> samples(std::max(capturePeriod, playbackPeriod) * captureConfig.periods * CALIBRATION_CHANNELS, 0);
+
+    // Leave room for one period, so the first write doesn't block while the capture device fills up.
+    const snd_pcm_uframes_t prefill = playbackPeriod * (playbackConfig.periods - 1);
+    snd_pcm_writei(playback, samples.data(), std::min<snd_pcm_uframes_t>(prefill, samples.size() / CALIBRATION_CHANNELS));
+    snd_pcm_start(capture);
+
+    int xruns = 0;
+    QElapsedTimer timer;
+    timer.start();
+
+    while (xruns == 0 && timer.elapsed() < mSoakSeconds * 1000)
+    {
+        if (snd_pcm_wait(capture, CALIBRATION_CLOCK_TIMEOUT_MS) == 0)
+        {
+            report += "no input clock";
+            xruns = CALIBRATION_NO_CLOCK;
+            break;
+        }
+
+        snd_pcm_sframes_t framesRead = snd_pcm_readi(capture, samples.data(), period);
+        if (framesRead < 0)
+        {
+            report += QString("capture xrun after %1 ms").arg(timer.elapsed());
+            xruns++;
+            break;
+        }
+
+        if (mTone)
+            fillTone(samples.data(), framesRead);
+
+        snd_pcm_sframes_t framesWritten = snd_pcm_writei(playback, samples.data(), framesRead);
+        if (framesWritten < 0)
+        {
+            report += QString("playback xrun after %1 ms").arg(timer.elapsed());
+            xruns++;
+            break;
+        }
+    }
+
+    if (xruns == 0)
+        report += "no xruns";
+
+    snd_pcm_drop(capture);
+    snd_pcm_drop(playback);
+    snd_pcm_close(capture);
+    snd_pcm_close(playback);
+    return xruns;
+}
+
+int LatencyCalibration::run()
+{
+    std::cout << qPrintable(applyRealtimeToCurrentThread(mRealtime, "Calibration")) << std::endl;
+    std::cout << "Calibrating latency of " << qPrintable(mCaptureDevice) << " to " << qPrintable(mPlaybackDevice) << " with "
+              << (mTone ? "a generated tone" : "the S/PDIF input") << ", soaking each configuration for " << mSoakSeconds << " seconds." << std::endl;
+
+    bool found = false;
+    Candidate smallest = {0, 0};
+
+    // From safe to tight. Per buffer time, two periods is tried before four, because it means half the wake-ups.
+    for (unsigned int bufferTimeUs : {40000, 30000, 20000, 15000, 10000, 8000, 6000, 5000, 4000, 3000, 2000})
+    {
+        bool passed = false;
+        bool supported = false;
+
+        for (unsigned int periods : {2, 4})
+        {
+            QString report;
+            const int xruns = soak({bufferTimeUs, periods}, report);
+            std::cout << "  " << qPrintable(report) << std::endl;
+
+            if (xruns == CALIBRATION_NO_CLOCK)
+            {
+                std::cerr << "Calibration needs an S/PDIF input, because it clocks the capture and playback device." << std::endl;
+                return 1;
+            }
+
+            supported |= xruns != CALIBRATION_UNSUPPORTED;
+
+            if (xruns == 0)
+            {
+                passed = true;
+                found = true;
+                smallest = {bufferTimeUs, periods};
+                break;
+            }
+        }
+
+        if (supported && !passed)
+            break;
+    }
+
+    if (!found)
+    {
+        std::cerr << "No configuration ran without xruns; keeping the defaults." << std::endl;
+        return 1;
+    }
+
+    const unsigned int bufferTimeUs = smallest.bufferTimeUs * (100 + mMarginPercent) / 100;
+
+    LatencyProfile profile;
+    profile.captureBufferUs = bufferTimeUs;
+    profile.rawPlaybackBufferUs = bufferTimeUs;
+    profile.decodedPlaybackBufferUs = bufferTimeUs + CALIBRATION_DECODE_BURST_US;
+    profile.periods = smallest.periods;
+    profile.save(mProfilePath);
+
+    std::cout << "Smallest buffer without xruns: " << smallest.bufferTimeUs << " us with " << smallest.periods << " periods. With "
+              << mMarginPercent << "% margin, saved to " << qPrintable(mProfilePath) << ": " << qPrintable(profile.describe()) << std::endl;
+    return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef LATENCYCALIBRATION_H
+#define LATENCYCALIBRATION_H
+
+#include <QString>
+#include <alsa/asoundlib.h>
+
+#include "latencyprofile.h"
+#include "realtime.h"
+
+#define CALIBRATION_DECODE_BURST_US 40000 // Extra buffer for the decoding path; an AC-3 frame is 32 ms.
+#define CALIBRATION_CLOCK_TIMEOUT_MS 1000
+#define CALIBRATION_TONE_HZ 1000
+
+/**
+ * @brief The LatencyCalibration class finds the smallest ALSA buffers that play without xruns on this box.
+ *
+ * It copies the capture device to the playback device, or plays a tone clocked by the capture device, and steps the buffer
+ * time down from a safe value. Every size is soaked for a while, and the first one that has an xrun ends the search. The
+ * smallest size that survived, plus a margin, is saved as latency profile, which normal runs load.
+ *
+ * There must be an S/PDIF input, because the DIR9001 clocks everything. The devices are those of the config, so the
+ * profile is for the devices normal runs use.
+ */
+class LatencyCalibration
+{
+    struct Candidate
+    {
+        unsigned int bufferTimeUs;
+        unsigned int periods;
+    };
+
+    const ThreadRealtimeSettings mRealtime;
+    const int mSoakSeconds;
+    const int mMarginPercent;
+    const bool mTone;
+    const QString mProfilePath;
+    const QString mCaptureDevice;
+    const QString mPlaybackDevice;
+    double mTonePhase = 0;
+
+    snd_pcm_t *openDevice(snd_pcm_stream_t stream, Candidate &candidate, snd_pcm_uframes_t &periodFrames);
+    int soak(Candidate candidate, QString &report);
+    void fillTone(int16_t *samples, int frames);
+
+public:
+    LatencyCalibration(const ThreadRealtimeSettings &realtime, int soakSeconds, int marginPercent, bool tone, const QString &profilePath,
+                       const QString &captureDevice, const QString &playbackDevice);
+    int run();
+};
+
+#endif // LATENCYCALIBRATION_H
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "latencyprofile.h"
+#include <QSettings>
+#include <QFileInfo>
+#include <QDir>
+#include "annotatedexception.h"
+
+/**
+ * @brief LatencyProfile::load reads a profile saved by a calibration run.
+ * @return false when there is no such file, in which case nothing is changed.
+ */
+bool LatencyProfile::load(const QString &path)
+{
+    if (!QFileInfo(path).exists())
+        return false;
+
+    QSettings file(path, QSettings::IniFormat);
+    captureBufferUs = file.value("capture_buffer_us", captureBufferUs).toUInt();
+    rawPlaybackBufferUs = file.value("raw_playback_buffer_us", rawPlaybackBufferUs).toUInt();
+    decodedPlaybackBufferUs = file.value("decoded_playback_buffer_us", decodedPlaybackBufferUs).toUInt();
+    periods = file.value("periods", periods).toUInt();
+    return true;
+}
+
+void LatencyProfile::save(const QString &path) const
+{
+    QDir().mkpath(QFileInfo(path).absolutePath());
+
+    QSettings file(path, QSettings::IniFormat);
+    file.setValue("capture_buffer_us", captureBufferUs);
+    file.setValue("raw_playback_buffer_us", rawPlaybackBufferUs);
+    file.setValue("decoded_playback_buffer_us", decodedPlaybackBufferUs);
+    file.setValue("periods", periods);
+    file.sync();
+
+    if (file.status() != QSettings::NoError)
+        throw AnnotatedException(QString("Can't write latency profile to '%1'").arg(path));
+}
+
+QString LatencyProfile::describe() const
+{
+    return QString("capture buffer %1 us, raw PCM playback buffer %2 us, decoded playback buffer %3 us, periods: %4")
+            .arg(captureBufferUs).arg(rawPlaybackBufferUs).arg(decodedPlaybackBufferUs)
+            .arg(periods > 0 ? QString::number(periods) : QString("driver default"));
+}
+
+/**
+ * @brief setBufferAndPeriods sets the buffer time, and the amount of periods in it if not 0, on hardware parameters being configured.
+ * @param bufferTimeUs is set to the buffer time the device actually uses.
+ */
+int setBufferAndPeriods(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw_params, unsigned int &bufferTimeUs, unsigned int periods)
+{
+    int dir = 0;
+    int ret = 0;
+
+    if (periods > 0)
+    {
+        ret = snd_pcm_hw_params_set_periods_near(pcm, hw_params, &periods, &dir);
+        if (ret < 0)
+            return ret;
+    }
+
+    dir = 0;
+    return snd_pcm_hw_params_set_buffer_time_near(pcm, hw_params, &bufferTimeUs, &dir);
+}
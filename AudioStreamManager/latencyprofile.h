@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef LATENCYPROFILE_H
+#define LATENCYPROFILE_H
+
+#include <QString>
+#include <alsa/asoundlib.h>
+
+#define LATENCY_PROFILE_PATH "/var/lib/audiostreammanager/latency.ini"
+
+/**
+ * @brief The LatencyProfile struct holds the ALSA buffer sizes, which are either the safe defaults or the result of --calibrate-latency.
+ */
+struct LatencyProfile
+{
+    unsigned int captureBufferUs = 10000;
+    unsigned int rawPlaybackBufferUs = 10000;
+    unsigned int decodedPlaybackBufferUs = 50000; // The decoding path gets audio a codec frame at a time.
+    unsigned int periods = 0; // 0 leaves it to the driver.
+
+    bool load(const QString &path);
+    void save(const QString &path) const;
+    QString describe() const;
+};
+
+int setBufferAndPeriods(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw_params, unsigned int &bufferTimeUs, unsigned int periods);
+
+#endif // LATENCYPROFILE_H
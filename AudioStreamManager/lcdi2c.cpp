@@ -21,6 +21,9 @@
 #include <QThread>
 #include <iostream>
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
 
 void LCDi2c::checkError(int retcode)
 {
@@ -60,14 +63,48 @@ void LCDi2c::i2c_write(uint8_t daddress, uint8_t value)
     i2c_access(I2C_SMBUS_WRITE, daddress, &data);
 }
 
-LCDi2c::LCDi2c(QObject *parent) : QObject(parent),
-    devFile(DEV_PATH)
+/**
+ * @brief LCDi2c::i2c_write_text sets the DDRAM address and writes the characters, in one I2C transfer.
+ */
+void LCDi2c::i2c_write_text(uint8_t startAddress, const char *text, int length)
 {
+    if (!isOpen)
+        return;
+
+    uint8_t buf[LCD_LINE_RAM + 3];
+    buf[0] = CONTINUED_INSTRUCTION;
+    buf[1] = 0b10000000 | startAddress; // Set DDRAM address
+    buf[2] = DATA_ADDRESS; // Co bit cleared: the rest is data.
+    memcpy(&buf[3], text, length);
 
+    if (write(devFile.handle(), buf, length + 3) < 0)
+    {
+        int err = errno;
+        std::cerr << "Writing to LCD failed: '" << strerror(err) << "'. Disabling LCD." << std::endl;
+        isOpen = false;
+    }
+}
+
+LCDi2c::LCDi2c(QObject *parent) : QObject(parent),
+    devFile(DEV_PATH),
+    isOpen(false)
+{
+    memset(mWanted, 0, sizeof(mWanted));
+    memset(mShown, ' ', sizeof(mShown)); // What Clear Display leaves.
 }
 
 LCDi2c::~LCDi2c()
 {
+    if (mRenderThread.joinable())
+    {
+        {
+            QMutexLocker locker(&mFrameMutex);
+            mStopRender = true;
+            mFrameChanged.wakeAll();
+        }
+        mRenderThread.join();
+    }
+
     devFile.close();
 }
 
@@ -103,38 +140,105 @@ void LCDi2c::open()
     i2c_write(INSTRUCTION_ADDRESS, 0x01); // Clear Display
 
     QThread::msleep(10); // TODO: read the state from the chip to see when it's ready.
+
+    mRenderThread = std::thread(&LCDi2c::renderLoop, this);
 }
 
-void LCDi2c::writeText(uint8_t startAddress, QString &msg)
+/**
+ * @brief LCDi2c::setLine sets what a line should show. It returns right away; the render thread writes it.
+ */
+void LCDi2c::setLine(int line, const QString &msg)
 {
-    if (!isOpen)
+    char text[LCD_LINE_RAM];
+    memset(text, 0, LCD_LINE_RAM); // Clears the rest of the line.
+
+    const QByteArray latin1 = msg.toLatin1();
+    memcpy(text, latin1.constData(), std::min(latin1.size(), LCD_LINE_RAM));
+
+    QMutexLocker locker(&mFrameMutex);
+
+    if (memcmp(mWanted[line], text, LCD_LINE_RAM) == 0)
         return;
 
-    i2c_write(INSTRUCTION_ADDRESS, 0b10000000 | startAddress);
-    int i = 0;
-    foreach (QChar c, msg)
+    memcpy(mWanted[line], text, LCD_LINE_RAM);
+    mDirty = true;
+    mFrameChanged.wakeAll();
+}
+
+void LCDi2c::renderLoop()
+{
+    char wanted[LCD_LINES][LCD_LINE_RAM];
+
+    while (true)
     {
-        i2c_write(DATA_ADDRESS, c.toLatin1());
+        {
+            QMutexLocker locker(&mFrameMutex);
+            while (!mDirty && !mStopRender)
+                mFrameChanged.wait(&mFrameMutex);
 
-        // Even though the display is 20 chars wide, the extra RAM can be used for scrolling text. Currently I didn't implement that yet.
-        i++;
-        if (i >= 40)
-            break;
+            if (mStopRender)
+                return;
+
+            memcpy(wanted, mWanted, sizeof(wanted));
+            mDirty = false;
+        }
+
+        for (int line = 0; line < LCD_LINES; line++)
+            renderLine(line, wanted[line]);
+
+        // Whatever comes in now is coalesced into the next update.
+        QThread::msleep(LCD_MIN_UPDATE_INTERVAL_MS);
     }
+}
 
-    // Clear the rest of the line
-    while (i++ < 40)
+/**
+ * @brief LCDi2c::renderLine writes the runs of characters that differ from what the display shows.
+ *
+ * Runs separated by only a few unchanged characters are merged, because a new transfer costs more than those characters.
+ */
+void LCDi2c::renderLine(int line, const char *wanted)
+{
+    const uint8_t lineAddress = line == 0 ? 0 : 0x40;
+    const int mergeGap = 3;
+    char *shown = mShown[line];
+
+    int i = 0;
+    while (i < LCD_LINE_RAM)
     {
-        i2c_write(DATA_ADDRESS, 0);
+        if (wanted[i] == shown[i])
+        {
+            i++;
+            continue;
+        }
+
+        const int start = i;
+        int end = i + 1;
+        int same = 0;
+        for (int j = end; j < LCD_LINE_RAM && same <= mergeGap; j++)
+        {
+            if (wanted[j] == shown[j])
+            {
+                same++;
+            }
+            else
+            {
+                same = 0;
+                end = j + 1;
+            }
+        }
+
+        i2c_write_text(lineAddress + start, wanted + start, end - start);
+        memcpy(shown + start, wanted + start, end - start);
+        i = end;
     }
 }
 
 void LCDi2c::setLineOne(QString msg)
 {
-    writeText(0, msg);
+    setLine(0, msg);
 }
 
 void LCDi2c::setLineTwo(QString msg)
 {
-    writeText(0x40, msg);
+    setLine(1, msg);
 }
@@ -26,22 +26,44 @@
 
 #include <QObject>
 #include <QFile>
+#include <QMutex>
+#include <QWaitCondition>
+#include <atomic>
+#include <thread>
 #include <annotatedexception.h>
 
 #define DEV_PATH "/dev/i2c-1"
 #define DEVICE_ADDRESS 0x3c
 #define INSTRUCTION_ADDRESS 0x00
 #define DATA_ADDRESS 0x40
+#define CONTINUED_INSTRUCTION 0x80 // Control byte with the Co bit: one instruction byte follows, and then another control byte.
+
+#define LCD_LINES 2
+#define LCD_LINE_RAM 40 // Even though the display is 20 chars wide, the extra RAM can be used for scrolling text.
+#define LCD_MIN_UPDATE_INTERVAL_MS 100
 
 /**
  * @brief The LCDi2c class controls a midas-MCCOG22005A6W-BNMLWI I2c display, which is simply a ST7032 controller.
+ *
+ * Setting a line only changes the wanted frame; a render thread sends it. It compares it to what the display shows, and
+ * writes each run of changed characters as one I2C transfer: the ST7032 takes the DDRAM address instruction and all data
+ * bytes after a single start condition. Updates are rate limited, and the ones in between are coalesced.
  */
 class LCDi2c : public QObject
 {
     Q_OBJECT
 
     QFile devFile;
-    bool isOpen = false;
+    std::atomic<bool> isOpen;
+
+    QMutex mFrameMutex;
+    QWaitCondition mFrameChanged;
+    char mWanted[LCD_LINES][LCD_LINE_RAM];
+    bool mDirty = false;
+    bool mStopRender = false;
+
+    char mShown[LCD_LINES][LCD_LINE_RAM]; // Only touched by the render thread.
+    std::thread mRenderThread;
 
     /**
      * @brief checkError checks the return code and generates a message using the kernel's strerror function and
@@ -54,7 +76,10 @@ class LCDi2c : public QObject
 
     void i2c_access(char rw, uint8_t command, union i2c_smbus_data *data);
     void i2c_write(uint8_t daddress, uint8_t value);
-    void writeText(uint8_t startAddress, QString &msg);
+    void i2c_write_text(uint8_t startAddress, const char *text, int length);
+    void setLine(int line, const QString &msg);
+    void renderLoop();
+    void renderLine(int line, const char *wanted);
 public:
     explicit LCDi2c(QObject *parent = nullptr);
     ~LCDi2c();
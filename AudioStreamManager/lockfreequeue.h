@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef LOCKFREEQUEUE_H
+#define LOCKFREEQUEUE_H
+
+#include <atomic>
+
+/**
+ * @brief The LockFreeQueue class is a bounded queue that any thread can push to and pop from without locking.
+ *
+ * It's Dmitry Vyukov's bounded MPMC queue: every cell has a sequence number that says whether it's free for the producer of
+ * that position, or filled for the consumer of it. Size must be a power of two, so the positions stay valid when they wrap.
+ */
+template <typename T, unsigned int Size>
+class LockFreeQueue
+{
+    struct Cell
+    {
+        std::atomic<unsigned int> sequence;
+        T data;
+    };
+
+    Cell mCells[Size];
+    std::atomic<unsigned int> mEnqueuePos;
+    std::atomic<unsigned int> mDequeuePos;
+
+public:
+    LockFreeQueue() :
+        mEnqueuePos(0),
+        mDequeuePos(0)
+    {
+        static_assert((Size & (Size - 1)) == 0, "Size must be a power of two");
+
+        for (unsigned int i = 0; i < Size; i++)
+            mCells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    /**
+     * @return false when the queue is full.
+     */
+    bool push(const T &data)
+    {
+        unsigned int pos = mEnqueuePos.load(std::memory_order_relaxed);
+
+        while (true)
+        {
+            Cell &cell = mCells[pos % Size];
+            const unsigned int sequence = cell.sequence.load(std::memory_order_acquire);
+            const int diff = static_cast<int>(sequence - pos);
+
+            if (diff == 0)
+            {
+                if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.data = data;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * @return false when the queue is empty.
+     */
+    bool pop(T &data)
+    {
+        unsigned int pos = mDequeuePos.load(std::memory_order_relaxed);
+
+        while (true)
+        {
+            Cell &cell = mCells[pos % Size];
+            const unsigned int sequence = cell.sequence.load(std::memory_order_acquire);
+            const int diff = static_cast<int>(sequence - (pos + 1));
+
+            if (diff == 0)
+            {
+                if (mDequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    data = cell.data;
+                    cell.sequence.store(pos + Size, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = mDequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+#endif // LOCKFREEQUEUE_H
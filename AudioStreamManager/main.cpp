@@ -18,20 +18,126 @@
  */
 
 #include <QCoreApplication>
+#include <QList>
 #include <streammanager.h>
 #include <lcdi2c.h>
+#include <settings.h>
+#include <decoderbenchmark.h>
+#include <jitterbenchmark.h>
+#include <latencycalibration.h>
+#include <realtime.h>
+#include <startuptrace.h>
+#include <tracer.h>
+#include <bitstreamrecorder.h>
+#include <replayharness.h>
+#include <runtimeconfig.h>
+#include <signal.h>
+#include <thread>
+#include <exception>
+
+static void onTraceSignal(int signal)
+{
+    if (signal == SIGUSR1)
+        Tracer::requestDump();
+    else if (signal == SIGUSR2)
+        Tracer::setEnabled(!Tracer::enabled());
+}
+
+static void onRecorderSignal(int signal)
+{
+    Q_UNUSED(signal)
+    BitstreamRecorder::requestToggle();
+}
+
+static void onReloadSignal(int signal)
+{
+    Q_UNUSED(signal)
+    RuntimeConfig::requestReload();
+}
 
 int main(int argc, char *argv[])
 {
+    StartupTrace::start();
+
     try
     {
         QCoreApplication a(argc, argv);
 
+        Settings settings;
+        settings.parseCommandLine(a);
+
+        if (!settings.decoderBenchmarkFiles.isEmpty())
+        {
+            DecoderBenchmark benchmark(SpeakerLayout::fromName(settings.speakerLayout));
+            return benchmark.run(settings.decoderBenchmarkFiles);
+        }
+
+        if (settings.jitterBenchmarkSeconds > 0)
+        {
+            JitterBenchmark benchmark(settings.captureRealtime, settings.playbackRealtime, settings.jitterBenchmarkSeconds);
+            return benchmark.run();
+        }
+
+        if (settings.calibrateLatencySeconds > 0)
+        {
+            LatencyCalibration calibration(settings.captureRealtime, settings.calibrateLatencySeconds, settings.calibrationMarginPercent,
+                                           settings.calibrateWithTone, settings.latencyProfilePath, settings.runtime.captureDevice,
+                                           settings.runtime.playbackDevice);
+            return calibration.run();
+        }
+
+        if (settings.lockMemory)
+            std::cout << qPrintable(lockMemory()) << std::endl;
+
+        Tracer::setEnabled(settings.traceEnabled);
+        signal(SIGUSR1, onTraceSignal);
+        signal(SIGUSR2, onTraceSignal);
+        signal(SIGRTMIN, onRecorderSignal);
+        signal(SIGHUP, onReloadSignal);
+
+        if (!settings.replayScript.isEmpty())
+        {
+            ReplayHarness harness(settings);
+            return harness.run();
+        }
+
+        const QList<Settings> pipelines = settings.pipelines();
+
+        // The LCD init sleeps, and the display can be written before it's done, so it runs in parallel with the audio setup.
         LCDi2c lcd;
-        lcd.open();
+        std::exception_ptr lcdError;
+        std::thread lcdInit([&lcd, &lcdError]() {
+            StartupPhase phase("LCD init");
+            try
+            {
+                lcd.open();
+            }
+            catch (...)
+            {
+                lcdError = std::current_exception();
+            }
+        });
+
+        // The managers are children of this, so they're deleted when it goes, also when one of them fails to build.
+        QObject managerOwner;
+        QList<StreamManager*> managers;
+        try
+        {
+            for (int i = 0; i < pipelines.size(); i++)
+                managers << new StreamManager(i == 0 ? &lcd : nullptr, pipelines.at(i), &managerOwner);
+        }
+        catch (...)
+        {
+            lcdInit.join();
+            throw;
+        }
+
+        lcdInit.join();
+        if (lcdError)
+            std::rethrow_exception(lcdError);
 
-        StreamManager manager(lcd);
-        manager.start();
+        for (StreamManager *manager : managers)
+            manager->start();
 
         return a.exec();
     }
@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "mixercontrol.h"
+#include <iostream>
+#include <algorithm>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "startuptrace.h"
+
+MixerControl::MixerControl(const QString &card, const QStringList &elementNames) : QObject(nullptr),
+    mCard(card),
+    mElementNames(elementNames),
+    mWantedMute(MIXER_MUTE_NO_CHANGE),
+    mWakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    mAvailable(false),
+    mMuted(false)
+{
+    mThread.setObjectName("Mixer");
+    moveToThread(&mThread);
+}
+
+MixerControl::~MixerControl()
+{
+    stop();
+    close(mWakeFd);
+}
+
+void MixerControl::start()
+{
+    mThread.start();
+    QMetaObject::invokeMethod(this, "doWork");
+}
+
+void MixerControl::stop()
+{
+    mStop.requestStop();
+    wake();
+    mThread.quit();
+    mThread.wait();
+}
+
+void MixerControl::wake()
+{
+    const uint64_t one = 1;
+    ssize_t ret = write(mWakeFd, &one, sizeof(one));
+    Q_UNUSED(ret)
+}
+
+/**
+ * @brief MixerControl::setMute asks the mixer thread for a mute change. Lock-free, so it can be called from the audio threads.
+ *
+ * When the thread hasn't gotten to an earlier change yet, this one replaces it.
+ */
+void MixerControl::setMute(bool mute)
+{
+    mWantedMute = mute ? 1 : 0;
+    wake();
+}
+
+/**
+ * @brief MixerControl::isMuted returns the mute state as last seen by the mixer thread, which includes changes made by other mixers.
+ */
+bool MixerControl::isMuted() const
+{
+    return mMuted;
+}
+
+bool MixerControl::isAvailable() const
+{
+    return mAvailable;
+}
+
+bool MixerControl::openMixer()
+{
+    StartupPhase phase("mixer open");
+
+    int ret = 0;
+    if ((ret = snd_mixer_open(&mMixer, 0)) < 0
+            || (ret = snd_mixer_attach(mMixer, qPrintable(mCard))) < 0
+            || (ret = snd_mixer_selem_register(mMixer, nullptr, nullptr)) < 0
+            || (ret = snd_mixer_load(mMixer)) < 0)
+    {
+        std::cerr << "Something went wrong with the alser mixer and I'm too lazy to figure out what. Error code: " << ret << std::endl;
+        closeMixer();
+        return false;
+    }
+
+    for (const QString &name : mElementNames)
+    {
+        snd_mixer_selem_id_t *sid;
+        snd_mixer_selem_id_alloca(&sid);
+        snd_mixer_selem_id_set_index(sid, 0);
+        snd_mixer_selem_id_set_name(sid, qPrintable(name));
+        snd_mixer_elem_t* elem = snd_mixer_find_selem(mMixer, sid);
+
+        if (elem && snd_mixer_selem_has_playback_switch(elem))
+            mSwitches.append(elem);
+        else
+            std::cerr << "Mixer element '" << qPrintable(name) << "' not found, or it has no playback switch." << std::endl;
+    }
+
+    return true;
+}
+
+void MixerControl::closeMixer()
+{
+    mSwitches.clear();
+
+    if (mMixer)
+    {
+        snd_mixer_close(mMixer);
+        mMixer = nullptr;
+    }
+}
+
+void MixerControl::applyWantedMute()
+{
+    const int wantedMute = mWantedMute.exchange(MIXER_MUTE_NO_CHANGE);
+    if (wantedMute == MIXER_MUTE_NO_CHANGE)
+        return;
+
+    for (snd_mixer_elem_t *elem : mSwitches)
+        snd_mixer_selem_set_playback_switch_all(elem, static_cast<int>(!wantedMute));
+
+    emit muteApplied(wantedMute != 0);
+}
+
+/**
+ * @brief MixerControl::readMute updates the cached state: muted when any channel of any element is switched off.
+ */
+void MixerControl::readMute()
+{
+    bool muted = false;
+
+    for (snd_mixer_elem_t *elem : mSwitches)
+    {
+        // Idea of going over 32 channels taken from alsa-lib source code for snd_mixer_selem_set_playback_switch_all()
+        for (int i = 0; i < 32 && !muted; i++)
+        {
+            snd_mixer_selem_channel_id_t chn = static_cast<snd_mixer_selem_channel_id_t>(i);
+            if (!snd_mixer_selem_has_playback_channel(elem, chn))
+                continue;
+
+            int value = 0;
+            if (snd_mixer_selem_get_playback_switch(elem, chn, &value) == 0 && value == 0)
+                muted = true;
+        }
+    }
+
+    if (mMuted.exchange(muted) != muted)
+        emit muteChanged(muted);
+}
+
+void MixerControl::doWork()
+{
+    if (!openMixer())
+        return;
+
+    mAvailable = true;
+
+    // A mute change asked for before the mixer was open goes first, so the first state we publish includes it.
+    applyWantedMute();
+    readMute();
+
+    const int mixerFdCount = std::max(0, snd_mixer_poll_descriptors_count(mMixer));
+    QVector<struct pollfd> fds(mixerFdCount + 1);
+
+    while (!mStop.stopRequested())
+    {
+        snd_mixer_poll_descriptors(mMixer, fds.data(), mixerFdCount);
+        fds[mixerFdCount].fd = mWakeFd;
+        fds[mixerFdCount].events = POLLIN;
+        fds[mixerFdCount].revents = 0;
+
+        if (poll(fds.data(), fds.size(), -1) <= 0)
+            continue;
+
+        if (fds.at(mixerFdCount).revents & POLLIN)
+        {
+            uint64_t count;
+            ssize_t ret = read(mWakeFd, &count, sizeof(count));
+            Q_UNUSED(ret)
+            applyWantedMute();
+        }
+
+        unsigned short revents = 0;
+        snd_mixer_poll_descriptors_revents(mMixer, fds.data(), mixerFdCount, &revents);
+        if (revents & (POLLIN | POLLERR))
+            snd_mixer_handle_events(mMixer);
+
+        // Our own changes also come back as events, but reading is cheap and doesn't depend on that.
+        readMute();
+    }
+
+    mAvailable = false;
+    closeMixer();
+}
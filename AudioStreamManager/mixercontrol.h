@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef MIXERCONTROL_H
+#define MIXERCONTROL_H
+
+#include <QObject>
+#include <QThread>
+#include <QStringList>
+#include <QVector>
+#include <atomic>
+#include <alsa/asoundlib.h>
+
+#include "stoptoken.h"
+
+#define MIXER_MUTE_NO_CHANGE -1
+
+/**
+ * @brief The MixerControl class does all mixer work in its own thread, so the audio threads never make mixer syscalls.
+ *
+ * It keeps one mixer handle open, with the elements looked up once. The wanted mute state is kept in an atomic, which the
+ * thread applies when an eventfd wakes it; only the last wish counts, so nothing can be lost when it's slow. Changes made
+ * by other mixers, like the one that mutes us on boot, come in as mixer events through snd_mixer_poll_descriptors(), and
+ * update the cached mute state that isMuted() returns.
+ *
+ * The PCM1690 DAC driver I wrote is not a proper one that exposes a multi-channel DAC that ALSA understands, nor does it
+ * have a master control. So, mute is the playback switch of all channel pair elements.
+ */
+class MixerControl : public QObject
+{
+    Q_OBJECT
+
+    const QString mCard;
+    const QStringList mElementNames;
+
+    std::atomic<int> mWantedMute; // MIXER_MUTE_NO_CHANGE, or 0 or 1 to apply.
+    int mWakeFd;
+    StopToken mStop;
+    QThread mThread;
+
+    // Only touched by the mixer thread.
+    snd_mixer_t *mMixer = nullptr;
+    QVector<snd_mixer_elem_t*> mSwitches;
+
+    std::atomic<bool> mAvailable;
+    std::atomic<bool> mMuted;
+
+    bool openMixer();
+    void closeMixer();
+    void applyWantedMute();
+    void readMute();
+    void wake();
+
+public:
+    MixerControl(const QString &card, const QStringList &elementNames);
+    ~MixerControl();
+
+    void start();
+    void stop();
+
+    void setMute(bool mute);
+    bool isMuted() const;
+    bool isAvailable() const;
+
+public slots:
+    void doWork();
+
+signals:
+    void muteChanged(bool muted);
+    void muteApplied(bool muted); // Our own change was made; mute changes reported after this come after it.
+};
+
+#endif // MIXERCONTROL_H
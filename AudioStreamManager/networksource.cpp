@@ -0,0 +1,444 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "networksource.h"
+#include <QStringList>
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "annotatedexception.h"
+#include "rtpsender.h"
+#include "tracer.h"
+
+static qint64 monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<qint64>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @param address address:port to listen on; with a multicast address, the group is joined on all interfaces.
+ * @param protocol rtp or udp.
+ * @param producer writes to the ring buffer; it's called from the receive thread.
+ */
+NetworkSource::NetworkSource(const QString &address, const QString &protocol, int jitterMs, const Producer &producer) :
+    mProducer(producer),
+    mRtp(protocol.compare("rtp", Qt::CaseInsensitive) == 0),
+    mJitterFrames(std::max(0, jitterMs) * NET_SAMPLE_RATE / 1000),
+    mStop(false),
+    mSlots(new Slot[NET_JITTER_SLOTS]),
+    mSilence(new int16_t[NET_MAX_PACKET_BYTES / sizeof(int16_t)]),
+    mSsrc(std::random_device()()),
+    mEncoded(false),
+    mPacketsReceived(0),
+    mPacketsLost(0),
+    mPacketsLate(0),
+    mResyncs(0),
+    mJitterUs(0),
+    mSenderClockPpm(0)
+{
+    if (!mRtp && protocol.compare("udp", Qt::CaseInsensitive) != 0)
+        throw AnnotatedException(QString("Unknown network source protocol '%1'; use rtp or udp").arg(protocol));
+
+    const QStringList parts = address.split(':');
+    const int port = parts.size() > 1 ? parts.at(1).toInt() : NET_DEFAULT_PORT;
+    memset(&mAddress, 0, sizeof(mAddress));
+    mAddress.sin_family = AF_INET;
+    mAddress.sin_port = htons(static_cast<uint16_t>(port));
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, parts.at(0).toLatin1().constData(), &mAddress.sin_addr) != 1)
+        throw AnnotatedException(QString("Invalid network source address '%1'").arg(address));
+    mMulticast = IN_MULTICAST(ntohl(mAddress.sin_addr.s_addr));
+
+    memset(mSilence, 0, NET_MAX_PACKET_BYTES);
+    memset(&mSenderAddress, 0, sizeof(mSenderAddress));
+}
+
+NetworkSource::~NetworkSource()
+{
+    stop();
+    delete[] mSlots;
+    delete[] mSilence;
+}
+
+void NetworkSource::start(const ThreadRealtimeSettings &realtime)
+{
+    mSocket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (mSocket < 0)
+        throw AnnotatedException(QString("Can't create network source socket: %1").arg(strerror(errno)));
+
+    const int one = 1;
+    const int receiveBuffer = NET_RECEIVE_BUFFER_BYTES;
+    setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(mSocket, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+
+    sockaddr_in bindAddress = mAddress;
+    if (mMulticast)
+        bindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(mSocket, reinterpret_cast<const sockaddr*>(&bindAddress), sizeof(bindAddress)) < 0)
+        throw AnnotatedException(QString("Can't bind network source socket: %1").arg(strerror(errno)));
+
+    if (mMulticast)
+    {
+        ip_mreq membership;
+        membership.imr_multiaddr = mAddress.sin_addr;
+        membership.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(mSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0)
+            throw AnnotatedException(QString("Can't join multicast group: %1").arg(strerror(errno)));
+    }
+
+    mRealtime = realtime;
+    mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    mStop = false;
+    mThread = std::thread(&NetworkSource::receiveLoop, this);
+}
+
+void NetworkSource::stop()
+{
+    if (mThread.joinable())
+    {
+        mStop = true;
+        const uint64_t one = 1;
+        ssize_t ret = write(mWakeFd, &one, sizeof(one));
+        Q_UNUSED(ret)
+        mThread.join();
+    }
+
+    if (mWakeFd >= 0)
+        close(mWakeFd);
+    if (mSocket >= 0)
+        close(mSocket);
+    mWakeFd = -1;
+    mSocket = -1;
+}
+
+void NetworkSource::receiveLoop()
+{
+    std::cout << qPrintable(applyRealtimeToCurrentThread(mRealtime, "Network capture")) << std::endl;
+    Tracer::registerCurrentThread("Network capture");
+
+    uint8_t *datagram = new uint8_t[65536];
+
+    struct pollfd fds[2];
+    fds[0].fd = mSocket;
+    fds[0].events = POLLIN;
+    fds[1].fd = mWakeFd;
+    fds[1].events = POLLIN;
+
+    while (!mStop)
+    {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        poll(fds, 2, NET_RTCP_INTERVAL_MS);
+
+        if (fds[1].revents & POLLIN)
+        {
+            uint64_t count;
+            ssize_t ret = read(mWakeFd, &count, sizeof(count));
+            Q_UNUSED(ret)
+        }
+
+        while (!mStop)
+        {
+            sockaddr_in from;
+            socklen_t fromLength = sizeof(from);
+            const ssize_t bytes = recvfrom(mSocket, datagram, 65536, MSG_DONTWAIT, reinterpret_cast<sockaddr*>(&from), &fromLength);
+            if (bytes <= 0)
+                break;
+            handleDatagram(datagram, static_cast<int>(bytes), from, monotonicNs());
+        }
+
+        const qint64 now = monotonicNs();
+        if (mRtp && mSynced && now - mLastReportNs >= NET_RTCP_INTERVAL_MS * 1000000LL)
+            sendReceiverReport(now);
+    }
+
+    delete[] datagram;
+}
+
+void NetworkSource::handleDatagram(const uint8_t *data, int bytes, const sockaddr_in &from, qint64 arrivalNs)
+{
+    TraceScope trace(TraceEvent::CapturePeriod);
+    trace.setArg(bytes);
+
+    if (mRtp)
+    {
+        handleRtp(data, bytes, from, arrivalNs);
+        return;
+    }
+
+    // Without sequence numbers, there's nothing to reorder, so the slots are only used to get the samples aligned.
+    mPacketsReceived++;
+    const int frames = std::min(bytes, NET_MAX_PACKET_BYTES) / (NET_CHANNELS * sizeof(int16_t));
+    memcpy(mSlots[0].samples, data, frames * NET_CHANNELS * sizeof(int16_t));
+    deliver(mSlots[0].samples, frames);
+}
+
+void NetworkSource::handleRtp(const uint8_t *data, int bytes, const sockaddr_in &from, qint64 arrivalNs)
+{
+    if (bytes < RTP_HEADER_SIZE || (data[0] >> 6) != 2)
+        return;
+
+    int offset = RTP_HEADER_SIZE + (data[0] & 0x0F) * 4;
+    if ((data[0] & 0x10) && bytes >= offset + 4)
+        offset += 4 + ((data[offset + 2] << 8) | data[offset + 3]) * 4;
+    const int end = (data[0] & 0x20) ? bytes - data[bytes - 1] : bytes;
+    if (end <= offset || end - offset > NET_MAX_PACKET_BYTES)
+        return;
+
+    const uint16_t sequence = (data[2] << 8) | data[3];
+    const uint32_t timestamp = (static_cast<uint32_t>(data[4]) << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+    const uint32_t ssrc = (static_cast<uint32_t>(data[8]) << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+
+    mPacketsReceived++;
+    mSenderAddress = from;
+
+    if (!mSynced || ssrc != mSenderSsrc)
+    {
+        mSenderSsrc = ssrc;
+        resync(sequence, timestamp, arrivalNs);
+    }
+
+    int16_t ahead = static_cast<int16_t>(sequence - mExpectedSequence);
+    if (ahead < 0)
+    {
+        mPacketsLate++;
+        return;
+    }
+
+    // Too far ahead for the reorder window: the sender restarted, or we missed a lot.
+    if (ahead >= NET_JITTER_SLOTS)
+    {
+        resync(sequence, timestamp, arrivalNs);
+        ahead = 0;
+    }
+
+    Slot &slot = mSlots[sequence % NET_JITTER_SLOTS];
+    if (slot.filled)
+    {
+        mPacketsLate++; // Duplicate
+        return;
+    }
+
+    // L16 is big endian.
+    const int frames = (end - offset) / (NET_CHANNELS * 2);
+    const uint8_t *payload = data + offset;
+    for (int i = 0; i < frames * NET_CHANNELS; i++)
+        slot.samples[i] = static_cast<int16_t>((payload[i * 2] << 8) | payload[i * 2 + 1]);
+    slot.filled = true;
+    slot.sequence = sequence;
+    slot.timestamp = timestamp;
+    slot.frames = frames;
+
+    if (static_cast<int32_t>(timestamp + frames - mNewestTimestamp) > 0)
+        mNewestTimestamp = timestamp + frames;
+
+    updateReportStatistics(sequence, timestamp, arrivalNs);
+    releaseInOrder();
+}
+
+/**
+ * @brief NetworkSource::resync starts following a (new) stream at the given packet.
+ */
+void NetworkSource::resync(uint16_t sequence, uint32_t timestamp, qint64 arrivalNs)
+{
+    if (mSynced)
+        mResyncs++;
+
+    for (int i = 0; i < NET_JITTER_SLOTS; i++)
+        mSlots[i].filled = false;
+
+    mSynced = true;
+    mExpectedSequence = sequence;
+    mNextTimestamp = timestamp;
+    mNewestTimestamp = timestamp;
+    mLastPacketFrames = 0;
+
+    mBaseSequence = sequence;
+    mMaxSequence = sequence;
+    mCycles = 0;
+    mReceivedForReport = 0;
+    mExpectedPrior = 0;
+    mReceivedPrior = 0;
+    mJitter = 0;
+    mFirstArrivalNs = arrivalNs;
+    mFirstTimestamp = timestamp;
+
+    // Silence first, so waiting for a missing packet doesn't run the ring buffer empty.
+    const int silenceChunk = NET_MAX_PACKET_BYTES / (NET_CHANNELS * sizeof(int16_t));
+    for (int left = mJitterFrames; left > 0; left -= silenceChunk)
+        deliver(mSilence, std::min(left, silenceChunk));
+}
+
+/**
+ * @brief NetworkSource::releaseInOrder delivers the packets that are next, and gives up on missing ones after the jitter depth.
+ */
+void NetworkSource::releaseInOrder()
+{
+    while (true)
+    {
+        Slot &slot = mSlots[mExpectedSequence % NET_JITTER_SLOTS];
+        if (slot.filled && slot.sequence == mExpectedSequence)
+        {
+            deliver(slot.samples, slot.frames);
+            slot.filled = false;
+            mNextTimestamp = slot.timestamp + slot.frames;
+            mLastPacketFrames = slot.frames;
+            mExpectedSequence++;
+            continue;
+        }
+
+        const int32_t ahead = static_cast<int32_t>(mNewestTimestamp - mNextTimestamp);
+        if (ahead <= 0 || ahead < mJitterFrames)
+            break;
+
+        // Lost; conceal it with silence, of the size of the packet before it.
+        const int silenceChunk = NET_MAX_PACKET_BYTES / (NET_CHANNELS * sizeof(int16_t));
+        const int frames = std::min(mLastPacketFrames > 0 ? mLastPacketFrames : ahead, silenceChunk);
+        mPacketsLost++;
+        deliver(mSilence, frames);
+        mNextTimestamp += frames;
+        mExpectedSequence++;
+    }
+}
+
+void NetworkSource::deliver(const int16_t *samples, int frames)
+{
+    if (frames <= 0)
+        return;
+
+    detectIec61937(samples, frames);
+    mProducer(reinterpret_cast<const char*>(samples), frames * NET_CHANNELS * sizeof(int16_t));
+}
+
+/**
+ * @brief NetworkSource::detectIec61937 looks for the burst preamble, Pa and Pb, like the DIR9001 does on S/PDIF.
+ */
+void NetworkSource::detectIec61937(const int16_t *samples, int frames)
+{
+    const int words = frames * NET_CHANNELS;
+    bool sync = false;
+    for (int i = 0; i < words; i++)
+    {
+        const uint16_t word = static_cast<uint16_t>(samples[i]);
+        if (mLastWord == 0xF872 && word == 0x4E1F)
+            sync = true;
+        mLastWord = word;
+    }
+
+    mFramesSinceSync = sync ? 0 : std::min(mFramesSinceSync + frames, NET_IEC61937_SYNC_TIMEOUT_FRAMES);
+    mEncoded = mFramesSinceSync < NET_IEC61937_SYNC_TIMEOUT_FRAMES;
+}
+
+/**
+ * @brief NetworkSource::updateReportStatistics keeps what RFC 3550 receiver reports need, and measures the sender clock.
+ */
+void NetworkSource::updateReportStatistics(uint16_t sequence, uint32_t timestamp, qint64 arrivalNs)
+{
+    const uint16_t delta = sequence - mMaxSequence;
+    if (delta < 0x8000)
+    {
+        if (sequence < mMaxSequence)
+            mCycles += 0x10000;
+        mMaxSequence = sequence;
+    }
+
+    // Interarrival jitter, in timestamp units.
+    const qint64 arrivalUnits = arrivalNs / 1000 * NET_SAMPLE_RATE / 1000000;
+    if (mReceivedForReport > 0)
+    {
+        const qint64 difference = (arrivalUnits - mLastArrivalUnits) - static_cast<int32_t>(timestamp - mLastArrivalTimestamp);
+        mJitter += (std::abs(static_cast<double>(difference)) - mJitter) / 16;
+        mJitterUs = static_cast<int>(mJitter * 1000000 / NET_SAMPLE_RATE);
+    }
+    mLastArrivalUnits = arrivalUnits;
+    mLastArrivalTimestamp = timestamp;
+    mReceivedForReport++;
+
+    // Restarted every hour, so the 32 bit timestamps don't wrap within a measurement.
+    const qint64 elapsedNs = arrivalNs - mFirstArrivalNs;
+    if (elapsedNs > 3600 * 1000000000LL)
+    {
+        mFirstArrivalNs = arrivalNs;
+        mFirstTimestamp = timestamp;
+    }
+    else if (elapsedNs > NET_CLOCK_MEASURE_MIN_NS)
+    {
+        const double expectedFrames = static_cast<double>(elapsedNs) * NET_SAMPLE_RATE / 1000000000.0;
+        mSenderClockPpm = (static_cast<uint32_t>(timestamp - mFirstTimestamp) / expectedFrames - 1.0) * 1000000.0;
+    }
+}
+
+/**
+ * @brief NetworkSource::sendReceiverReport sends an RTCP RR to the sender, on the RTP port + 1.
+ */
+void NetworkSource::sendReceiverReport(qint64 nowNs)
+{
+    mLastReportNs = nowNs;
+
+    const qint64 extendedMax = mCycles + mMaxSequence;
+    const qint64 expected = extendedMax - mBaseSequence + 1;
+    const qint64 received = static_cast<qint64>(mReceivedForReport);
+    const qint64 lost = std::max<qint64>(-0x800000, std::min<qint64>(0x7FFFFF, expected - received));
+
+    const qint64 expectedInterval = expected - static_cast<qint64>(mExpectedPrior);
+    const qint64 lostInterval = expectedInterval - (received - static_cast<qint64>(mReceivedPrior));
+    mExpectedPrior = expected;
+    mReceivedPrior = received;
+    const uint8_t fraction = (expectedInterval <= 0 || lostInterval <= 0) ? 0 : static_cast<uint8_t>((lostInterval << 8) / expectedInterval);
+
+    const uint32_t words[] = {
+        0x81C90007, // Version 2, one report block, RR, length 7 words.
+        mSsrc,
+        mSenderSsrc,
+        (static_cast<uint32_t>(fraction) << 24) | (static_cast<uint32_t>(lost) & 0xFFFFFF),
+        static_cast<uint32_t>(extendedMax),
+        static_cast<uint32_t>(mJitter),
+        0, // No sender reports received, so no LSR and DLSR.
+        0
+    };
+
+    uint32_t packet[8];
+    for (int i = 0; i < 8; i++)
+        packet[i] = htonl(words[i]);
+
+    sockaddr_in destination = mSenderAddress;
+    destination.sin_port = htons(ntohs(mSenderAddress.sin_port) + 1);
+    sendto(mSocket, packet, sizeof(packet), MSG_DONTWAIT, reinterpret_cast<const sockaddr*>(&destination), sizeof(destination));
+}
+
+bool NetworkSource::seesEncodedAudio() const
+{
+    return mEncoded;
+}
+
+QString NetworkSource::describe() const
+{
+    return QString("Network source: %1 packets, %2 lost, %3 late, %4 resyncs, jitter %5 us, sender clock %6 ppm")
+            .arg(mPacketsReceived).arg(mPacketsLost).arg(mPacketsLate).arg(mResyncs).arg(mJitterUs).arg(mSenderClockPpm, 0, 'f', 1);
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef NETWORKSOURCE_H
+#define NETWORKSOURCE_H
+
+#include <QString>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <netinet/in.h>
+
+#include "capturesource.h"
+
+#define NET_SAMPLE_RATE 48000
+#define NET_CHANNELS 2 // Like the S/PDIF input; IEC 61937 bursts are carried in stereo frames too.
+#define NET_MAX_PACKET_BYTES 4096
+#define NET_JITTER_SLOTS 128 // Reorder window in packets; must be a power of two.
+#define NET_RTCP_INTERVAL_MS 5000
+#define NET_RECEIVE_BUFFER_BYTES (256 * 1024)
+#define NET_IEC61937_SYNC_TIMEOUT_FRAMES 16384 // More than the longest burst repetition period, of E-AC-3.
+#define NET_CLOCK_MEASURE_MIN_NS 10000000000LL // Don't report the sender clock before 10 s of packets.
+#define NET_DEFAULT_PORT 5004
+
+/**
+ * @brief The NetworkSource class receives audio over UDP and feeds it to the ring buffer instead of the S/PDIF input.
+ *
+ * With the 'rtp' protocol, the payload is L16 stereo, big endian. Packets go through a reorder buffer: in-order packets
+ * are delivered right away, and a missing packet is waited for until the newest packet is the jitter depth ahead of it,
+ * after which it's counted as lost and replaced by silence. Late and duplicate packets are dropped. Every (re)start of a
+ * stream is preceded by the jitter depth of silence, so the wait for a missing packet doesn't run the ring buffer empty.
+ *
+ * With 'udp', datagrams are S16LE stereo as captured from the DIR9001, and are written as is.
+ *
+ * Either way, it can carry PCM or IEC 61937; the latter is recognized by its burst preamble, which replaces the DIR9001
+ * format GPIO while this source is used.
+ *
+ * The sender's clock is followed by the playback drift compensation, because this writes at the sender's rate. As feedback,
+ * RTCP receiver reports with loss and interarrival jitter are sent to the sender (RTP port + 1), and the rate of the sender
+ * relative to our monotonic clock is measured for the status output.
+ */
+class NetworkSource : public CaptureSource
+{
+    struct Slot
+    {
+        bool filled = false;
+        uint16_t sequence = 0;
+        uint32_t timestamp = 0;
+        int frames = 0;
+        int16_t samples[NET_MAX_PACKET_BYTES / sizeof(int16_t)];
+    };
+
+    const Producer mProducer;
+    const bool mRtp;
+    const int mJitterFrames;
+    sockaddr_in mAddress;
+    bool mMulticast = false;
+    int mSocket = -1;
+    int mWakeFd = -1;
+    std::atomic<bool> mStop;
+    std::thread mThread;
+    ThreadRealtimeSettings mRealtime;
+
+    // Only touched by the receive thread.
+    Slot *mSlots;
+    bool mSynced = false;
+    uint32_t mSenderSsrc = 0;
+    uint16_t mExpectedSequence = 0;
+    uint32_t mNewestTimestamp = 0;
+    uint32_t mNextTimestamp = 0;
+    int mLastPacketFrames = 0;
+    int16_t *mSilence;
+    int mFramesSinceSync = NET_IEC61937_SYNC_TIMEOUT_FRAMES;
+    uint16_t mLastWord = 0;
+
+    // For the receiver reports.
+    const uint32_t mSsrc;
+    sockaddr_in mSenderAddress;
+    uint16_t mBaseSequence = 0;
+    uint16_t mMaxSequence = 0;
+    uint32_t mCycles = 0;
+    quint64 mReceivedForReport = 0;
+    quint64 mExpectedPrior = 0;
+    quint64 mReceivedPrior = 0;
+    double mJitter = 0;
+    qint64 mLastArrivalUnits = 0;
+    uint32_t mLastArrivalTimestamp = 0;
+    qint64 mLastReportNs = 0;
+    qint64 mFirstArrivalNs = 0;
+    uint32_t mFirstTimestamp = 0;
+
+    std::atomic<bool> mEncoded;
+    std::atomic<quint64> mPacketsReceived;
+    std::atomic<quint64> mPacketsLost;
+    std::atomic<quint64> mPacketsLate;
+    std::atomic<quint64> mResyncs;
+    std::atomic<int> mJitterUs;
+    std::atomic<double> mSenderClockPpm;
+
+    void receiveLoop();
+    void handleDatagram(const uint8_t *data, int bytes, const sockaddr_in &from, qint64 arrivalNs);
+    void handleRtp(const uint8_t *data, int bytes, const sockaddr_in &from, qint64 arrivalNs);
+    void resync(uint16_t sequence, uint32_t timestamp, qint64 arrivalNs);
+    void releaseInOrder();
+    void deliver(const int16_t *samples, int frames);
+    void detectIec61937(const int16_t *samples, int frames);
+    void updateReportStatistics(uint16_t sequence, uint32_t timestamp, qint64 arrivalNs);
+    void sendReceiverReport(qint64 nowNs);
+
+public:
+    NetworkSource(const QString &address, const QString &protocol, int jitterMs, const Producer &producer);
+    ~NetworkSource();
+
+    void start(const ThreadRealtimeSettings &realtime) override;
+    void stop() override;
+    bool seesEncodedAudio() const override;
+    QString describe() const override;
+};
+
+#endif // NETWORKSOURCE_H
@@ -0,0 +1,559 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "outputstage.h"
+#include <QThread>
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "startuptrace.h"
+#include "tracer.h"
+#include "annotatedexception.h"
+
+OutputStage::OutputStage(AlsaReactor &reactor, XrunRecovery &xrunRecovery, const QString &device, int fadeMs, int silenceMs, unsigned int periods,
+                         QObject *parent) : QObject(parent),
+    mReactor(reactor),
+    mXrunRecovery(xrunRecovery),
+    mDevice(device),
+    mPeriods(periods),
+    mFifo(OUTPUT_FIFO_FRAMES, MAX_OUTPUT_CHANNELS),
+    mSpaceFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    mPlaybackIdle(false),
+    mShortWrites(0),
+    mEagains(0),
+    mLostFrames(0),
+    mNullDeviceFrames(0),
+    mFadeFrames(std::max(0, std::min(MAX_FADE_FRAMES, fadeMs * OUTPUT_SAMPLE_RATE / 1000))),
+    mSilenceFrames(std::max(0, silenceMs * OUTPUT_SAMPLE_RATE / 1000)),
+    mPending(new int16_t[(MAX_FADE_FRAMES + OUTPUT_BLOCK_FRAMES) * MAX_OUTPUT_CHANNELS]),
+    mPathActive(false),
+    mPathChannels(0),
+    mDeviceQueuedFrames(0),
+    mTransitions(0),
+    mLastTransitionMs(0),
+    mMaxTransitionMs(0)
+{
+
+}
+
+OutputStage::~OutputStage()
+{
+    mStop = nullptr;
+    closeDevice();
+    delete[] mPending;
+    close(mSpaceFd);
+}
+
+GainStage &OutputStage::gainStage()
+{
+    return mGainStage;
+}
+
+/**
+ * @brief OutputStage::channels is the channel count of the playing path, or 0 between paths. Safe from any thread.
+ */
+int OutputStage::channels() const
+{
+    return mPathChannels;
+}
+
+/**
+ * @brief OutputStage::addTap must be called before the first path starts.
+ */
+void OutputStage::addTap(OutputTap *tap)
+{
+    mTaps.push_back(tap);
+}
+
+/**
+ * @brief OutputStage::setNullDevice throws the output away instead of playing it, so replays run as fast as their input.
+ */
+void OutputStage::setNullDevice(bool nullDevice)
+{
+    mNullDevice = nullDevice;
+}
+
+/**
+ * @brief OutputStage::configureDevice opens the playback device and sets it up, or throws saying what failed.
+ */
+snd_pcm_t *OutputStage::configureDevice(int channels, unsigned int bufferTimeUs, int &bufferFrames)
+{
+    unsigned int rate = OUTPUT_SAMPLE_RATE; // Actually unnecessary, because my hacked mcasp davinci driver ignores it, because it's clocked externally.
+    snd_pcm_t *pcm = nullptr;
+    snd_pcm_hw_params_t *hw_params = nullptr;
+    snd_pcm_sw_params_t *sw_params = nullptr;
+
+    try
+    {
+        checkError(snd_pcm_open(&pcm, qPrintable(mDevice), SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK), "open");
+        checkError(snd_pcm_hw_params_malloc(&hw_params), "hw params");
+        checkError(snd_pcm_hw_params_any(pcm, hw_params), "hw params");
+        checkError(snd_pcm_hw_params_set_access(pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED), "access");
+        checkError(snd_pcm_hw_params_set_format(pcm, hw_params, SND_PCM_FORMAT_S16_LE), "format");
+        checkError(snd_pcm_hw_params_set_rate_near(pcm, hw_params, &rate, 0), "rate");
+        checkError(snd_pcm_hw_params_set_channels(pcm, hw_params, channels), "channels");
+
+        int dir = 0; checkError(setBufferAndPeriods(pcm, hw_params, bufferTimeUs, mPeriods), "buffer time");
+#ifdef QT_DEBUG
+        printf("Playback device buffer set to: %d us\n", bufferTimeUs);
+#endif
+
+        checkError(snd_pcm_hw_params(pcm, hw_params), "hw params");
+
+        snd_pcm_uframes_t buffer_size = 0;
+        checkError(snd_pcm_hw_params_get_buffer_size(hw_params, &buffer_size), "buffer size");
+        bufferFrames = static_cast<int>(buffer_size);
+
+        // Wake the reactor when there's room for a period, and don't start playing with less than that.
+        snd_pcm_uframes_t period_size = 0;
+        checkError(snd_pcm_hw_params_get_period_size(hw_params, &period_size, &dir), "period size");
+        checkError(snd_pcm_sw_params_malloc(&sw_params), "sw params");
+        checkError(snd_pcm_sw_params_current(pcm, sw_params), "sw params");
+        checkError(snd_pcm_sw_params_set_avail_min(pcm, sw_params, period_size), "avail min");
+        checkError(snd_pcm_sw_params_set_start_threshold(pcm, sw_params, period_size), "start threshold");
+        checkError(snd_pcm_sw_params(pcm, sw_params), "sw params");
+
+        checkError(snd_pcm_prepare(pcm), "prepare");
+    }
+    catch (AnnotatedException &)
+    {
+        if (sw_params)
+            snd_pcm_sw_params_free(sw_params);
+        if (hw_params)
+            snd_pcm_hw_params_free(hw_params);
+        if (pcm)
+            snd_pcm_close(pcm);
+        throw;
+    }
+
+    snd_pcm_sw_params_free(sw_params);
+    snd_pcm_hw_params_free(hw_params);
+    return pcm;
+}
+
+void OutputStage::openDevice(int channels, unsigned int bufferTimeUs)
+{
+    int bufferFrames = 0;
+    mPlaybackHandle = configureDevice(channels, bufferTimeUs, bufferFrames);
+    mChannels = channels;
+    mBufferTimeUs = bufferTimeUs;
+    mBufferFrames = bufferFrames;
+    mDeviceQueuedFrames = 0;
+
+    mFifo.reset(channels);
+    mPlaybackIdle = false;
+    snd_pcm_t *pcm = mPlaybackHandle;
+    mReactor.add(pcm, [this, pcm](unsigned short revents) {
+        return onPlaybackReady(pcm, revents);
+    });
+}
+
+/**
+ * @brief OutputStage::checkDevice opens the device once and closes it again, so a bad device fails the pipeline build.
+ *
+ * The device itself is only opened when the first path starts, in the playback thread, where nothing can go back to the
+ * previous config anymore. Call it before the playback thread starts.
+ */
+void OutputStage::checkDevice(int channels, unsigned int bufferTimeUs)
+{
+    if (mNullDevice)
+        return;
+
+    int bufferFrames = 0;
+    snd_pcm_close(configureDevice(channels, bufferTimeUs, bufferFrames));
+}
+
+void OutputStage::closeDevice()
+{
+    if (mPlaybackHandle)
+    {
+        drainFifo();
+        mReactor.remove(mPlaybackHandle);
+        mLostFrames += mFifo.framesAvailable();
+        snd_pcm_close(mPlaybackHandle);
+        mPlaybackHandle = nullptr;
+        mChannels = 0;
+        mBufferTimeUs = 0;
+        mDeviceQueuedFrames = 0;
+    }
+}
+
+void OutputStage::checkError(int ret, const char *step)
+{
+    if (ret < 0)
+        throw AnnotatedException(QString("Can't set up playback device '%1', %2 failed: %3").arg(mDevice).arg(step).arg(snd_strerror(ret)));
+}
+
+/**
+ * @brief OutputStage::beginPath prepares the output for a playback path, and starts fading it in.
+ * @param bufferTimeUs ALSA buffer time; the decoding path needs more than raw PCM, because it gets audio in bursts.
+ * @param stop of the worker playing the path; a wait for the device gives up when it's set.
+ */
+void OutputStage::beginPath(int channels, unsigned int bufferTimeUs, const StopToken &stop)
+{
+    mStop = &stop;
+
+    if (mNullDevice)
+    {
+        mChannels = channels;
+        mBufferTimeUs = bufferTimeUs;
+    }
+    else
+    {
+        if (mPlaybackHandle && (channels != mChannels || bufferTimeUs != mBufferTimeUs))
+            closeDevice();
+
+        if (!mPlaybackHandle)
+        {
+            // The path plays on regardless, into nothing, so the taps and the statistics keep going.
+            try
+            {
+                openDevice(channels, bufferTimeUs);
+            }
+            catch (AnnotatedException &ex)
+            {
+                std::cerr << ex.what() << std::endl;
+            }
+        }
+    }
+
+    mGainStage.setChannels(channels);
+    mGainStage.setMuted(false);
+
+    for (OutputTap *tap : mTaps)
+        tap->beginPath(channels);
+
+    mPendingFrames = 0;
+    mFadeInFramesDone = 0;
+    mPathActive = true;
+    mPathChannels = channels;
+
+    if (mTransitionTimer.isValid())
+    {
+        const int ms = static_cast<int>(mTransitionTimer.elapsed());
+        mTransitionTimer.invalidate();
+
+        mTransitions++;
+        mLastTransitionMs = ms;
+        if (ms > mMaxTransitionMs)
+            mMaxTransitionMs = ms;
+
+        std::cout << "Transition " << mTransitions << " took " << ms << " ms, max so far " << mMaxTransitionMs << " ms." << std::endl;
+    }
+
+    emit pathStarted();
+}
+
+void OutputStage::fadeIn(int16_t *samples, int frames)
+{
+    for (int f = 0; f < frames && mFadeInFramesDone < mFadeFrames; f++)
+    {
+        const float gain = static_cast<float>(mFadeInFramesDone) / mFadeFrames;
+        for (int c = 0; c < mChannels; c++)
+            samples[f * mChannels + c] = static_cast<int16_t>(samples[f * mChannels + c] * gain);
+        mFadeInFramesDone++;
+    }
+}
+
+/**
+ * @brief OutputStage::write takes interleaved samples of the amount of channels given to beginPath(). They're modified in place.
+ */
+void OutputStage::write(int16_t *samples, int frames)
+{
+    if (!mPathActive)
+        return;
+
+    while (frames > 0)
+    {
+        const int chunk = std::min(frames, OUTPUT_BLOCK_FRAMES);
+        writeBlock(samples, chunk);
+        samples += chunk * mChannels;
+        frames -= chunk;
+    }
+}
+
+void OutputStage::writeBlock(int16_t *samples, int frames)
+{
+    mGainStage.process(samples, frames);
+
+    if (mFadeInFramesDone < mFadeFrames)
+        fadeIn(samples, frames);
+
+    memcpy(mPending + mPendingFrames * mChannels, samples, frames * mChannels * sizeof(int16_t));
+    mPendingFrames += frames;
+
+    const int ready = mPendingFrames - mFadeFrames;
+    if (ready > 0)
+    {
+        writeToDevice(mPending, ready);
+        memmove(mPending, mPending + ready * mChannels, mFadeFrames * mChannels * sizeof(int16_t));
+        mPendingFrames = mFadeFrames;
+    }
+}
+
+/**
+ * @brief OutputStage::endPath fades out the held back audio and follows it with silence.
+ */
+void OutputStage::endPath()
+{
+    // The tail is written regardless of the stop, because the path is stopping anyway.
+    mStop = nullptr;
+
+    if (!mPathActive)
+        return;
+
+    mPathActive = false;
+    mPathChannels = 0;
+
+    for (int f = 0; f < mPendingFrames; f++)
+    {
+        const float gain = static_cast<float>(mPendingFrames - 1 - f) / mPendingFrames;
+        for (int c = 0; c < mChannels; c++)
+            mPending[f * mChannels + c] = static_cast<int16_t>(mPending[f * mChannels + c] * gain);
+    }
+    writeToDevice(mPending, mPendingFrames);
+    mPendingFrames = 0;
+
+    int silenceLeft = mSilenceFrames;
+    memset(mPending, 0, OUTPUT_BLOCK_FRAMES * mChannels * sizeof(int16_t));
+    while (silenceLeft > 0)
+    {
+        const int chunk = std::min(silenceLeft, OUTPUT_BLOCK_FRAMES);
+        writeToDevice(mPending, chunk);
+        silenceLeft -= chunk;
+    }
+
+    mTransitionTimer.start();
+}
+
+/**
+ * @brief OutputStage::writeToDevice queues the samples for the reactor, waiting for room when needed.
+ */
+void OutputStage::writeToDevice(const int16_t *samples, int frames)
+{
+    if ((!mPlaybackHandle && !mNullDevice) || frames <= 0)
+        return;
+
+    for (OutputTap *tap : mTaps)
+        tap->write(samples, frames);
+
+    if (mNullDevice)
+    {
+        mNullDeviceFrames += frames;
+        return;
+    }
+
+    while (frames > 0)
+    {
+        const int pushed = mFifo.push(samples, frames);
+        samples += pushed * mChannels;
+        frames -= pushed;
+
+        // Only wake the reactor when it stopped watching the device; otherwise it will get to the new frames by itself.
+        if (pushed > 0 && mPlaybackIdle.exchange(false))
+            mReactor.wake();
+
+        if (frames > 0 && !waitForSpace())
+        {
+            if (mStop && mStop->stopRequested())
+                return; // The fade out at the end of the path takes over from here.
+
+            std::cerr << "Playback device didn't take audio for " << OUTPUT_WRITE_TIMEOUT_MS << " ms. Dropping " << frames << " frames." << std::endl;
+            mLostFrames += frames;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief OutputStage::waitForSpace waits until the reactor took frames from the FIFO, in slices, so a stop is seen in time.
+ * @return false after OUTPUT_WRITE_TIMEOUT_MS, or when the worker of the path must stop.
+ */
+bool OutputStage::waitForSpace()
+{
+    struct pollfd pfd;
+    pfd.fd = mSpaceFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    QElapsedTimer waited;
+    waited.start();
+    while (poll(&pfd, 1, RING_WAIT_SLICE_MS) <= 0)
+    {
+        if ((mStop && mStop->stopRequested()) || waited.elapsed() >= OUTPUT_WRITE_TIMEOUT_MS)
+            return false;
+    }
+
+    uint64_t count;
+    ssize_t ret = read(mSpaceFd, &count, sizeof(count));
+    Q_UNUSED(ret)
+    return true;
+}
+
+/**
+ * @brief OutputStage::drainFifo waits until the reactor wrote everything queued to the device, like the silence of a transition.
+ */
+void OutputStage::drainFifo()
+{
+    while (mFifo.framesAvailable() > 0)
+    {
+        if (mPlaybackIdle.exchange(false))
+            mReactor.wake();
+
+        if (!waitForSpace())
+            return;
+    }
+}
+
+/**
+ * @brief OutputStage::onPlaybackReady writes what the FIFO has to the device, in the reactor thread.
+ * @return whether the reactor should keep watching the device.
+ */
+bool OutputStage::onPlaybackReady(snd_pcm_t *pcm, unsigned short revents)
+{
+    TraceScope trace(TraceEvent::Write);
+
+    // Between paths, the device simply runs out after the transition silence. It's prepared, and starts again with the next path.
+    const bool pathActive = mPathActive;
+
+    if (revents & POLLERR)
+        mXrunRecovery.recover(pcm, -EPIPE, "playback", pathActive, pathActive);
+
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+    if (avail < 0)
+    {
+        mXrunRecovery.recover(pcm, avail, "playback", pathActive, pathActive);
+        avail = snd_pcm_avail_update(pcm);
+    }
+
+    bool wrote = false;
+    while (avail > 0)
+    {
+        int frames = 0;
+        const int16_t *samples = mFifo.readPointer(frames);
+        frames = std::min<snd_pcm_sframes_t>(frames, avail);
+        if (frames <= 0)
+            break;
+
+        // What isn't written stays in the FIFO, so a short write or EAGAIN just means trying again on the next wake-up.
+        snd_pcm_sframes_t ret = snd_pcm_writei(pcm, samples, frames);
+        if (ret == -EAGAIN)
+        {
+            mEagains++;
+            break;
+        }
+        else if (ret < 0)
+        {
+            mXrunRecovery.recover(pcm, ret, "playback", pathActive, pathActive);
+            break;
+        }
+
+        mFifo.consume(ret);
+        avail -= ret;
+        wrote = true;
+
+        if (pathActive && !StartupTrace::firstAudibleSampleMarked())
+        {
+            snd_pcm_sframes_t delay = 0;
+            snd_pcm_delay(pcm, &delay);
+            StartupTrace::markFirstAudibleSample(delay * 1000000000LL / OUTPUT_SAMPLE_RATE);
+        }
+
+        if (ret < frames)
+        {
+            mShortWrites++;
+            break;
+        }
+    }
+
+    // What's left of avail after writing is the room in the device; the rest is queued. Cheaper than snd_pcm_delay().
+    if (avail >= 0)
+        mDeviceQueuedFrames = std::max(0, mBufferFrames - static_cast<int>(avail));
+
+    if (wrote)
+    {
+        const uint64_t one = 1;
+        ssize_t ret = write(mSpaceFd, &one, sizeof(one));
+        Q_UNUSED(ret)
+    }
+
+    if (mFifo.framesAvailable() > 0)
+        return true;
+
+    // If the playback thread pushed something right before this, it didn't wake us, so look once more.
+    mPlaybackIdle = true;
+    if (mFifo.framesAvailable() > 0)
+    {
+        mPlaybackIdle = false;
+        return true;
+    }
+
+    return false;
+}
+
+unsigned int OutputStage::transitionCount() const
+{
+    return mTransitions;
+}
+
+int OutputStage::lastTransitionMs() const
+{
+    return mLastTransitionMs;
+}
+
+int OutputStage::maxTransitionMs() const
+{
+    return mMaxTransitionMs;
+}
+
+quint64 OutputStage::shortWrites() const
+{
+    return mShortWrites;
+}
+
+quint64 OutputStage::eagainCount() const
+{
+    return mEagains;
+}
+
+/**
+ * @brief OutputStage::lostFrames counts frames that were given to the output stage, but never reached the device.
+ */
+quint64 OutputStage::lostFrames() const
+{
+    return mLostFrames;
+}
+
+quint64 OutputStage::nullDeviceFrames() const
+{
+    return mNullDeviceFrames;
+}
+
+/**
+ * @brief OutputStage::queuedFrames is roughly how much audio is on its way to the speakers: the held back tail, the FIFO and the device buffer.
+ */
+int OutputStage::queuedFrames() const
+{
+    const int heldBack = mPathActive ? mFadeFrames : 0;
+    return heldBack + mFifo.framesAvailable() + (mNullDevice ? 0 : mDeviceQueuedFrames.load());
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef OUTPUTSTAGE_H
+#define OUTPUTSTAGE_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <atomic>
+#include <vector>
+#include <alsa/asoundlib.h>
+
+#include "gainstage.h"
+#include "alsareactor.h"
+#include "samplefifo.h"
+#include "latencyprofile.h"
+#include "xrunrecovery.h"
+#include "outputtap.h"
+#include "stoptoken.h"
+
+#define OUTPUT_SAMPLE_RATE 48000
+#define MAX_FADE_FRAMES 4800 // 100 ms
+#define OUTPUT_BLOCK_FRAMES 8192 // Bigger writes are split up.
+#define OUTPUT_FIFO_FRAMES 4096 // Must be a power of two.
+#define OUTPUT_WRITE_TIMEOUT_MS 100 // When the device takes nothing for this long, audio is dropped instead of waiting.
+
+/**
+ * @brief The OutputStage class owns the playback device, and makes the transitions between playback paths clean.
+ *
+ * The raw PCM path and the decoding path are separate workers that come and go, and the moment a worker finds out
+ * the audio format changed, it's already too late to do anything nice with the output. So, the output stage holds back
+ * the last fade length of audio. When a path ends, that tail is faded out and followed by a bit of silence, and the next
+ * path is faded in. The device stays open when the next path uses the same channel count and buffer time; otherwise it's
+ * reopened while the output is silent anyway.
+ *
+ * The device itself is written by the reactor, from a FIFO that write() fills. When the FIFO is full, the playback
+ * thread waits until the reactor has made room. Optional taps, like the RTP sender, the recorder, shared memory and extra
+ * sinks, get a copy of what goes to the FIFO.
+ *
+ * All methods except the statistics must be called from the playback thread.
+ */
+class OutputStage : public QObject
+{
+    Q_OBJECT
+
+    AlsaReactor &mReactor;
+    XrunRecovery &mXrunRecovery;
+    const QString mDevice;
+    const unsigned int mPeriods; // 0 leaves it to the driver.
+    snd_pcm_t *mPlaybackHandle = nullptr;
+    int mChannels = 0;
+    unsigned int mBufferTimeUs = 0;
+    int mBufferFrames = 0;
+
+    GainStage mGainStage;
+    std::vector<OutputTap*> mTaps;
+
+    SampleFifo mFifo;
+    int mSpaceFd; // eventfd the reactor signals when it took frames from the FIFO.
+    std::atomic<bool> mPlaybackIdle; // Set when the reactor stopped watching the device because the FIFO ran empty.
+    const StopToken *mStop = nullptr; // Of the worker of the current path; not checked for the fade out at the end.
+
+    std::atomic<quint64> mShortWrites;
+    std::atomic<quint64> mEagains;
+    std::atomic<quint64> mLostFrames;
+    bool mNullDevice = false;
+    std::atomic<quint64> mNullDeviceFrames;
+
+    const int mFadeFrames;
+    const int mSilenceFrames;
+    int16_t *mPending; // The held back tail, plus room for one block.
+    int mPendingFrames = 0;
+    int mFadeInFramesDone = 0;
+    std::atomic<bool> mPathActive; // Read by the reactor, to tell dropouts from running out after a path ended.
+    std::atomic<int> mPathChannels; // For other threads; 0 between paths.
+    std::atomic<int> mDeviceQueuedFrames; // As seen by the reactor at its last wake-up.
+
+    QElapsedTimer mTransitionTimer;
+    std::atomic<unsigned int> mTransitions;
+    std::atomic<int> mLastTransitionMs;
+    std::atomic<int> mMaxTransitionMs;
+
+    snd_pcm_t *configureDevice(int channels, unsigned int bufferTimeUs, int &bufferFrames);
+    void openDevice(int channels, unsigned int bufferTimeUs);
+    void closeDevice();
+    void checkError(int ret, const char *step);
+    void fadeIn(int16_t *samples, int frames);
+    void writeBlock(int16_t *samples, int frames);
+    void writeToDevice(const int16_t *samples, int frames);
+    bool waitForSpace();
+    void drainFifo();
+    bool onPlaybackReady(snd_pcm_t *pcm, unsigned short revents);
+
+public:
+    OutputStage(AlsaReactor &reactor, XrunRecovery &xrunRecovery, const QString &device, int fadeMs, int silenceMs, unsigned int periods,
+                QObject *parent = nullptr);
+    ~OutputStage();
+
+    GainStage &gainStage();
+    int channels() const;
+    void addTap(OutputTap *tap);
+    void setNullDevice(bool nullDevice);
+    void checkDevice(int channels, unsigned int bufferTimeUs);
+
+    void beginPath(int channels, unsigned int bufferTimeUs, const StopToken &stop);
+    void write(int16_t *samples, int frames);
+    void endPath();
+
+    unsigned int transitionCount() const;
+    int lastTransitionMs() const;
+    int maxTransitionMs() const;
+    quint64 shortWrites() const;
+    quint64 eagainCount() const;
+    quint64 lostFrames() const;
+    quint64 nullDeviceFrames() const;
+    int queuedFrames() const;
+
+signals:
+    void pathStarted();
+};
+
+#endif // OUTPUTSTAGE_H
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef OUTPUTTAP_H
+#define OUTPUTTAP_H
+
+#include <stdint.h>
+
+/**
+ * @brief The OutputTap class gets a copy of everything the output stage sends to the device.
+ *
+ * It's called from the playback thread, so implementations must never block; when they can't keep up, they drop.
+ */
+class OutputTap
+{
+public:
+    virtual ~OutputTap() {}
+
+    virtual void beginPath(int channels) = 0;
+    virtual void write(const int16_t *samples, int frames) = 0;
+};
+
+#endif // OUTPUTTAP_H
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "realtime.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+QString policyName(int policy)
+{
+    switch (policy)
+    {
+    case SCHED_FIFO:
+        return "SCHED_FIFO";
+    case SCHED_RR:
+        return "SCHED_RR";
+    case SCHED_OTHER:
+        return "SCHED_OTHER";
+    default:
+        return QString("policy %1").arg(policy);
+    }
+}
+
+/**
+ * @brief policyFromName parses 'fifo', 'rr' or 'other'.
+ * @return the policy, or -1 when unknown.
+ */
+int policyFromName(const QString &name)
+{
+    const QString lower = name.toLower();
+    if (lower == "fifo")
+        return SCHED_FIFO;
+    if (lower == "rr")
+        return SCHED_RR;
+    if (lower == "other")
+        return SCHED_OTHER;
+    return -1;
+}
+
+/**
+ * @brief prefault touches every page, so the first real use doesn't cause a page fault. Only lasts with mlockall().
+ */
+void prefault(void *memory, size_t size)
+{
+    const long pageSize = sysconf(_SC_PAGESIZE);
+    volatile char *p = static_cast<volatile char*>(memory);
+
+    for (size_t i = 0; i < size; i += pageSize)
+        p[i] = p[i];
+}
+
+static void prefaultStack()
+{
+    volatile char stack[STACK_PREFAULT_SIZE];
+    for (size_t i = 0; i < sizeof(stack); i += 1024)
+        stack[i] = 0;
+}
+
+/**
+ * @brief applyRealtimeToCurrentThread sets scheduling and CPU affinity of the calling thread.
+ * @return a line for the startup report, saying what took effect.
+ */
+QString applyRealtimeToCurrentThread(const ThreadRealtimeSettings &settings, const QString &threadName)
+{
+    QString report = QString("%1 thread: ").arg(threadName);
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = settings.policy == SCHED_OTHER ? 0 : settings.priority;
+
+    int ret = pthread_setschedparam(pthread_self(), settings.policy, &param);
+    if (ret == 0)
+        report += QString("%1 priority %2").arg(policyName(settings.policy)).arg(param.sched_priority);
+    else
+        report += QString("%1 priority %2 failed (%3)").arg(policyName(settings.policy)).arg(param.sched_priority).arg(strerror(ret));
+
+    if (settings.cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(settings.cpu, &cpus);
+
+        ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (ret == 0)
+            report += QString(", on CPU %1").arg(settings.cpu);
+        else
+            report += QString(", CPU %1 failed (%2)").arg(settings.cpu).arg(strerror(ret));
+    }
+    else
+    {
+        report += ", any CPU";
+    }
+
+    prefaultStack();
+
+    return report;
+}
+
+/**
+ * @brief lockMemory locks all current and future memory of the process, so the audio threads never wait for paging.
+ * @return a line for the startup report.
+ */
+QString lockMemory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+        return "Memory locked.";
+
+    const int err = errno;
+    return QString("Locking memory failed (%1).").arg(strerror(err));
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <QString>
+#include <sched.h>
+#include <stddef.h>
+
+#define STACK_PREFAULT_SIZE (64 * 1024)
+
+/**
+ * @brief The ThreadRealtimeSettings struct says how an audio thread should be scheduled.
+ *
+ * With the default SCHED_OTHER, an SSH login or log rotation is enough to make the 10 ms capture buffer overrun.
+ */
+struct ThreadRealtimeSettings
+{
+    int policy = SCHED_OTHER;
+    int priority = 0;
+    int cpu = -1; // -1 is any CPU
+};
+
+QString policyName(int policy);
+int policyFromName(const QString &name);
+QString applyRealtimeToCurrentThread(const ThreadRealtimeSettings &settings, const QString &threadName);
+QString lockMemory();
+void prefault(void *memory, size_t size);
+
+#endif // REALTIME_H
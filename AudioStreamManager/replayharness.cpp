@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "replayharness.h"
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QFile>
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+
+#include "gpiofunctions.h"
+#include "audioringbuffer.h"
+
+ReplayHarness::ReplayHarness(const Settings &settings) :
+    mSettings(settings)
+{
+
+}
+
+quint64 ReplayHarness::residentBytes()
+{
+    QFile statm("/proc/self/statm");
+    if (!statm.open(QFile::ReadOnly))
+        return 0;
+
+    const QList<QByteArray> fields = statm.readAll().split(' ');
+    if (fields.size() < 2)
+        return 0;
+    return fields.at(1).toULongLong() * static_cast<quint64>(sysconf(_SC_PAGESIZE));
+}
+
+int ReplayHarness::run()
+{
+    GpIOFunctions gpio(-1); // Only because the ring buffer wants one; the replay script plays its role.
+    AudioRingBuffer ring(gpio, mSettings);
+
+    QElapsedTimer wallTimer;
+    wallTimer.start();
+    ring.startCapture();
+    ring.startPlayback();
+
+    quint64 baselineRss = 0;
+    quint64 maxRss = 0;
+    int maxAlive = 0;
+    int samples = 0;
+
+    QEventLoop loop;
+    QTimer sampleTimer;
+    sampleTimer.setInterval(REPLAY_SAMPLE_INTERVAL_MS);
+    QObject::connect(&sampleTimer, &QTimer::timeout, [&]() {
+        const quint64 rss = residentBytes();
+        samples++;
+        if (samples == 1 || samples == REPLAY_WARMUP_SAMPLES)
+            baselineRss = rss;
+        maxRss = std::max(maxRss, rss);
+        maxAlive = std::max(maxAlive, PlaybackWorker::aliveCount());
+
+        std::cout << qPrintable(ring.captureSource()->describe()) << std::endl;
+        if (ring.captureSource()->finished())
+            loop.quit();
+    });
+    sampleTimer.start();
+    loop.exec();
+
+    const quint64 endRss = residentBytes();
+    const double wallSeconds = wallTimer.elapsed() / 1000.0;
+    const QString sourceReport = ring.captureSource()->describe();
+
+    ring.stopThreads();
+    QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    const int leakedWorkers = PlaybackWorker::aliveCount();
+    const quint64 droppedFrames = ring.captureDroppedFrames() + ring.outputStage().lostFrames();
+
+    std::cout << std::endl << "Replay report" << std::endl;
+    std::cout << qPrintable(sourceReport) << std::endl;
+    std::cout << "Wall time: " << wallSeconds << " s" << std::endl;
+    std::cout << "Output frames: " << ring.outputStage().nullDeviceFrames() << std::endl;
+    std::cout << "Resident memory: " << baselineRss / 1024 << " KB after warm-up, " << endRss / 1024 << " KB at the end, "
+              << maxRss / 1024 << " KB max, growth " << (static_cast<qint64>(endRss) - static_cast<qint64>(baselineRss)) / 1024 << " KB" << std::endl;
+    std::cout << "Playback workers: " << PlaybackWorker::createdCount() << " created, " << maxAlive << " max alive, "
+              << leakedWorkers << " left after stopping" << std::endl;
+    std::cout << "Switches: " << ring.switchCount() << ", max " << ring.maxSwitchUs() << " us, over " << PLAYBACK_SWITCH_BOUND_MS
+              << " ms: " << ring.slowSwitchCount() << std::endl;
+    std::cout << "Dropped frames: " << ring.captureDroppedFrames() << " capture, " << ring.outputStage().lostFrames() << " output" << std::endl;
+
+    if (leakedWorkers > 0 || droppedFrames > 0 || ring.slowSwitchCount() > 0)
+    {
+        std::cerr << "Replay failed: " << leakedWorkers << " leaked playback workers, " << droppedFrames << " dropped frames, "
+                  << ring.slowSwitchCount() << " switches over " << PLAYBACK_SWITCH_BOUND_MS << " ms." << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
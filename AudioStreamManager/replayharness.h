@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef REPLAYHARNESS_H
+#define REPLAYHARNESS_H
+
+#include <QtGlobal>
+
+#include "settings.h"
+
+#define REPLAY_SAMPLE_INTERVAL_MS 1000
+#define REPLAY_WARMUP_SAMPLES 10 // Memory growth is counted from here, after the buffers and decoders have been allocated.
+
+/**
+ * @brief The ReplayHarness class runs the real ring buffer and playback workers on a replay script, headless, and reports on it.
+ *
+ * The output goes to the null device, and the DIR9001 GPIO is replaced by the script, so it runs on a development machine
+ * too. It reports memory growth, playback workers that weren't deleted, switch latencies and dropped frames, and fails
+ * when workers leaked, frames were dropped or a switch took longer than PLAYBACK_SWITCH_BOUND_MS.
+ */
+class ReplayHarness
+{
+    const Settings &mSettings;
+
+    static quint64 residentBytes();
+
+public:
+    ReplayHarness(const Settings &settings);
+    int run();
+};
+
+#endif // REPLAYHARNESS_H
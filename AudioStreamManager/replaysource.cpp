@@ -0,0 +1,379 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "replaysource.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QStringList>
+#include <QTextStream>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "annotatedexception.h"
+#include "tracer.h"
+
+extern "C"
+{
+    #include <libavcodec/avcodec.h>
+    #include <libavutil/channel_layout.h>
+}
+
+static quint64 monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<quint64>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static float syntheticToneSample(int frame)
+{
+    // -20 dBFS, like the latency calibration tone.
+    return 0.1f * static_cast<float>(sin(2.0 * M_PI * REPLAY_SYNTHETIC_TONE_HZ * frame / REPLAY_SAMPLE_RATE));
+}
+
+/**
+ * @brief syntheticTone makes S16LE stereo PCM of a tone, to stand in for a PCM capture.
+ */
+static QByteArray syntheticTone()
+{
+    QByteArray data(REPLAY_SYNTHETIC_FRAMES * REPLAY_FRAME_BYTES, 0);
+    int16_t *samples = reinterpret_cast<int16_t*>(data.data());
+    for (int frame = 0; frame < REPLAY_SYNTHETIC_FRAMES; frame++)
+    {
+        const int16_t sample = static_cast<int16_t>(syntheticToneSample(frame) * 32767);
+        samples[frame * 2] = sample;
+        samples[frame * 2 + 1] = sample;
+    }
+    return data;
+}
+
+/**
+ * @brief writeIec61937Burst wraps an AC-3 frame in an IEC 61937 burst, as S16LE, like the DIR9001 captures it.
+ */
+static void writeIec61937Burst(char *burst, const AVPacket *packet)
+{
+    const int burstBytes = REPLAY_IEC61937_BURST_FRAMES * REPLAY_FRAME_BYTES;
+    const int payloadBytes = std::min(packet->size, burstBytes - 8);
+    const uint16_t preamble[4] = { 0xF872, 0x4E1F, 0x0001, static_cast<uint16_t>(payloadBytes * 8) }; // Pa, Pb, Pc (AC-3), Pd
+
+    uint8_t *out = reinterpret_cast<uint8_t*>(burst);
+    for (int i = 0; i < 4; i++)
+    {
+        out[i * 2] = preamble[i] & 0xFF;
+        out[i * 2 + 1] = preamble[i] >> 8;
+    }
+
+    // The AC-3 frame is big endian 16 bit words, so swap each pair of bytes.
+    for (int i = 0; i < payloadBytes; i += 2)
+    {
+        out[8 + i] = i + 1 < payloadBytes ? packet->data[i + 1] : 0;
+        out[8 + i + 1] = packet->data[i];
+    }
+}
+
+/**
+ * @brief syntheticAc3 encodes the tone of syntheticTone() to AC-3, in IEC 61937 bursts, to stand in for an encoded capture.
+ */
+static QByteArray syntheticAc3()
+{
+    avcodec_register_all();
+
+    AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_AC3);
+    AVCodecContext *context = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (!context)
+        throw AnnotatedException("No AC-3 encoder for the synthetic replay capture");
+
+    context->sample_rate = REPLAY_SAMPLE_RATE;
+    context->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    context->channel_layout = AV_CH_LAYOUT_STEREO;
+    context->channels = 2;
+    context->bit_rate = 192000;
+
+    if (avcodec_open2(context, codec, nullptr) < 0 || context->frame_size != REPLAY_IEC61937_BURST_FRAMES)
+    {
+        avcodec_free_context(&context);
+        throw AnnotatedException("Can't open the AC-3 encoder for the synthetic replay capture");
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    frame->nb_samples = context->frame_size;
+    frame->format = context->sample_fmt;
+    frame->channel_layout = context->channel_layout;
+    frame->sample_rate = context->sample_rate;
+    av_frame_get_buffer(frame, 0);
+    AVPacket *packet = av_packet_alloc();
+
+    QByteArray data(REPLAY_SYNTHETIC_FRAMES * REPLAY_FRAME_BYTES, 0);
+    const int bursts = REPLAY_SYNTHETIC_FRAMES / REPLAY_IEC61937_BURST_FRAMES;
+    int burstsWritten = 0;
+
+    for (int i = 0; i <= bursts; i++)
+    {
+        if (i < bursts)
+        {
+            av_frame_make_writable(frame);
+            for (int channel = 0; channel < 2; channel++)
+            {
+                float *samples = reinterpret_cast<float*>(frame->data[channel]);
+                for (int n = 0; n < frame->nb_samples; n++)
+                    samples[n] = syntheticToneSample(i * REPLAY_IEC61937_BURST_FRAMES + n);
+            }
+            frame->pts = static_cast<int64_t>(i) * REPLAY_IEC61937_BURST_FRAMES;
+            avcodec_send_frame(context, frame);
+        }
+        else
+        {
+            avcodec_send_frame(context, nullptr); // Flush the encoder delay.
+        }
+
+        while (burstsWritten < bursts && avcodec_receive_packet(context, packet) == 0)
+        {
+            writeIec61937Burst(data.data() + burstsWritten * REPLAY_IEC61937_BURST_FRAMES * REPLAY_FRAME_BYTES, packet);
+            burstsWritten++;
+            av_packet_unref(packet);
+        }
+    }
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&context);
+
+    if (burstsWritten == 0)
+        throw AnnotatedException("The AC-3 encoder gave nothing for the synthetic replay capture");
+
+    return data;
+}
+
+/**
+ * @param totalSeconds audio to feed; the script is repeated until it's done. 0 plays the script once.
+ * @param speed multiple of real time; 0 is as fast as the ring buffer takes it.
+ * @param freeBytes room in the ring buffer.
+ * @param formatChanged called from the replay thread when a segment changes the format, before it's changed.
+ */
+ReplaySource::ReplaySource(const QString &scriptPath, int totalSeconds, double speed, const Producer &producer, const std::function<int()> &freeBytes,
+                           const std::function<void(bool encoded)> &formatChanged) :
+    mTotalFrames(static_cast<quint64>(std::max(0, totalSeconds)) * REPLAY_SAMPLE_RATE),
+    mSpeed(speed),
+    mProducer(producer),
+    mFreeBytes(freeBytes),
+    mFormatChanged(formatChanged),
+    mStop(false),
+    mEncoded(false),
+    mFinished(false),
+    mFramesFed(0),
+    mSegmentsDone(0),
+    mFormatChanges(0),
+    mStalledUs(0)
+{
+    QFile script(scriptPath);
+    if (!script.open(QFile::ReadOnly | QFile::Text))
+        throw AnnotatedException(QString("Can't open replay script '%1'").arg(scriptPath));
+
+    const QDir scriptDir = QFileInfo(scriptPath).dir();
+    QByteArray tone;
+    QByteArray ac3;
+    QTextStream lines(&script);
+    int lineNumber = 0;
+    while (!lines.atEnd())
+    {
+        const QString line = lines.readLine().trimmed();
+        lineNumber++;
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+
+        const QStringList fields = line.simplified().split(' ');
+        bool ok = false;
+        const double seconds = fields.at(0).toDouble(&ok);
+        const QString kind = fields.value(1);
+
+        Segment segment;
+        segment.frames = static_cast<quint64>(seconds * REPLAY_SAMPLE_RATE);
+        segment.encoded = kind == "encoded";
+
+        if (!ok || seconds <= 0 || (kind != "pause" && fields.size() < 3) || (kind != "pause" && kind != "pcm" && kind != "encoded"))
+            throw AnnotatedException(QString("%1:%2: expected '<seconds> pcm|encoded <file>' or '<seconds> pause'").arg(scriptPath).arg(lineNumber));
+
+        if (fields.value(2) == "@tone" && kind == "pcm")
+        {
+            if (tone.isEmpty())
+                tone = syntheticTone();
+            segment.data = tone;
+        }
+        else if (fields.value(2) == "@ac3" && kind == "encoded")
+        {
+            if (ac3.isEmpty())
+                ac3 = syntheticAc3();
+            segment.data = ac3;
+        }
+        else if (fields.value(2).startsWith('@'))
+        {
+            throw AnnotatedException(QString("%1:%2: generated captures are '@tone' for pcm and '@ac3' for encoded").arg(scriptPath).arg(lineNumber));
+        }
+        else if (kind != "pause")
+        {
+            const QString path = scriptDir.filePath(fields.at(2));
+            QFile capture(path);
+            if (!capture.open(QFile::ReadOnly))
+                throw AnnotatedException(QString("Can't open capture '%1'").arg(path));
+            segment.data = capture.readAll();
+            segment.data.truncate(segment.data.size() - segment.data.size() % REPLAY_FRAME_BYTES);
+            if (segment.data.isEmpty())
+                throw AnnotatedException(QString("Capture '%1' is empty").arg(path));
+        }
+
+        mScriptFrames += segment.frames;
+        mSegments.append(segment);
+    }
+
+    if (mSegments.isEmpty())
+        throw AnnotatedException(QString("Replay script '%1' has no segments").arg(scriptPath));
+}
+
+ReplaySource::~ReplaySource()
+{
+    stop();
+}
+
+void ReplaySource::start(const ThreadRealtimeSettings &realtime)
+{
+    mRealtime = realtime;
+    mStop = false;
+    mThread = std::thread(&ReplaySource::feedLoop, this);
+}
+
+void ReplaySource::stop()
+{
+    mStop = true;
+    if (mThread.joinable())
+        mThread.join();
+}
+
+void ReplaySource::feedLoop()
+{
+    std::cout << qPrintable(applyRealtimeToCurrentThread(mRealtime, "Replay")) << std::endl;
+    Tracer::registerCurrentThread("Replay");
+
+    const quint64 totalFrames = mTotalFrames > 0 ? mTotalFrames : mScriptFrames;
+    const quint64 startNs = monotonicNs();
+    char chunk[REPLAY_CHUNK_FRAMES * REPLAY_FRAME_BYTES];
+    quint64 frames = 0;
+    int segmentIndex = 0;
+    quint64 segmentLeft = 0;
+    int dataPosition = 0;
+
+    while (!mStop && frames < totalFrames)
+    {
+        const Segment &segment = mSegments.at(segmentIndex);
+        if (segmentLeft == 0)
+        {
+            // Segment start: this is the DIR9001 seeing a new format, and raising its GPIO.
+            if (segment.encoded != mEncoded)
+            {
+                mFormatChanges++;
+                if (mFormatChanged)
+                    mFormatChanged(segment.encoded);
+            }
+            mEncoded = segment.encoded;
+            segmentLeft = segment.frames;
+            dataPosition = 0;
+        }
+
+        const int chunkFrames = static_cast<int>(std::min<quint64>(std::min<quint64>(REPLAY_CHUNK_FRAMES, segmentLeft), totalFrames - frames));
+        const int bytes = chunkFrames * REPLAY_FRAME_BYTES;
+
+        if (segment.data.isEmpty())
+        {
+            memset(chunk, 0, bytes);
+        }
+        else
+        {
+            for (int done = 0; done < bytes; )
+            {
+                const int n = std::min(bytes - done, segment.data.size() - dataPosition);
+                memcpy(chunk + done, segment.data.constData() + dataPosition, n);
+                done += n;
+                dataPosition = (dataPosition + n) % segment.data.size();
+            }
+        }
+
+        if (mSpeed > 0)
+        {
+            const quint64 dueNs = startNs + static_cast<quint64>(frames * 1000000000.0 / (REPLAY_SAMPLE_RATE * mSpeed));
+            struct timespec due;
+            due.tv_sec = static_cast<time_t>(dueNs / 1000000000ULL);
+            due.tv_nsec = static_cast<long>(dueNs % 1000000000ULL);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, nullptr);
+        }
+
+        while (!mStop && mFreeBytes() < bytes)
+        {
+            usleep(REPLAY_BACKPRESSURE_SLEEP_US);
+            mStalledUs += REPLAY_BACKPRESSURE_SLEEP_US;
+        }
+
+        mProducer(chunk, bytes);
+
+        frames += chunkFrames;
+        mFramesFed = frames;
+        segmentLeft -= chunkFrames;
+        if (segmentLeft == 0)
+        {
+            segmentIndex = (segmentIndex + 1) % mSegments.size();
+            mSegmentsDone++;
+        }
+    }
+
+    mFinished = true;
+}
+
+bool ReplaySource::seesEncodedAudio() const
+{
+    return mEncoded;
+}
+
+QString ReplaySource::describe() const
+{
+    return QString("Replay: %1 s of audio fed, %2 segments, %3 format changes, %4 ms waited for room in the ring buffer")
+            .arg(secondsFed(), 0, 'f', 1).arg(mSegmentsDone).arg(mFormatChanges).arg(mStalledUs / 1000);
+}
+
+bool ReplaySource::finished() const
+{
+    return mFinished;
+}
+
+double ReplaySource::secondsFed() const
+{
+    return static_cast<double>(mFramesFed) / REPLAY_SAMPLE_RATE;
+}
+
+quint64 ReplaySource::formatChanges() const
+{
+    return mFormatChanges;
+}
+
+quint64 ReplaySource::stalledUs() const
+{
+    return mStalledUs;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef REPLAYSOURCE_H
+#define REPLAYSOURCE_H
+
+#include <QByteArray>
+#include <QList>
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include "capturesource.h"
+
+#define REPLAY_SAMPLE_RATE 48000
+#define REPLAY_FRAME_BYTES 4 // S16LE stereo, like the DIR9001 capture.
+#define REPLAY_CHUNK_FRAMES 256
+#define REPLAY_BACKPRESSURE_SLEEP_US 1000
+#define REPLAY_SYNTHETIC_FRAMES 49152 // 32 IEC 61937 AC-3 bursts, and a whole number of tone periods, so it loops cleanly.
+#define REPLAY_SYNTHETIC_TONE_HZ 1000
+#define REPLAY_IEC61937_BURST_FRAMES 1536
+
+/**
+ * @brief The ReplaySource class feeds recorded or generated captures to the ring buffer, following a script, at a multiple
+ * of real time.
+ *
+ * The script has a segment per line: '<seconds> pcm <file>' or '<seconds> encoded <file>' plays the capture (looped) with
+ * the DIR9001 format GPIO at that level, and '<seconds> pause' is zeroes seen as PCM, like a source that's paused. Files are
+ * relative to the script; '@tone' (PCM) and '@ac3' (IEC 61937) are generated instead, so scripts can run without
+ * recordings. Consecutive encoded segments with different codecs or layouts exercise the break on a changed channel
+ * layout in the decoding path, without a GPIO change in between.
+ *
+ * A segment with a different format than the one before calls formatChanged, before the format flips, like the GPIO
+ * interrupt of the DIR9001 does.
+ *
+ * When the ring buffer is full, it waits, so at any speed, dropped frames mean something is wrong downstream.
+ */
+class ReplaySource : public CaptureSource
+{
+    struct Segment
+    {
+        quint64 frames = 0;
+        bool encoded = false;
+        QByteArray data; // Empty for a pause.
+    };
+
+    QList<Segment> mSegments;
+    quint64 mScriptFrames = 0;
+    const quint64 mTotalFrames;
+    const double mSpeed;
+    const Producer mProducer;
+    const std::function<int()> mFreeBytes;
+    const std::function<void(bool encoded)> mFormatChanged;
+
+    ThreadRealtimeSettings mRealtime;
+    std::atomic<bool> mStop;
+    std::thread mThread;
+
+    std::atomic<bool> mEncoded;
+    std::atomic<bool> mFinished;
+    std::atomic<quint64> mFramesFed;
+    std::atomic<quint64> mSegmentsDone;
+    std::atomic<quint64> mFormatChanges;
+    std::atomic<quint64> mStalledUs;
+
+    void feedLoop();
+
+public:
+    ReplaySource(const QString &scriptPath, int totalSeconds, double speed, const Producer &producer, const std::function<int()> &freeBytes,
+                 const std::function<void(bool encoded)> &formatChanged);
+    ~ReplaySource();
+
+    void start(const ThreadRealtimeSettings &realtime) override;
+    void stop() override;
+    bool seesEncodedAudio() const override;
+    QString describe() const override;
+    bool finished() const override;
+
+    double secondsFed() const;
+    quint64 formatChanges() const;
+    quint64 stalledUs() const;
+};
+
+#endif // REPLAYSOURCE_H
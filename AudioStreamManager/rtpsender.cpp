@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "rtpsender.h"
+#include <QStringList>
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "annotatedexception.h"
+
+/**
+ * @param destination address[:port], multicast or not; 127.0.0.1 makes it easy to test on the box itself.
+ * @param format L16 or L24.
+ * @param interface address of the interface to send multicast on; empty leaves it to the routing table.
+ * @param channels what the receivers are told in the SDP.
+ * @param captureFramePosition how many capture frames were consumed by playback so far.
+ */
+RtpSender::RtpSender(const QString &destination, const QString &format, int mtu, int ttl, const QString &interface, int channels,
+                     const std::function<quint64()> &captureFramePosition) :
+    mCaptureFramePosition(captureFramePosition),
+    mL24(format.compare("L24", Qt::CaseInsensitive) == 0),
+    mMtu(mtu),
+    mTtl(ttl),
+    mSdpChannels(channels),
+    mInterface(interface),
+    mSenderIdle(false),
+    mStop(false),
+    mPacketsSent(0),
+    mPacketsDropped(0),
+    mSendErrors(0)
+{
+    if (!mL24 && format.compare("L16", Qt::CaseInsensitive) != 0)
+        throw AnnotatedException(QString("Unknown RTP format '%1'; use L16 or L24").arg(format));
+
+    const QStringList parts = destination.split(':');
+    const int port = parts.size() > 1 ? parts.at(1).toInt() : RTP_DEFAULT_PORT;
+    memset(&mDestination, 0, sizeof(mDestination));
+    mDestination.sin_family = AF_INET;
+    mDestination.sin_port = htons(static_cast<uint16_t>(port));
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, parts.at(0).toLatin1().constData(), &mDestination.sin_addr) != 1)
+        throw AnnotatedException(QString("Invalid RTP destination '%1'").arg(destination));
+
+    if (mMtu - RTP_IP_UDP_OVERHEAD - RTP_HEADER_SIZE < MAX_OUTPUT_CHANNELS * 3)
+        throw AnnotatedException(QString("MTU %1 is too small for RTP").arg(mMtu));
+
+    const int bytesPerSample = mL24 ? 3 : 2;
+    const int mtuFrames = (mMtu - RTP_IP_UDP_OVERHEAD - RTP_HEADER_SIZE) / (mSdpChannels * bytesPerSample);
+    mPacketFrames = std::min(RTP_PACKET_FRAMES, mtuFrames);
+
+    std::random_device randomDevice;
+    mSsrc = randomDevice();
+    mSequence = static_cast<uint16_t>(randomDevice());
+    memset(&mCurrent, 0, sizeof(mCurrent));
+}
+
+RtpSender::~RtpSender()
+{
+    stop();
+}
+
+void RtpSender::start()
+{
+    mSocket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (mSocket < 0)
+        throw AnnotatedException(QString("Can't create RTP socket: %1").arg(strerror(errno)));
+
+    const unsigned char ttl = static_cast<unsigned char>(mTtl);
+    const unsigned char loop = 1; // So receivers on this box hear it too.
+    const int tos = RTP_DSCP_EF << 2;
+    setsockopt(mSocket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(mSocket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    setsockopt(mSocket, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+
+    if (!mInterface.isEmpty())
+    {
+        in_addr address;
+        if (inet_pton(AF_INET, mInterface.toLatin1().constData(), &address) != 1 ||
+            setsockopt(mSocket, IPPROTO_IP, IP_MULTICAST_IF, &address, sizeof(address)) < 0)
+            throw AnnotatedException(QString("Can't send RTP multicast on interface '%1'").arg(mInterface));
+    }
+
+    mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    mStop = false;
+    mThread = std::thread(&RtpSender::senderLoop, this);
+}
+
+void RtpSender::stop()
+{
+    if (mThread.joinable())
+    {
+        mStop = true;
+        const uint64_t one = 1;
+        ssize_t ret = ::write(mWakeFd, &one, sizeof(one));
+        Q_UNUSED(ret)
+        mThread.join();
+    }
+
+    if (mWakeFd >= 0)
+        close(mWakeFd);
+    if (mSocket >= 0)
+        close(mSocket);
+    mWakeFd = -1;
+    mSocket = -1;
+}
+
+/**
+ * @brief RtpSender::beginPath re-anchors the timestamps on the capture clock. Called from the playback thread.
+ */
+void RtpSender::beginPath(int channels)
+{
+    mCurrent.frames = 0;
+    mCurrent.channels = mSdpChannels;
+    mPathChannels = channels;
+
+    // Compared as the difference, so it keeps working when the timestamps wrap.
+    const uint32_t anchor = static_cast<uint32_t>(mCaptureFramePosition());
+    if (!mTimestampAnchored || static_cast<int32_t>(anchor - mNextTimestamp) > 0)
+        mNextTimestamp = anchor;
+    mTimestampAnchored = true;
+    mMarker = true;
+}
+
+/**
+ * @brief RtpSender::write cuts the samples in packets, at the channel count of the SDP, and queues them for the sender thread. Never blocks.
+ */
+void RtpSender::write(const int16_t *samples, int frames)
+{
+    const int pathChannels = mPathChannels;
+    const int channels = mCurrent.channels;
+    if (pathChannels <= 0)
+        return;
+
+    const int common = std::min(pathChannels, channels);
+
+    while (frames > 0)
+    {
+        const int chunk = std::min(frames, mPacketFrames - mCurrent.frames);
+        int16_t *out = mCurrent.samples + mCurrent.frames * channels;
+        if (pathChannels == channels)
+        {
+            memcpy(out, samples, chunk * channels * sizeof(int16_t));
+        }
+        else
+        {
+            // The first DAC channels are front left and right, so stereo ends up on the front speakers of the receiver.
+            for (int f = 0; f < chunk; f++)
+            {
+                for (int c = 0; c < common; c++)
+                    out[f * channels + c] = samples[f * pathChannels + c];
+                for (int c = common; c < channels; c++)
+                    out[f * channels + c] = 0;
+            }
+        }
+        mCurrent.frames += chunk;
+        samples += chunk * pathChannels;
+        frames -= chunk;
+
+        if (mCurrent.frames == mPacketFrames)
+            queueCurrent();
+    }
+}
+
+void RtpSender::queueCurrent()
+{
+    mCurrent.timestamp = mNextTimestamp;
+    mCurrent.marker = mMarker;
+    mNextTimestamp += mCurrent.frames;
+    mMarker = false;
+
+    if (mQueue.push(mCurrent))
+    {
+        if (mSenderIdle.exchange(false))
+        {
+            const uint64_t one = 1;
+            ssize_t ret = ::write(mWakeFd, &one, sizeof(one));
+            Q_UNUSED(ret)
+        }
+    }
+    else
+    {
+        mPacketsDropped++;
+    }
+
+    mCurrent.frames = 0;
+}
+
+int RtpSender::buildPacket(const Chunk &chunk, uint8_t *packet)
+{
+    packet[0] = 0x80; // Version 2, no padding, extension or CSRCs.
+    packet[1] = (chunk.marker ? 0x80 : 0) | RTP_PAYLOAD_TYPE;
+    packet[2] = mSequence >> 8;
+    packet[3] = mSequence & 0xFF;
+    packet[4] = chunk.timestamp >> 24;
+    packet[5] = (chunk.timestamp >> 16) & 0xFF;
+    packet[6] = (chunk.timestamp >> 8) & 0xFF;
+    packet[7] = chunk.timestamp & 0xFF;
+    packet[8] = mSsrc >> 24;
+    packet[9] = (mSsrc >> 16) & 0xFF;
+    packet[10] = (mSsrc >> 8) & 0xFF;
+    packet[11] = mSsrc & 0xFF;
+    mSequence++;
+
+    // Network byte order; L24 is the 16 bit sample with a zero low byte.
+    uint8_t *p = packet + RTP_HEADER_SIZE;
+    const int samples = chunk.frames * chunk.channels;
+    for (int i = 0; i < samples; i++)
+    {
+        const uint16_t s = static_cast<uint16_t>(chunk.samples[i]);
+        *p++ = s >> 8;
+        *p++ = s & 0xFF;
+        if (mL24)
+            *p++ = 0;
+    }
+
+    return static_cast<int>(p - packet);
+}
+
+void RtpSender::senderLoop()
+{
+    uint8_t *packet = new uint8_t[mMtu];
+    Chunk chunk;
+
+    while (!mStop)
+    {
+        if (!mQueue.pop(chunk))
+        {
+            // Tell the playback thread to wake us, then check once more, so a chunk queued in between isn't missed.
+            mSenderIdle = true;
+            if (!mQueue.pop(chunk))
+            {
+                struct pollfd pfd;
+                pfd.fd = mWakeFd;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                poll(&pfd, 1, -1);
+
+                uint64_t count;
+                ssize_t ret = read(mWakeFd, &count, sizeof(count));
+                Q_UNUSED(ret)
+                continue;
+            }
+            mSenderIdle = false;
+        }
+
+        const int size = buildPacket(chunk, packet);
+        if (sendto(mSocket, packet, size, MSG_DONTWAIT, reinterpret_cast<const sockaddr*>(&mDestination), sizeof(mDestination)) == size)
+            mPacketsSent++;
+        else
+            mSendErrors++;
+    }
+
+    delete[] packet;
+}
+
+/**
+ * @brief RtpSender::sdp describes the stream for receivers, like 'ffplay -protocol_whitelist file,udp,rtp stream.sdp'.
+ */
+QString RtpSender::sdp() const
+{
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &mDestination.sin_addr, address, sizeof(address));
+    const bool multicast = IN_MULTICAST(ntohl(mDestination.sin_addr.s_addr));
+
+    QString result;
+    result += "v=0\n";
+    result += QString("o=- %1 0 IN IP4 %2\n").arg(mSsrc).arg(mInterface.isEmpty() ? "0.0.0.0" : mInterface);
+    result += "s=AudioStreamManager\n";
+    result += QString("c=IN IP4 %1%2\n").arg(address).arg(multicast ? QString("/%1").arg(mTtl) : QString());
+    result += "t=0 0\n";
+    result += QString("m=audio %1 RTP/AVP %2\n").arg(ntohs(mDestination.sin_port)).arg(RTP_PAYLOAD_TYPE);
+    result += QString("a=rtpmap:%1 %2/%3/%4\n").arg(RTP_PAYLOAD_TYPE).arg(mL24 ? "L24" : "L16").arg(RTP_SAMPLE_RATE).arg(mSdpChannels);
+    result += QString("a=ptime:%1\n").arg(mPacketFrames * 1000.0 / RTP_SAMPLE_RATE);
+    return result;
+}
+
+QString RtpSender::describe() const
+{
+    return QString("RTP: %1 packets sent, %2 dropped, %3 send errors").arg(mPacketsSent).arg(mPacketsDropped).arg(mSendErrors);
+}
+
+quint64 RtpSender::packetsSent() const
+{
+    return mPacketsSent;
+}
+
+quint64 RtpSender::packetsDropped() const
+{
+    return mPacketsDropped;
+}
+
+quint64 RtpSender::sendErrors() const
+{
+    return mSendErrors;
+}
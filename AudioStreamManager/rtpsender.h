@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef RTPSENDER_H
+#define RTPSENDER_H
+
+#include <QString>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <netinet/in.h>
+
+#include "outputtap.h"
+#include "lockfreequeue.h"
+#include "speakerlayout.h"
+
+#define RTP_SAMPLE_RATE 48000
+#define RTP_PACKET_FRAMES 48 // 1 ms per packet, like AES67; less when the MTU doesn't allow it.
+#define RTP_HEADER_SIZE 12
+#define RTP_IP_UDP_OVERHEAD 28
+#define RTP_QUEUE_PACKETS 256 // Must be a power of two.
+#define RTP_PAYLOAD_TYPE 96 // Dynamic; the SDP says what it is.
+#define RTP_DSCP_EF 46
+#define RTP_DEFAULT_PORT 5004
+
+/**
+ * @brief The RtpSender class sends the output as RTP, L16 or L24, to a UDP (multicast) destination.
+ *
+ * The playback thread cuts the audio in packet sized chunks and queues them without locking; when the queue is full,
+ * the chunk is dropped and counted. The sender thread does the formatting and the sendto(), so local playback never
+ * waits for the network.
+ *
+ * RTP timestamps are positions on the capture clock: at the start of each playback path, the timestamp is set to the
+ * amount of capture frames consumed so far, and the marker bit is set. After that it counts output frames. Because the
+ * output runs ahead of the capture by the device buffer and the transition, a quick switch can anchor below what was
+ * already sent; then the timestamps just go on, so they never go backwards.
+ *
+ * The SDP has one channel count for the whole stream, the speaker layout's, but raw PCM that isn't upmixed plays in
+ * stereo. So, a path with fewer channels is sent with the rest silent, and one with more only sends the first ones.
+ */
+class RtpSender : public OutputTap
+{
+    struct Chunk
+    {
+        uint32_t timestamp;
+        int frames;
+        int channels;
+        bool marker;
+        int16_t samples[RTP_PACKET_FRAMES * MAX_OUTPUT_CHANNELS];
+    };
+
+    const std::function<quint64()> mCaptureFramePosition;
+    const bool mL24;
+    const int mMtu;
+    const int mTtl;
+    const int mSdpChannels;
+    sockaddr_in mDestination;
+    QString mInterface;
+    int mSocket = -1;
+    int mWakeFd = -1;
+    uint32_t mSsrc;
+    uint16_t mSequence;
+
+    int mPacketFrames = RTP_PACKET_FRAMES;
+
+    // Only touched by the playback thread.
+    Chunk mCurrent;
+    int mPathChannels = 0;
+    uint32_t mNextTimestamp = 0;
+    bool mTimestampAnchored = false;
+    bool mMarker = false;
+
+    LockFreeQueue<Chunk, RTP_QUEUE_PACKETS> mQueue;
+    std::atomic<bool> mSenderIdle;
+    std::atomic<bool> mStop;
+    std::thread mThread;
+
+    std::atomic<quint64> mPacketsSent;
+    std::atomic<quint64> mPacketsDropped;
+    std::atomic<quint64> mSendErrors;
+
+    void queueCurrent();
+    void senderLoop();
+    int buildPacket(const Chunk &chunk, uint8_t *packet);
+
+public:
+    RtpSender(const QString &destination, const QString &format, int mtu, int ttl, const QString &interface, int channels,
+              const std::function<quint64()> &captureFramePosition);
+    ~RtpSender();
+
+    void start();
+    void stop();
+    QString sdp() const;
+    QString describe() const;
+
+    void beginPath(int channels) override;
+    void write(const int16_t *samples, int frames) override;
+
+    quint64 packetsSent() const;
+    quint64 packetsDropped() const;
+    quint64 sendErrors() const;
+};
+
+#endif // RTPSENDER_H
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+#include "runtimeconfig.h"
+#include <QSettings>
+#include <QFileInfo>
+#include <QStringList>
+#include "annotatedexception.h"
+#include "speakerlayout.h"
+
+static std::atomic<unsigned int> reloadRequestCount(0);
+
+static int checkedValue(QSettings &file, const QString &key, int current, int min, int max)
+{
+    bool ok = false;
+    const int value = file.value(key, current).toInt(&ok);
+    if (!ok || value < min || value > max)
+        throw AnnotatedException(QString("Config value %1 must be a number from %2 to %3").arg(key).arg(min).arg(max));
+    return value;
+}
+
+/**
+ * @brief RuntimeConfig::load reads the config file over the current values.
+ * @return false when there is no such file, in which case nothing is changed.
+ *
+ * Throws on values that are out of range, so a typo doesn't become a broken pipeline.
+ */
+bool RuntimeConfig::load(const QString &path)
+{
+    if (!QFileInfo(path).exists())
+        return false;
+
+    QSettings file(path, QSettings::IniFormat);
+    if (file.status() != QSettings::NoError)
+        throw AnnotatedException(QString("Can't parse config file '%1'").arg(path));
+
+    captureDevice = file.value("devices/capture", captureDevice).toString();
+    playbackDevice = file.value("devices/playback", playbackDevice).toString();
+    mixerCard = file.value("devices/mixer", mixerCard).toString();
+    gpioLine = checkedValue(file, "devices/gpio", gpioLine, -1, 1023);
+    networkSource = file.value("devices/network_source", networkSource).toString();
+
+    // Sinks in the file replace the ones from the command line, instead of adding to them.
+    QList<ExtraSinkConfig> sinks;
+    for (const QString &group : file.childGroups())
+    {
+        if (!group.startsWith("sink"))
+            continue;
+
+        ExtraSinkConfig sink;
+        sink.device = file.value(group + "/device").toString();
+        sink.delayMs = checkedValue(file, group + "/delay_ms", sink.delayMs, 0, EXTRA_SINK_MAX_DELAY_MS);
+        sink.channels = checkedValue(file, group + "/channels", sink.channels, 1, MAX_OUTPUT_CHANNELS);
+        if (sink.device.isEmpty())
+            throw AnnotatedException(QString("Config section %1 needs a device").arg(group));
+        sinks << sink;
+    }
+    if (!sinks.isEmpty())
+        extraSinks = sinks;
+
+    // The ring buffer size must be whole frames, also for the biggest we capture: 4 bytes.
+    framesInBuffer = checkedValue(file, "buffers/frames", framesInBuffer, 16, 4096);
+    ringBufferSize = checkedValue(file, "buffers/ring_bytes", ringBufferSize, 65536, 268435456) / 4 * 4;
+    avioBufferSize = checkedValue(file, "buffers/avio_bytes", avioBufferSize, 512, 1048576);
+    probeSize = checkedValue(file, "buffers/probe_bytes", probeSize, 32, 1048576); // 32 is the ffmpeg minimum.
+    latency.captureBufferUs = checkedValue(file, "buffers/capture_buffer_us", latency.captureBufferUs, 1000, 1000000);
+    latency.rawPlaybackBufferUs = checkedValue(file, "buffers/raw_playback_buffer_us", latency.rawPlaybackBufferUs, 1000, 1000000);
+    latency.decodedPlaybackBufferUs = checkedValue(file, "buffers/decoded_playback_buffer_us", latency.decodedPlaybackBufferUs, 1000, 1000000);
+    latency.periods = checkedValue(file, "buffers/periods", latency.periods, 0, 64);
+
+    lockThresholdSamples = checkedValue(file, "dsp/lock_threshold", lockThresholdSamples, 1, 192000);
+    volume = checkedValue(file, "dsp/volume", volume, 0, 100);
+    upmixStereo = file.value("dsp/upmix", upmixStereo).toBool();
+
+    if (captureDevice.isEmpty() || playbackDevice.isEmpty() || mixerCard.isEmpty())
+        throw AnnotatedException("Config device names can't be empty");
+
+    return true;
+}
+
+/**
+ * @brief RuntimeConfig::changeTo says what's needed to apply the next config. The biggest change needed wins.
+ */
+ConfigChange RuntimeConfig::changeTo(const RuntimeConfig &next) const
+{
+    if (captureDevice != next.captureDevice || playbackDevice != next.playbackDevice || mixerCard != next.mixerCard
+            || gpioLine != next.gpioLine || networkSource != next.networkSource || extraSinks != next.extraSinks || framesInBuffer != next.framesInBuffer || ringBufferSize != next.ringBufferSize
+            || latency.captureBufferUs != next.latency.captureBufferUs || latency.periods != next.latency.periods)
+        return ConfigChange::Pipeline;
+
+    if (avioBufferSize != next.avioBufferSize || probeSize != next.probeSize || upmixStereo != next.upmixStereo
+            || latency.rawPlaybackBufferUs != next.latency.rawPlaybackBufferUs
+            || latency.decodedPlaybackBufferUs != next.latency.decodedPlaybackBufferUs)
+        return ConfigChange::Playback;
+
+    if (lockThresholdSamples != next.lockThresholdSamples || volume != next.volume)
+        return ConfigChange::Live;
+
+    return ConfigChange::None;
+}
+
+QString RuntimeConfig::describe() const
+{
+    const QString capture = networkSource.isEmpty() ? captureDevice : QString("network %1").arg(networkSource);
+    const QString gpio = gpioLine >= 0 ? QString::number(gpioLine) : QString("none");
+    QString playback = playbackDevice;
+    for (const ExtraSinkConfig &sink : extraSinks)
+        playback += " + " + sink.describe();
+
+    return QString("capture %1, playback %2, mixer %3, GPIO %4, %5 frames per read, ring buffer %6 bytes, AVIO buffer %7 bytes, "
+                   "probe %8 bytes, %9, ").arg(capture).arg(playback).arg(mixerCard).arg(gpio).arg(framesInBuffer)
+            .arg(ringBufferSize).arg(avioBufferSize).arg(probeSize).arg(latency.describe())
+            + QString("lock threshold %1 samples/s, volume %2, %3").arg(lockThresholdSamples).arg(volume).arg(upmixStereo ? "upmix" : "no upmix");
+}
+
+bool ExtraSinkConfig::operator==(const ExtraSinkConfig &other) const
+{
+    return device == other.device && delayMs == other.delayMs && channels == other.channels;
+}
+
+QString ExtraSinkConfig::describe() const
+{
+    return QString("%1 (%2 ch, %3 ms delay)").arg(device).arg(channels).arg(delayMs);
+}
+
+/**
+ * @brief ExtraSinkConfig::parse reads device[@delay_ms[@channels]], the command line form. ALSA names have colons and
+ * commas, hence the @.
+ */
+ExtraSinkConfig ExtraSinkConfig::parse(const QString &value)
+{
+    const QStringList parts = value.split('@');
+    ExtraSinkConfig sink;
+    sink.device = parts.at(0);
+
+    bool delayOk = true;
+    bool channelsOk = true;
+    if (parts.size() > 1)
+        sink.delayMs = parts.at(1).toInt(&delayOk);
+    if (parts.size() > 2)
+        sink.channels = parts.at(2).toInt(&channelsOk);
+
+    if (sink.device.isEmpty() || parts.size() > 3 || !delayOk || !channelsOk || sink.delayMs < 0 || sink.delayMs > EXTRA_SINK_MAX_DELAY_MS
+            || sink.channels < 1 || sink.channels > MAX_OUTPUT_CHANNELS)
+        throw AnnotatedException(QString("Invalid extra sink '%1'; use device[@delay_ms[@channels]]").arg(value));
+
+    return sink;
+}
+
+const char *RuntimeConfig::describe(ConfigChange change)
+{
+    switch (change)
+    {
+    case ConfigChange::None:
+        return "nothing changed";
+    case ConfigChange::Live:
+        return "applied live";
+    case ConfigChange::Playback:
+        return "restarting playback";
+    case ConfigChange::Pipeline:
+        return "restarting the pipeline";
+    }
+    return "";
+}
+
+/**
+ * @brief RuntimeConfig::requestReload only counts, so it's safe to call from the SIGHUP handler.
+ */
+void RuntimeConfig::requestReload()
+{
+    reloadRequestCount++;
+}
+
+/**
+ * @brief RuntimeConfig::reloadRequests is a count, so every pipeline can see a new request by comparing with what it saw last.
+ */
+unsigned int RuntimeConfig::reloadRequests()
+{
+    return reloadRequestCount;
+}
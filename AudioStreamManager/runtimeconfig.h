@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+#ifndef RUNTIMECONFIG_H
+#define RUNTIMECONFIG_H
+
+#include <QString>
+#include <QList>
+#include <atomic>
+
+#include "latencyprofile.h"
+
+#define RUNTIME_CONFIG_PATH "/etc/audiostreammanager.conf"
+
+// Defaults, for when the config file doesn't say.
+#define CAPTURE_DEVICE "hw:0"
+#define PLAYBACK_DEVICE "hw:0"
+#define MIXER_CARD "default"
+#define DIR9001_GPIO_LINE 51 // The DIR9001 AUDIO pin on the cape.
+#define FRAMES_IN_BUFFER 64
+#define RING_BUFFER_SIZE 10485760
+#define AVIO_CTX_BUFFER_SIZE 4096
+#define PROBE_SIZE 4096 // Small, for fast codec detection with avformat_find_stream_info().
+#define LOCK_THRESHOLD_SAMPLES 36000 // See AudioRingBuffer::onSampleRateCalculatorTimer()
+#define EXTRA_SINK_CHANNELS 2 // Most USB DACs are stereo.
+#define EXTRA_SINK_MAX_DELAY_MS 2000
+
+/**
+ * @brief What it takes to go from one runtime config to another.
+ */
+enum class ConfigChange
+{
+    None,
+    Live, // Applied right away.
+    Playback, // Applied by the next playback worker, so at a block boundary.
+    Pipeline // The capture and playback pipeline must be built again.
+};
+
+/**
+ * @brief An extra ALSA device that plays the same output as the primary one, like a USB DAC for a second zone.
+ */
+struct ExtraSinkConfig
+{
+    QString device;
+    int delayMs = 0; // Added to what the sink would have by itself, to line it up with the primary output.
+    int channels = EXTRA_SINK_CHANNELS; // The output is mixed down or up to this.
+
+    bool operator==(const ExtraSinkConfig &other) const;
+    QString describe() const;
+
+    static ExtraSinkConfig parse(const QString &value);
+};
+
+/**
+ * @brief The RuntimeConfig struct holds what the config file can change while running: devices, buffers and DSP.
+ *
+ * The file is INI, with the sections devices, buffers and dsp, and a section per extra sink, with a name starting with
+ * 'sink', like [sink_zone2]. Keys that aren't there keep the values from the command
+ * line and latency profile, so the file only needs what differs.
+ */
+struct RuntimeConfig
+{
+    QString captureDevice = CAPTURE_DEVICE;
+    QString playbackDevice = PLAYBACK_DEVICE;
+    QString mixerCard = MIXER_CARD;
+    int gpioLine = DIR9001_GPIO_LINE; // -1 for none, like on a machine without the cape.
+    QString networkSource; // Captures from the network instead of the capture device, when set.
+    QList<ExtraSinkConfig> extraSinks;
+    int framesInBuffer = FRAMES_IN_BUFFER;
+    int ringBufferSize = RING_BUFFER_SIZE;
+    int avioBufferSize = AVIO_CTX_BUFFER_SIZE;
+    int probeSize = PROBE_SIZE;
+    LatencyProfile latency;
+    int lockThresholdSamples = LOCK_THRESHOLD_SAMPLES;
+    int volume = 100;
+    bool upmixStereo = false;
+
+    bool load(const QString &path);
+    ConfigChange changeTo(const RuntimeConfig &next) const;
+    QString describe() const;
+
+    static const char *describe(ConfigChange change);
+    static void requestReload();
+    static unsigned int reloadRequests();
+};
+
+#endif // RUNTIMECONFIG_H
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "samplefifo.h"
+#include <algorithm>
+#include <string.h>
+
+SampleFifo::SampleFifo(int capacityFrames, int maxChannels) :
+    mSamples(new int16_t[capacityFrames * maxChannels]),
+    mCapacityFrames(capacityFrames),
+    mWriteFrame(0),
+    mReadFrame(0)
+{
+
+}
+
+SampleFifo::~SampleFifo()
+{
+    delete[] mSamples;
+}
+
+void SampleFifo::reset(int channels)
+{
+    mChannels = channels;
+    mWriteFrame = 0;
+    mReadFrame = 0;
+}
+
+/**
+ * @brief SampleFifo::push copies as many frames as fit.
+ * @return the amount of frames copied.
+ */
+int SampleFifo::push(const int16_t *samples, int frames)
+{
+    const unsigned int write = mWriteFrame.load(std::memory_order_relaxed);
+    const unsigned int read = mReadFrame.load(std::memory_order_acquire);
+    const int space = mCapacityFrames - static_cast<int>(write - read);
+    frames = std::min(frames, space);
+
+    int done = 0;
+    while (done < frames)
+    {
+        const int index = (write + done) % mCapacityFrames;
+        const int chunk = std::min(frames - done, mCapacityFrames - index);
+        memcpy(mSamples + index * mChannels, samples + done * mChannels, chunk * mChannels * sizeof(int16_t));
+        done += chunk;
+    }
+
+    mWriteFrame.store(write + frames, std::memory_order_release);
+    return frames;
+}
+
+/**
+ * @brief SampleFifo::readPointer gives the contiguous part of the readable frames.
+ * @param frames is set to the amount of frames that can be read from the returned pointer.
+ */
+const int16_t *SampleFifo::readPointer(int &frames) const
+{
+    const unsigned int read = mReadFrame.load(std::memory_order_relaxed);
+    const unsigned int write = mWriteFrame.load(std::memory_order_acquire);
+    const int index = read % mCapacityFrames;
+    frames = std::min(static_cast<int>(write - read), mCapacityFrames - index);
+    return mSamples + index * mChannels;
+}
+
+void SampleFifo::consume(int frames)
+{
+    mReadFrame.fetch_add(frames, std::memory_order_release);
+}
+
+int SampleFifo::framesAvailable() const
+{
+    return static_cast<int>(mWriteFrame.load(std::memory_order_acquire) - mReadFrame.load(std::memory_order_acquire));
+}
+
+int SampleFifo::framesFree() const
+{
+    return mCapacityFrames - framesAvailable();
+}
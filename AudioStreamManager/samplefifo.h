@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef SAMPLEFIFO_H
+#define SAMPLEFIFO_H
+
+#include <atomic>
+#include <stdint.h>
+
+/**
+ * @brief The SampleFifo class is a single producer, single consumer FIFO of interleaved 16 bit frames.
+ *
+ * It's lock-free, so the reactor thread never waits for the thread that produces audio. The consumer reads in place,
+ * with readPointer() and consume(), so the samples can go straight to snd_pcm_writei().
+ *
+ * The capacity must be a power of two, so the free-running counters stay valid when they wrap.
+ *
+ * reset() may only be called when neither side is using it.
+ */
+class SampleFifo
+{
+    int16_t *mSamples;
+    const int mCapacityFrames;
+    int mChannels = 0;
+    std::atomic<unsigned int> mWriteFrame; // Free-running counters; the difference is the fill level.
+    std::atomic<unsigned int> mReadFrame;
+
+public:
+    SampleFifo(int capacityFrames, int maxChannels);
+    ~SampleFifo();
+
+    void reset(int channels);
+    int push(const int16_t *samples, int frames);
+    const int16_t *readPointer(int &frames) const;
+    void consume(int frames);
+    int framesAvailable() const;
+    int framesFree() const;
+};
+
+#endif // SAMPLEFIFO_H
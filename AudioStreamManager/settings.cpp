@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "settings.h"
+#include <QCommandLineParser>
+#include <QFileInfo>
+#include <QThread>
+#include <algorithm>
+#include "annotatedexception.h"
+#include "bitstreamrecorder.h"
+#include "controlserver.h"
+
+void Settings::parseCommandLine(const QCoreApplication &app)
+{
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Decodes the S/PDIF input of the BBB audio decoder cape to its DAC.");
+    parser.addHelpOption();
+
+    QCommandLineOption speakersOption("speakers", "The speakers that are connected, as ffmpeg channel layout name, like '2.0', '2.1', "
+                                      "'5.1(back)' or '7.1'. DAC channels are, in order: FL FR FC LFE BL BR SL SR, so '5.1' "
+                                      "(with side speakers) uses DAC channels 7 and 8 for the surrounds. Default: 7.1.", "layout", speakerLayout);
+    parser.addOption(speakersOption);
+
+    QCommandLineOption upmixOption("upmix", "Spread raw PCM stereo over all connected speakers.");
+    parser.addOption(upmixOption);
+
+    QCommandLineOption fadeOption("fade-ms", "Fade out and in over this many milliseconds when switching between raw PCM and "
+                                  "decoding. Default: 5.", "ms", QString::number(fadeMs));
+    parser.addOption(fadeOption);
+
+    QCommandLineOption silenceOption("transition-silence-ms", "Milliseconds of silence between the fade out and fade in. Default: 20.",
+                                     "ms", QString::number(transitionSilenceMs));
+    parser.addOption(silenceOption);
+
+    QCommandLineOption rtPolicyOption("rt-policy", "Scheduling policy of the audio threads: fifo, rr or other. Default: other.",
+                                      "policy", "other");
+    parser.addOption(rtPolicyOption);
+
+    QCommandLineOption capturePriorityOption("capture-priority", "Real-time priority of the capture thread. Default: 80.", "priority", "80");
+    parser.addOption(capturePriorityOption);
+
+    QCommandLineOption playbackPriorityOption("playback-priority", "Real-time priority of the decode/playback thread. Default: 70.", "priority", "70");
+    parser.addOption(playbackPriorityOption);
+
+    QCommandLineOption captureCpuOption("capture-cpu", "Run the capture thread on this CPU only.", "cpu", "-1");
+    parser.addOption(captureCpuOption);
+
+    QCommandLineOption playbackCpuOption("playback-cpu", "Run the decode/playback thread on this CPU only.", "cpu", "-1");
+    parser.addOption(playbackCpuOption);
+
+    QCommandLineOption mlockOption("mlock", "Lock all memory, and prefault the buffers.");
+    parser.addOption(mlockOption);
+
+    QCommandLineOption jitterBenchmarkOption("benchmark-jitter", "Don't play, but measure the wake-up latency of the audio threads "
+                                             "for this many seconds, with and without the real-time settings.", "seconds");
+    parser.addOption(jitterBenchmarkOption);
+
+    QCommandLineOption latencyProfileOption("latency-profile", QString("Where the ALSA buffer sizes found by --calibrate-latency are "
+                                            "saved, and loaded from. Default: %1.").arg(LATENCY_PROFILE_PATH), "file", latencyProfilePath);
+    parser.addOption(latencyProfileOption);
+
+    QCommandLineOption calibrateLatencyOption("calibrate-latency", "Don't play normally, but find the smallest ALSA buffers that have "
+                                              "no xruns for this many seconds, and save them as latency profile.", "seconds");
+    parser.addOption(calibrateLatencyOption);
+
+    QCommandLineOption calibrationMarginOption("calibration-margin", "Percentage added to the smallest buffer without xruns. Default: 50.",
+                                               "percent", QString::number(calibrationMarginPercent));
+    parser.addOption(calibrationMarginOption);
+
+    QCommandLineOption calibrationToneOption("calibration-tone", "Play a tone while calibrating, instead of the S/PDIF input.");
+    parser.addOption(calibrationToneOption);
+
+    QCommandLineOption configOption("config", QString("Config file with devices, buffer sizes and DSP settings. It's applied again "
+                                    "on SIGHUP, or when it changes. Give it more than once to run a pipeline per file, each with "
+                                    "its own devices and GPIO line. Default: %1.").arg(RUNTIME_CONFIG_PATH), "file", configPath);
+    parser.addOption(configOption);
+
+    QCommandLineOption startupTargetOption("startup-target-ms", "Boot to first sound target; the startup trace says when it's not met.",
+                                           "ms", "0");
+    parser.addOption(startupTargetOption);
+
+    QCommandLineOption traceOption("trace", "Start with tracing the audio threads on. SIGUSR2 switches it on and off, and SIGUSR1 "
+                                   "dumps the trace. It's also dumped on every xrun.");
+    parser.addOption(traceOption);
+
+    QCommandLineOption traceDirectoryOption("trace-dir", "Where trace dumps go. Default: /tmp.", "directory", traceDirectory);
+    parser.addOption(traceDirectoryOption);
+
+    QCommandLineOption traceSecondsOption("trace-seconds", "How many seconds of trace to dump. Default: 10.", "seconds",
+                                          QString::number(traceSeconds));
+    parser.addOption(traceSecondsOption);
+
+    QCommandLineOption rtpDestinationOption("rtp-destination", "Also send the output as RTP to this address[:port], like "
+                                            "239.255.77.77:5004. Use 127.0.0.1 to test on the box itself.", "address");
+    parser.addOption(rtpDestinationOption);
+
+    QCommandLineOption rtpFormatOption("rtp-format", "RTP payload format: L16 or L24. Default: L24.", "format", rtpFormat);
+    parser.addOption(rtpFormatOption);
+
+    QCommandLineOption rtpMtuOption("rtp-mtu", "MTU of the network; RTP packets are made to fit. Default: 1500.", "bytes",
+                                    QString::number(rtpMtu));
+    parser.addOption(rtpMtuOption);
+
+    QCommandLineOption rtpTtlOption("rtp-ttl", "Multicast TTL of the RTP packets. Default: 1.", "hops", QString::number(rtpTtl));
+    parser.addOption(rtpTtlOption);
+
+    QCommandLineOption rtpInterfaceOption("rtp-interface", "Address of the interface to send RTP multicast on.", "address");
+    parser.addOption(rtpInterfaceOption);
+
+    QCommandLineOption rtpSdpOption("rtp-sdp", "Write the SDP of the RTP stream to this file, for the receivers.", "file");
+    parser.addOption(rtpSdpOption);
+
+    QCommandLineOption networkSourceOption("net-source", "Capture from the network instead of S/PDIF, on this address:port. A "
+                                           "multicast address is joined. Carries PCM or IEC 61937, like S/PDIF does.", "address");
+    parser.addOption(networkSourceOption);
+
+    QCommandLineOption networkProtocolOption("net-protocol", "rtp (L16 stereo) or udp (S16LE stereo, as captured). Default: rtp.",
+                                             "protocol", networkProtocol);
+    parser.addOption(networkProtocolOption);
+
+    QCommandLineOption networkJitterOption("net-jitter-ms", "How long to wait for a missing RTP packet; this is added as latency. "
+                                           "Default: 20.", "ms", QString::number(networkJitterMs));
+    parser.addOption(networkJitterOption);
+
+    QCommandLineOption recordOption("record", "Start with recording the captured bytes, for diagnosing sources. SIGRTMIN switches "
+                                    "it on and off.");
+    parser.addOption(recordOption);
+
+    QCommandLineOption recordOutputOption("record-output", "Also record the output.");
+    parser.addOption(recordOutputOption);
+
+    QCommandLineOption recordDirectoryOption("record-dir", QString("Where recordings go. Setting it makes the recorder available "
+                                             "without starting it. Default: %1.").arg(RECORDER_DEFAULT_DIRECTORY), "directory");
+    parser.addOption(recordDirectoryOption);
+
+    QCommandLineOption recordFileOption("record-file-mb", "Size at which the next recording file is started. Default: 64.", "MB",
+                                        QString::number(recordFileMb));
+    parser.addOption(recordFileOption);
+
+    QCommandLineOption recordMaxOption("record-max-mb", "Total size of the recording files of each stream; the oldest are deleted. "
+                                       "Default: 1024.", "MB", QString::number(recordMaxMb));
+    parser.addOption(recordMaxOption);
+
+    QCommandLineOption replayOption("replay", "Don't play, but feed the captures of this script through the ring buffer and "
+                                    "playback workers, and report memory growth, leaked workers, switch latencies and dropped "
+                                    "frames. Lines are '<seconds> pcm|encoded <capture>' or '<seconds> pause'; the capture '@tone' "
+                                    "or '@ac3' is generated.", "script");
+    parser.addOption(replayOption);
+
+    QCommandLineOption replaySecondsOption("replay-seconds", "Seconds of audio to replay; the script is repeated. Default: the script once.",
+                                           "seconds", "0");
+    parser.addOption(replaySecondsOption);
+
+    QCommandLineOption replaySpeedOption("replay-speed", "Replay speed, as multiple of real time; 0 is as fast as possible. Default: 10.",
+                                         "factor", QString::number(replaySpeed));
+    parser.addOption(replaySpeedOption);
+
+    QCommandLineOption controlSocketOption("control-socket", QString("Unix socket for state queries, volume, mute and mode commands, "
+                                           "and state change events. Empty disables it. Default: %1.").arg(CONTROL_DEFAULT_SOCKET),
+                                           "path", CONTROL_DEFAULT_SOCKET);
+    parser.addOption(controlSocketOption);
+
+    QCommandLineOption shmOutputOption("shm-output", "Publish the output in this POSIX shared memory object, for other processes "
+                                       "on the box, like level meters. Readers map it read-only and can't slow down playback.", "name");
+    parser.addOption(shmOutputOption);
+
+    QCommandLineOption extraSinkOption("extra-sink", "Also play the output on this ALSA device, like a USB DAC for a second zone, "
+                                       "as device[@delay_ms[@channels]]. Give it more than once for more sinks. A slow or "
+                                       "unplugged sink drops audio, and never holds up the primary output.", "sink");
+    parser.addOption(extraSinkOption);
+
+    QCommandLineOption floatDecodersOption("float-decoders", "Use the float decoders, even when there is a fixed-point variant.");
+    parser.addOption(floatDecodersOption);
+
+    QCommandLineOption benchmarkDecodersOption("benchmark-decoders", "Don't play, but report the CPU cost of each decoder variant "
+                                               "on the given recorded captures.");
+    parser.addOption(benchmarkDecodersOption);
+    parser.addPositionalArgument("captures", "Raw captures (IEC 61937 in S16LE stereo) for --benchmark-decoders.", "[captures...]");
+
+    parser.process(app);
+
+    speakerLayout = parser.value(speakersOption);
+    upmixStereo = parser.isSet(upmixOption);
+    fadeMs = parser.value(fadeOption).toInt();
+    transitionSilenceMs = parser.value(silenceOption).toInt();
+    preferFixedPointDecoders = !parser.isSet(floatDecodersOption);
+
+    const int policy = policyFromName(parser.value(rtPolicyOption));
+    if (policy < 0)
+        throw AnnotatedException(QString("Unknown scheduling policy '%1'").arg(parser.value(rtPolicyOption)));
+    captureRealtime.policy = policy;
+    captureRealtime.priority = parser.value(capturePriorityOption).toInt();
+    captureRealtime.cpu = parser.value(captureCpuOption).toInt();
+    playbackRealtime.policy = policy;
+    playbackRealtime.priority = parser.value(playbackPriorityOption).toInt();
+    playbackRealtime.cpu = parser.value(playbackCpuOption).toInt();
+    lockMemory = parser.isSet(mlockOption);
+    jitterBenchmarkSeconds = parser.value(jitterBenchmarkOption).toInt();
+    latencyProfilePath = parser.value(latencyProfileOption);
+    configPaths = parser.values(configOption);
+    configPath = configPaths.first();
+    calibrateLatencySeconds = parser.value(calibrateLatencyOption).toInt();
+    calibrationMarginPercent = parser.value(calibrationMarginOption).toInt();
+    calibrateWithTone = parser.isSet(calibrationToneOption);
+    if (calibrateLatencySeconds > 0 && configPaths.size() > 1)
+        throw AnnotatedException("There is one latency profile, so calibrate with the one config file whose devices it's for");
+    startupTargetMs = parser.value(startupTargetOption).toInt();
+    traceEnabled = parser.isSet(traceOption);
+    traceDirectory = parser.value(traceDirectoryOption);
+    traceSeconds = parser.value(traceSecondsOption).toInt();
+    rtpDestination = parser.value(rtpDestinationOption);
+    rtpFormat = parser.value(rtpFormatOption);
+    rtpMtu = parser.value(rtpMtuOption).toInt();
+    rtpTtl = parser.value(rtpTtlOption).toInt();
+    rtpInterface = parser.value(rtpInterfaceOption);
+    rtpSdpFile = parser.value(rtpSdpOption);
+    networkSource = parser.value(networkSourceOption);
+    networkProtocol = parser.value(networkProtocolOption);
+    networkJitterMs = parser.value(networkJitterOption).toInt();
+    recordOutput = parser.isSet(recordOutputOption);
+    recordEnabled = parser.isSet(recordOption) || recordOutput;
+    recordDirectory = parser.value(recordDirectoryOption);
+    recordFileMb = parser.value(recordFileOption).toInt();
+    recordMaxMb = parser.value(recordMaxOption).toInt();
+    replayScript = parser.value(replayOption);
+    replaySeconds = parser.value(replaySecondsOption).toInt();
+    replaySpeed = parser.value(replaySpeedOption).toDouble();
+    controlSocket = parser.value(controlSocketOption);
+    shmOutput = parser.value(shmOutputOption);
+    for (const QString &sink : parser.values(extraSinkOption))
+        extraSinks << ExtraSinkConfig::parse(sink);
+
+    if (calibrateLatencySeconds == 0)
+        latencyProfileLoaded = latency.load(latencyProfilePath);
+
+    runtime = loadRuntimeConfig(&runtimeConfigLoaded);
+
+    if (parser.isSet(benchmarkDecodersOption))
+    {
+        decoderBenchmarkFiles = parser.positionalArguments();
+        if (decoderBenchmarkFiles.isEmpty())
+            parser.showHelp(1);
+    }
+}
+
+/**
+ * @brief Settings::loadRuntimeConfig makes the runtime config from the command line, and the config file as it is now.
+ *
+ * Throws when the file has invalid values.
+ */
+RuntimeConfig Settings::loadRuntimeConfig(bool *loaded) const
+{
+    RuntimeConfig config;
+    config.latency = latency;
+    config.upmixStereo = upmixStereo;
+    config.networkSource = networkSource;
+    config.extraSinks = extraSinks;
+
+    const bool fileLoaded = config.load(configPath);
+    if (loaded)
+        *loaded = fileLoaded;
+    return config;
+}
+
+/**
+ * @brief Settings::pipelines makes the settings for each pipeline, one per config file.
+ *
+ * With more than one, every pipeline gets the name of its config file in its control socket, recording directory, shared
+ * memory output and thread names, and the audio threads are spread over the cores, unless a CPU was given. The network
+ * source, extra sinks on the command line and RTP sending are for the first pipeline; the others can have a network source
+ * and extra sinks in their config file.
+ */
+QList<Settings> Settings::pipelines() const
+{
+    QList<Settings> result;
+
+    if (configPaths.size() <= 1)
+    {
+        result << *this;
+        return result;
+    }
+
+    const int cpus = std::max(1, QThread::idealThreadCount());
+    QStringList names;
+
+    for (int i = 0; i < configPaths.size(); i++)
+    {
+        Settings pipeline = *this;
+        pipeline.configPath = configPaths.at(i);
+        pipeline.pipelineName = QFileInfo(pipeline.configPath).completeBaseName();
+
+        if (!QFileInfo(pipeline.configPath).exists())
+            throw AnnotatedException(QString("Config file '%1' doesn't exist; with more than one pipeline, each needs its own").arg(pipeline.configPath));
+        if (names.contains(pipeline.pipelineName))
+            throw AnnotatedException(QString("Config file names must differ, because they name the pipelines; '%1' is used twice").arg(pipeline.pipelineName));
+        names << pipeline.pipelineName;
+
+        if (i > 0)
+        {
+            pipeline.networkSource.clear();
+            pipeline.extraSinks.clear();
+            pipeline.rtpDestination.clear();
+            pipeline.rtpSdpFile.clear();
+        }
+
+        if (!pipeline.controlSocket.isEmpty())
+            pipeline.controlSocket += "." + pipeline.pipelineName;
+        if (!pipeline.shmOutput.isEmpty())
+            pipeline.shmOutput += "-" + pipeline.pipelineName;
+
+        if (captureRealtime.cpu < 0)
+            pipeline.captureRealtime.cpu = (2 * i) % cpus;
+        if (playbackRealtime.cpu < 0)
+            pipeline.playbackRealtime.cpu = (2 * i + 1) % cpus;
+
+        pipeline.runtime = pipeline.loadRuntimeConfig(&pipeline.runtimeConfigLoaded);
+        result << pipeline;
+    }
+
+    return result;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <QCoreApplication>
+#include <QString>
+#include <QStringList>
+#include <QList>
+
+#include "realtime.h"
+#include "latencyprofile.h"
+#include "runtimeconfig.h"
+
+/**
+ * @brief The Settings class holds what can be configured about the installation, as given on the command line.
+ *
+ * What can be changed while running is in runtime, which is what the command line says, with the config file on top.
+ * Each config file on the command line is a pipeline of its own; see pipelines().
+ */
+class Settings
+{
+public:
+    QString speakerLayout = "7.1";
+    bool upmixStereo = false;
+    int fadeMs = 5;
+    int transitionSilenceMs = 20;
+    bool preferFixedPointDecoders = true;
+    QStringList decoderBenchmarkFiles;
+    ThreadRealtimeSettings captureRealtime;
+    ThreadRealtimeSettings playbackRealtime;
+    bool lockMemory = false;
+    int jitterBenchmarkSeconds = 0;
+    QString latencyProfilePath = LATENCY_PROFILE_PATH;
+    LatencyProfile latency;
+    bool latencyProfileLoaded = false;
+    int calibrateLatencySeconds = 0;
+    int calibrationMarginPercent = 50;
+    bool calibrateWithTone = false;
+    int startupTargetMs = 0;
+    bool traceEnabled = false;
+    QString traceDirectory = "/tmp";
+    int traceSeconds = 10;
+    QString rtpDestination;
+    QString rtpFormat = "L24";
+    int rtpMtu = 1500;
+    int rtpTtl = 1;
+    QString rtpInterface;
+    QString rtpSdpFile;
+    QString networkSource;
+    QString networkProtocol = "rtp";
+    int networkJitterMs = 20;
+    bool recordEnabled = false;
+    bool recordOutput = false;
+    QString recordDirectory;
+    int recordFileMb = 64;
+    int recordMaxMb = 1024;
+    QString replayScript;
+    int replaySeconds = 0;
+    double replaySpeed = 10;
+    QString controlSocket;
+    QString shmOutput;
+    QList<ExtraSinkConfig> extraSinks;
+    QString configPath = RUNTIME_CONFIG_PATH;
+    QStringList configPaths;
+    QString pipelineName; // Empty when there's only one.
+    RuntimeConfig runtime;
+    bool runtimeConfigLoaded = false;
+
+    void parseCommandLine(const QCoreApplication &app);
+    RuntimeConfig loadRuntimeConfig(bool *loaded = nullptr) const;
+    QList<Settings> pipelines() const;
+};
+
+#endif // SETTINGS_H
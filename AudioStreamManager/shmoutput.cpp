@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+#include "shmoutput.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+
+#include "annotatedexception.h"
+#include "outputstage.h"
+
+static QString shmName(const QString &name)
+{
+    return name.startsWith('/') ? name : "/" + name;
+}
+
+ShmOutput::ShmOutput(const QString &name) :
+    mName(shmName(name)),
+    mPublished(0)
+{
+
+}
+
+ShmOutput::~ShmOutput()
+{
+    if (mLayout)
+    {
+        mLayout->header.writerActive.store(0, std::memory_order_release);
+        munmap(mLayout, sizeof(ShmOutputLayout));
+    }
+
+    if (mFd >= 0)
+    {
+        close(mFd);
+        shm_unlink(qPrintable(mName));
+    }
+}
+
+/**
+ * @brief ShmOutput::start creates the shared memory object. One left behind by a crash is replaced; its readers see it as gone.
+ */
+void ShmOutput::start()
+{
+    shm_unlink(qPrintable(mName));
+
+    mFd = shm_open(qPrintable(mName), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+    if (mFd < 0)
+        throw AnnotatedException(QString("Can't create shared memory %1: %2").arg(mName).arg(strerror(errno)));
+
+    if (ftruncate(mFd, sizeof(ShmOutputLayout)) < 0)
+        throw AnnotatedException(QString("Can't size shared memory %1: %2").arg(mName).arg(strerror(errno)));
+
+    void *memory = mmap(nullptr, sizeof(ShmOutputLayout), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, 0);
+    if (memory == MAP_FAILED)
+        throw AnnotatedException(QString("Can't map shared memory %1: %2").arg(mName).arg(strerror(errno)));
+
+    memset(memory, 0, sizeof(ShmOutputLayout));
+    mLayout = static_cast<ShmOutputLayout*>(memory);
+
+    ShmOutputHeader &header = mLayout->header;
+    header.magic = SHM_OUTPUT_MAGIC;
+    header.version = SHM_OUTPUT_VERSION;
+    header.sampleRate = OUTPUT_SAMPLE_RATE;
+    header.slotCount = SHM_OUTPUT_SLOTS;
+    header.slotFrames = SHM_OUTPUT_SLOT_FRAMES;
+    header.maxChannels = MAX_OUTPUT_CHANNELS;
+    header.writerActive.store(1, std::memory_order_release);
+}
+
+void ShmOutput::beginPath(int channels)
+{
+    if (mSlot)
+        publishSlot();
+
+    mChannels = channels;
+    mPath++;
+}
+
+void ShmOutput::write(const int16_t *samples, int frames)
+{
+    if (!mLayout || mChannels <= 0)
+        return;
+
+    while (frames > 0)
+    {
+        if (!mSlot)
+            openSlot();
+
+        const int chunk = std::min(frames, static_cast<int>(SHM_OUTPUT_SLOT_FRAMES - mSlot->frames));
+        memcpy(mSlot->samples + mSlot->frames * mChannels, samples, chunk * mChannels * sizeof(int16_t));
+        mSlot->frames += chunk;
+        mPosition += chunk;
+        samples += chunk * mChannels;
+        frames -= chunk;
+
+        if (mSlot->frames == SHM_OUTPUT_SLOT_FRAMES)
+            publishSlot();
+    }
+}
+
+/**
+ * @brief ShmOutput::openSlot marks the next slot as being written, so a reader still copying the old block sees it change.
+ */
+void ShmOutput::openSlot()
+{
+    mSlot = &mLayout->slots[mBlock % SHM_OUTPUT_SLOTS];
+    mSlot->sequence.store(2 * mBlock + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    mSlot->channels = mChannels;
+    mSlot->frames = 0;
+    mSlot->path = mPath;
+    mSlot->position = mPosition;
+}
+
+void ShmOutput::publishSlot()
+{
+    mSlot->sequence.store(2 * (mBlock + 1), std::memory_order_release);
+    mBlock++;
+    mLayout->header.blocks.store(mBlock, std::memory_order_release);
+    mPublished.store(mBlock, std::memory_order_relaxed);
+    mSlot = nullptr;
+}
+
+QString ShmOutput::describe() const
+{
+    return QString("Shared memory output %1: %2 blocks published").arg(mName).arg(mPublished.load());
+}
+
+ShmOutputReader::~ShmOutputReader()
+{
+    detach();
+}
+
+/**
+ * @brief ShmOutputReader::attach maps the shared memory of a ShmOutput read-only, so the reader can't disturb the writer.
+ */
+bool ShmOutputReader::attach(const QString &name)
+{
+    detach();
+
+    mFd = shm_open(qPrintable(shmName(name)), O_RDONLY | O_CLOEXEC, 0);
+    if (mFd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(mFd, &info) < 0 || info.st_size < static_cast<off_t>(sizeof(ShmOutputLayout)))
+    {
+        detach();
+        return false;
+    }
+
+    void *memory = mmap(nullptr, sizeof(ShmOutputLayout), PROT_READ, MAP_SHARED, mFd, 0);
+    if (memory == MAP_FAILED)
+    {
+        detach();
+        return false;
+    }
+    mLayout = static_cast<const ShmOutputLayout*>(memory);
+
+    if (mLayout->header.magic != SHM_OUTPUT_MAGIC || mLayout->header.version != SHM_OUTPUT_VERSION)
+    {
+        detach();
+        return false;
+    }
+
+    const uint32_t blocks = mLayout->header.blocks.load(std::memory_order_acquire);
+    mNext = blocks > 0 ? blocks - 1 : 0;
+    return true;
+}
+
+void ShmOutputReader::detach()
+{
+    if (mLayout)
+        munmap(const_cast<ShmOutputLayout*>(mLayout), sizeof(ShmOutputLayout));
+    mLayout = nullptr;
+
+    if (mFd >= 0)
+        close(mFd);
+    mFd = -1;
+}
+
+ShmOutputReader::Result ShmOutputReader::read(ShmOutputBlock &block)
+{
+    if (!mLayout)
+        return Result::Gone;
+
+    const uint32_t blocks = mLayout->header.blocks.load(std::memory_order_acquire);
+    const int32_t behind = static_cast<int32_t>(blocks - mNext);
+
+    if (behind <= 0)
+        return mLayout->header.writerActive.load(std::memory_order_acquire) ? Result::Wait : Result::Gone;
+
+    if (behind > SHM_OUTPUT_SLOTS - 1)
+    {
+        mNext = blocks - 1;
+        mOverruns++;
+        return Result::Overrun;
+    }
+
+    const ShmOutputSlot &slot = mLayout->slots[mNext % SHM_OUTPUT_SLOTS];
+    const uint32_t before = slot.sequence.load(std::memory_order_acquire);
+    if (before != 2 * (mNext + 1))
+    {
+        mNext = blocks - 1;
+        mOverruns++;
+        return Result::Overrun;
+    }
+
+    block.channels = std::min<uint32_t>(slot.channels, MAX_OUTPUT_CHANNELS);
+    block.frames = std::min<uint32_t>(slot.frames, SHM_OUTPUT_SLOT_FRAMES);
+    block.path = slot.path;
+    block.position = slot.position;
+    memcpy(block.samples, slot.samples, block.frames * block.channels * sizeof(int16_t));
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != before)
+    {
+        mNext = mLayout->header.blocks.load(std::memory_order_acquire) - 1;
+        mOverruns++;
+        return Result::Overrun;
+    }
+
+    mNext++;
+    return Result::Block;
+}
+
+uint64_t ShmOutputReader::overruns() const
+{
+    return mOverruns;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+#ifndef SHMOUTPUT_H
+#define SHMOUTPUT_H
+
+#include <QString>
+#include <atomic>
+#include <stdint.h>
+
+#include "outputtap.h"
+#include "speakerlayout.h"
+
+#define SHM_OUTPUT_MAGIC 0x4f4d5341 // "ASMO"
+#define SHM_OUTPUT_VERSION 1
+#define SHM_OUTPUT_SLOTS 64 // About 340 ms of history for readers.
+#define SHM_OUTPUT_SLOT_FRAMES 256
+
+/**
+ * @brief One block of output in shared memory, guarded by its sequence counter like a seqlock.
+ */
+struct alignas(64) ShmOutputSlot
+{
+    std::atomic<uint32_t> sequence; // Odd while being written; 2 * (block + 1) when block is complete.
+    uint32_t channels;
+    uint32_t frames;
+    uint32_t path; // Counts playback paths, so readers know when the format may have changed.
+    uint64_t position; // Output frame number of the first frame.
+    int16_t samples[SHM_OUTPUT_SLOT_FRAMES * MAX_OUTPUT_CHANNELS];
+};
+
+struct alignas(64) ShmOutputHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sampleRate;
+    uint32_t slotCount;
+    uint32_t slotFrames;
+    uint32_t maxChannels;
+    std::atomic<uint32_t> writerActive; // Cleared when the writer goes; readers should attach again later.
+    std::atomic<uint32_t> blocks; // Blocks completed; wraps.
+};
+
+/**
+ * @brief The layout of the shared memory object. The counters are 32 bits, so they're lock-free on every platform.
+ */
+struct ShmOutputLayout
+{
+    ShmOutputHeader header;
+    ShmOutputSlot slots[SHM_OUTPUT_SLOTS];
+};
+
+/**
+ * @brief The ShmOutput class publishes the output in a POSIX shared memory ring, for co-located readers like level meters.
+ *
+ * There is one writer, the playback thread, and any number of readers, which map the memory read-only. The writer never
+ * waits for, or even knows about, readers: it marks a slot as being written, copies the audio into it, marks it complete,
+ * and then counts it in the header. A reader checks the slot's sequence before and after copying; when it changed, or the
+ * reader is more than the ring behind, it overran and skips ahead. ShmOutputReader does exactly that.
+ *
+ * The memory is populated when it's created, so the playback thread does no syscalls and takes no page faults.
+ */
+class ShmOutput : public OutputTap
+{
+    const QString mName;
+    int mFd = -1;
+    ShmOutputLayout *mLayout = nullptr;
+    std::atomic<uint32_t> mPublished;
+
+    // Only touched by the playback thread.
+    ShmOutputSlot *mSlot = nullptr;
+    uint32_t mBlock = 0;
+    int mChannels = 0;
+    uint32_t mPath = 0;
+    uint64_t mPosition = 0;
+
+    void openSlot();
+    void publishSlot();
+
+public:
+    ShmOutput(const QString &name);
+    ~ShmOutput();
+
+    void start();
+    void beginPath(int channels) override;
+    void write(const int16_t *samples, int frames) override;
+    QString describe() const;
+};
+
+struct ShmOutputBlock
+{
+    uint32_t channels;
+    uint32_t frames;
+    uint32_t path;
+    uint64_t position;
+    int16_t samples[SHM_OUTPUT_SLOT_FRAMES * MAX_OUTPUT_CHANNELS];
+};
+
+/**
+ * @brief The ShmOutputReader class reads the ring of a ShmOutput, from another process. It starts at the newest block.
+ */
+class ShmOutputReader
+{
+    int mFd = -1;
+    const ShmOutputLayout *mLayout = nullptr;
+    uint32_t mNext = 0;
+    uint64_t mOverruns = 0;
+
+public:
+    enum class Result
+    {
+        Block,
+        Wait, // Nothing new yet.
+        Overrun, // Blocks were lost; reading continues at the newest.
+        Gone // The writer stopped; attach again.
+    };
+
+    ~ShmOutputReader();
+
+    bool attach(const QString &name);
+    void detach();
+    Result read(ShmOutputBlock &block);
+    uint64_t overruns() const;
+};
+
+#endif // SHMOUTPUT_H
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "speakerlayout.h"
+#include "annotatedexception.h"
+#include <math.h>
+
+extern "C"
+{
+    #include <libavutil/opt.h>
+}
+
+SpeakerLayout::SpeakerLayout() :
+    mName("7.1")
+{
+
+}
+
+SpeakerLayout SpeakerLayout::fromName(const QString &name)
+{
+    SpeakerLayout result;
+    result.mName = name;
+    result.mConnectedLayout = av_get_channel_layout(qPrintable(name));
+
+    if (result.mConnectedLayout == 0 || (result.mConnectedLayout & ~HARDWARE_CHANNEL_LAYOUT))
+        throw AnnotatedException(QString("Speaker layout '%1' is unknown, or has speakers the DAC doesn't have.").arg(name));
+
+    // Take DAC channels in pairs until all connected speakers are covered.
+    const int hardwareChannels = av_get_channel_layout_nb_channels(HARDWARE_CHANNEL_LAYOUT);
+    uint64_t output = 0;
+    for (int i = 0; i < hardwareChannels; i += 2)
+    {
+        if ((result.mConnectedLayout & ~output) == 0)
+            break;
+
+        output |= av_channel_layout_extract_channel(HARDWARE_CHANNEL_LAYOUT, i);
+        output |= av_channel_layout_extract_channel(HARDWARE_CHANNEL_LAYOUT, i + 1);
+    }
+    result.mOutputLayout = output;
+
+    return result;
+}
+
+QString SpeakerLayout::name() const
+{
+    return mName;
+}
+
+uint64_t SpeakerLayout::connectedLayout() const
+{
+    return mConnectedLayout;
+}
+
+uint64_t SpeakerLayout::outputLayout() const
+{
+    return mOutputLayout;
+}
+
+int SpeakerLayout::outputChannels() const
+{
+    return av_get_channel_layout_nb_channels(mOutputLayout);
+}
+
+/**
+ * @brief SpeakerLayout::decoderDownmixLayout is what to set as request_channel_layout on the decoder.
+ * @return the layout, or 0 for no request.
+ *
+ * When only front left and right are connected, the AC3 and DTS decoders can downmix themselves, which is cheaper than
+ * decoding all channels and throwing most away in the matrix.
+ */
+uint64_t SpeakerLayout::decoderDownmixLayout() const
+{
+    if ((mConnectedLayout & ~AV_CH_LAYOUT_STEREO) == 0)
+        return AV_CH_LAYOUT_STEREO;
+    return 0;
+}
+
+/**
+ * @brief SpeakerLayout::setMatrix expands a matrix for the connected speakers to one for the output channels and sets it.
+ * @param connectedMatrix matrix with a row per connected speaker, and a column per input channel.
+ */
+int SpeakerLayout::setMatrix(SwrContext *swr, const double *connectedMatrix, int inChannels) const
+{
+    double matrix[MAX_OUTPUT_CHANNELS * MAX_OUTPUT_CHANNELS] = {0};
+    const int outChannels = outputChannels();
+
+    for (int out = 0; out < outChannels; out++)
+    {
+        const uint64_t channel = av_channel_layout_extract_channel(mOutputLayout, out);
+        const int connectedIndex = av_get_channel_layout_channel_index(mConnectedLayout, channel);
+
+        if (connectedIndex < 0)
+            continue;
+
+        for (int in = 0; in < inChannels; in++)
+            matrix[out * inChannels + in] = connectedMatrix[connectedIndex * inChannels + in];
+    }
+
+    av_opt_set_channel_layout(swr, "out_channel_layout", mOutputLayout, 0);
+    return swr_set_matrix(swr, matrix, inChannels);
+}
+
+/**
+ * @brief SpeakerLayout::configureDownmix sets the output layout and mixing matrix of a resample context.
+ *
+ * Call this after setting the input layout and before swr_init().
+ */
+int SpeakerLayout::configureDownmix(SwrContext *swr, uint64_t inLayout) const
+{
+    const int inChannels = av_get_channel_layout_nb_channels(inLayout);
+    if (inChannels <= 0 || inChannels > MAX_OUTPUT_CHANNELS)
+        return AVERROR(EINVAL);
+
+    double connectedMatrix[MAX_OUTPUT_CHANNELS * MAX_OUTPUT_CHANNELS] = {0};
+    int ret = swr_build_matrix(inLayout, mConnectedLayout, M_SQRT1_2, M_SQRT1_2, 0.0, 1.0, 1.0, connectedMatrix, inChannels,
+                               AV_MATRIX_ENCODING_NONE, nullptr);
+    if (ret < 0)
+        return ret;
+
+    return setMatrix(swr, connectedMatrix, inChannels);
+}
+
+/**
+ * @brief SpeakerLayout::configureStereoUpmix sets a matrix that spreads stereo over all connected speakers.
+ *
+ * A simple passive upmix: the center and LFE get the mono sum, the surrounds get left and right at -6 dB.
+ */
+int SpeakerLayout::configureStereoUpmix(SwrContext *swr) const
+{
+    const int inChannels = 2;
+    const int connectedChannels = av_get_channel_layout_nb_channels(mConnectedLayout);
+    double connectedMatrix[MAX_OUTPUT_CHANNELS * 2] = {0};
+
+    for (int i = 0; i < connectedChannels; i++)
+    {
+        double *row = &connectedMatrix[i * inChannels];
+
+        switch (av_channel_layout_extract_channel(mConnectedLayout, i))
+        {
+        case AV_CH_FRONT_LEFT:
+            row[0] = 1.0;
+            break;
+        case AV_CH_FRONT_RIGHT:
+            row[1] = 1.0;
+            break;
+        case AV_CH_FRONT_CENTER:
+        case AV_CH_LOW_FREQUENCY:
+            row[0] = 0.5;
+            row[1] = 0.5;
+            break;
+        case AV_CH_BACK_LEFT:
+        case AV_CH_SIDE_LEFT:
+            row[0] = 0.5;
+            break;
+        case AV_CH_BACK_RIGHT:
+        case AV_CH_SIDE_RIGHT:
+            row[1] = 0.5;
+            break;
+        default:
+            break;
+        }
+    }
+
+    av_opt_set_channel_layout(swr, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+    return setMatrix(swr, connectedMatrix, inChannels);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef SPEAKERLAYOUT_H
+#define SPEAKERLAYOUT_H
+
+#include <QString>
+
+extern "C"
+{
+    #include <libavutil/channel_layout.h>
+    #include <libswresample/swresample.h>
+}
+
+// The order of the channels on the TDM bus to the PCM1690.
+#define HARDWARE_CHANNEL_LAYOUT AV_CH_LAYOUT_7POINT1
+#define MAX_OUTPUT_CHANNELS 8
+
+/**
+ * @brief The SpeakerLayout class knows which speakers are connected, and makes the mixing matrix for them.
+ *
+ * The DAC channels have a fixed meaning (see HARDWARE_CHANNEL_LAYOUT), so we can't just use the ffmpeg layout of the speakers
+ * as output layout. For example, on 2.1, the LFE is on DAC channel 4. So, the output is the smallest number of DAC channels,
+ * in pairs because that's how the PCM1690 is wired, that covers all connected speakers. Channels in between that are not
+ * connected get a zero row in the matrix; channels after the last connected one are not transferred at all.
+ */
+class SpeakerLayout
+{
+    QString mName;
+    uint64_t mConnectedLayout = HARDWARE_CHANNEL_LAYOUT;
+    uint64_t mOutputLayout = HARDWARE_CHANNEL_LAYOUT;
+
+    int setMatrix(SwrContext *swr, const double *connectedMatrix, int inChannels) const;
+
+public:
+    SpeakerLayout();
+
+    static SpeakerLayout fromName(const QString &name);
+
+    QString name() const;
+    uint64_t connectedLayout() const;
+    uint64_t outputLayout() const;
+    int outputChannels() const;
+    uint64_t decoderDownmixLayout() const;
+
+    int configureDownmix(SwrContext *swr, uint64_t inLayout) const;
+    int configureStereoUpmix(SwrContext *swr) const;
+};
+
+#endif // SPEAKERLAYOUT_H
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "startuptrace.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <atomic>
+#include <iostream>
+#include <time.h>
+
+#define STARTUP_MAX_PHASES 32
+
+struct StartupPhaseTimes
+{
+    const char *name;
+    qint64 beginNs;
+    qint64 endNs;
+};
+
+static QMutex phasesMutex;
+static StartupPhaseTimes phases[STARTUP_MAX_PHASES];
+static int phaseCount = 0;
+static qint64 processStartNs = 0;
+static std::atomic<qint64> firstCapturedNs(0);
+static std::atomic<qint64> firstAudibleNs(0);
+static bool reported = false;
+
+static qint64 bootTimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return static_cast<qint64>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+static double toMs(qint64 ns)
+{
+    return ns / 1000000.0;
+}
+
+/**
+ * @brief StartupTrace::start marks the start of the process. Call it first thing in main().
+ */
+void StartupTrace::start()
+{
+    processStartNs = bootTimeNs();
+}
+
+/**
+ * @brief StartupTrace::beginPhase can be called from any thread, because phases run in parallel.
+ * @return index to give to endPhase(), or -1 when there are too many phases to record.
+ */
+int StartupTrace::beginPhase(const char *name)
+{
+    QMutexLocker locker(&phasesMutex);
+
+    if (phaseCount >= STARTUP_MAX_PHASES)
+        return -1;
+
+    phases[phaseCount].name = name;
+    phases[phaseCount].beginNs = bootTimeNs();
+    phases[phaseCount].endNs = 0;
+    return phaseCount++;
+}
+
+void StartupTrace::endPhase(int index)
+{
+    if (index < 0)
+        return;
+
+    QMutexLocker locker(&phasesMutex);
+    phases[index].endNs = bootTimeNs();
+}
+
+void StartupTrace::markFirstCapturedByte()
+{
+    if (firstCapturedNs.load(std::memory_order_relaxed) != 0)
+        return;
+
+    qint64 expected = 0;
+    firstCapturedNs.compare_exchange_strong(expected, bootTimeNs());
+}
+
+bool StartupTrace::firstAudibleSampleMarked()
+{
+    return firstAudibleNs.load(std::memory_order_relaxed) != 0;
+}
+
+/**
+ * @brief StartupTrace::markFirstAudibleSample is called when the first sample of a playback path was given to the device.
+ * @param delayNs how long it takes until that sample comes out of the DAC, as said by snd_pcm_delay().
+ */
+void StartupTrace::markFirstAudibleSample(qint64 delayNs)
+{
+    qint64 expected = 0;
+    firstAudibleNs.compare_exchange_strong(expected, bootTimeNs() + delayNs);
+}
+
+/**
+ * @brief StartupTrace::report prints the trace, once, as soon as there has been sound. Call it from the main thread.
+ * @param targetMs boot to first sound target; 0 for none.
+ */
+void StartupTrace::report(int targetMs)
+{
+    if (reported || firstAudibleNs == 0 || firstCapturedNs == 0)
+        return;
+
+    reported = true;
+
+    std::cout << "Startup trace, in ms since the process started, which was " << toMs(processStartNs) << " ms after boot:" << std::endl;
+
+    {
+        QMutexLocker locker(&phasesMutex);
+        for (int i = 0; i < phaseCount; i++)
+        {
+            const StartupPhaseTimes &p = phases[i];
+            std::cout << "  " << p.name << ": " << toMs(p.beginNs - processStartNs) << " - ";
+            if (p.endNs > 0)
+                std::cout << toMs(p.endNs - processStartNs) << " (" << toMs(p.endNs - p.beginNs) << " ms)" << std::endl;
+            else
+                std::cout << "not done" << std::endl;
+        }
+    }
+
+    const qint64 audibleNs = firstAudibleNs;
+    std::cout << "  first captured byte: " << toMs(firstCapturedNs - processStartNs) << std::endl;
+    std::cout << "  first audible sample: " << toMs(audibleNs - processStartNs) << std::endl;
+    std::cout << "Boot to first sound: " << toMs(audibleNs) << " ms";
+    if (targetMs > 0)
+        std::cout << ", target " << targetMs << " ms" << (toMs(audibleNs) > targetMs ? ", TOO SLOW" : "");
+    std::cout << std::endl;
+}
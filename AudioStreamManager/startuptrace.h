@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef STARTUPTRACE_H
+#define STARTUPTRACE_H
+
+#include <QtGlobal>
+
+/**
+ * @brief The StartupTrace class records how long it takes from power-on to the first sound, and where that time goes.
+ *
+ * Init phases are timed with StartupPhase. The first captured byte and first audible sample are marked from the audio
+ * threads, which only costs an atomic load once they're marked. When both are there, report() prints the trace once.
+ *
+ * All times are CLOCK_BOOTTIME, so they include the time the kernel and init system took before we were started.
+ */
+class StartupTrace
+{
+public:
+    static void start();
+    static int beginPhase(const char *name);
+    static void endPhase(int index);
+    static void markFirstCapturedByte();
+    static bool firstAudibleSampleMarked();
+    static void markFirstAudibleSample(qint64 delayNs);
+    static void report(int targetMs);
+};
+
+/**
+ * @brief The StartupPhase class times a startup phase for as long as it exists.
+ */
+class StartupPhase
+{
+    int mIndex;
+
+public:
+    StartupPhase(const char *name) : mIndex(StartupTrace::beginPhase(name)) {}
+    ~StartupPhase() { StartupTrace::endPhase(mIndex); }
+};
+
+#endif // STARTUPTRACE_H
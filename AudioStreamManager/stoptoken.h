@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef STOPTOKEN_H
+#define STOPTOKEN_H
+
+#include <atomic>
+
+// Waits are done in slices of this, so a stop request is seen in time to stay within PLAYBACK_SWITCH_BOUND_MS.
+#define RING_WAIT_SLICE_MS 5
+
+/**
+ * @brief The StopToken class is how another thread asks a worker to stop. The worker checks it in every loop and wait.
+ */
+class StopToken
+{
+    std::atomic<bool> mStopRequested;
+
+public:
+    StopToken() : mStopRequested(false) {}
+    inline void requestStop() { mStopRequested = true; }
+    inline bool stopRequested() const { return mStopRequested; }
+};
+
+#endif // STOPTOKEN_H
@@ -19,9 +19,15 @@
 
 #include "streammanager.h"
 #include <QNetworkInterface>
+#include <QFileInfo>
+#include "startuptrace.h"
+#include "annotatedexception.h"
 
 void StreamManager::setIpAddressOnLcd()
 {
+    if (!mLcd)
+        return;
+
     const QList<QNetworkInterface> interfaces = QNetworkInterface::allInterfaces();
 
     foreach (const QNetworkInterface &interface, interfaces)
@@ -34,7 +40,7 @@ void StreamManager::setIpAddressOnLcd()
                 QHostAddress adr = entry.ip();
                 if (adr.protocol() == QAbstractSocket::IPv4Protocol)
                 {
-                    mLcd.setLineTwo(adr.toString());
+                    mLcd->setLineTwo(adr.toString());
                     mIpAddrSetAt = QDateTime::currentDateTime();
                 }
             }
@@ -42,13 +48,37 @@ void StreamManager::setIpAddressOnLcd()
     }
 }
 
-StreamManager::StreamManager(LCDi2c &lcd, QObject *parent) : QObject(parent),
-    mRingBuffer(mGpIOFunctions),
+StreamManager::StreamManager(LCDi2c *lcd, const Settings &settings, QObject *parent) : QObject(parent),
+    mSettings(settings),
+    mLoadedConfig(settings.runtime),
     mLcd(lcd),
+    mReloadRequestsSeen(RuntimeConfig::reloadRequests()),
     mIpDisplayExpired(false)
 {
-    connect(&mRingBuffer, &AudioRingBuffer::newCodecName, this, &StreamManager::onNewCodecName);
-    connect(&mRingBuffer, &AudioRingBuffer::bufferBytesInfo, this, &StreamManager::onSecondLineInfo);
+    makeRingBuffer();
+
+    mMuteRaceTimer.setSingleShot(true);
+    mMuteRaceTimer.setInterval(MUTE_RACE_MAX_WAIT_MS);
+    connect(&mMuteRaceTimer, &QTimer::timeout, this, &StreamManager::onMuteRaceDone);
+
+    if (!settings.controlSocket.isEmpty())
+    {
+        mControlServer.reset(new ControlServer(*mRingBuffer, settings.controlSocket));
+        mControlServer->listen();
+    }
+
+    // Editors that save by renaming make the watch go away, so reloadConfig() adds it again.
+    if (QFileInfo(settings.configPath).exists())
+        mConfigWatcher.addPath(settings.configPath);
+    connect(&mConfigWatcher, &QFileSystemWatcher::fileChanged, this, &StreamManager::onConfigFileChanged);
+
+    mReloadDelayTimer.setSingleShot(true);
+    mReloadDelayTimer.setInterval(CONFIG_RELOAD_DELAY_MS);
+    connect(&mReloadDelayTimer, &QTimer::timeout, this, &StreamManager::reloadConfig);
+
+    mReloadPollTimer.setInterval(CONFIG_RELOAD_POLL_MS);
+    connect(&mReloadPollTimer, &QTimer::timeout, this, &StreamManager::onReloadPollTimer);
+    mReloadPollTimer.start();
 
     setIpAddressOnLcd();
 }
@@ -58,15 +88,168 @@ StreamManager::~StreamManager()
 
 }
 
+/**
+ * @brief StreamManager::makeRingBuffer builds the pipeline, with the GPIO line of the current config.
+ */
+void StreamManager::makeRingBuffer()
+{
+    mRingBuffer.reset();
+    mGpIOFunctions.reset(new GpIOFunctions(mSettings.runtime.gpioLine));
+    mRingBuffer.reset(new AudioRingBuffer(*mGpIOFunctions, mSettings));
+    connect(mRingBuffer.data(), &AudioRingBuffer::newCodecName, this, &StreamManager::onNewCodecName);
+    connect(mRingBuffer.data(), &AudioRingBuffer::bufferBytesInfo, this, &StreamManager::onSecondLineInfo);
+}
+
+/**
+ * @brief StreamManager::start starts capturing right away, and playback when the boot mute race is over.
+ *
+ * Waiting for the race is waiting for the mute event from the mixer thread, or the timeout, without blocking the event loop.
+ */
 void StreamManager::start()
 {
+    mRingBuffer->setAlsaMute(false);
+    mRingBuffer->startCapture();
+
+    if (!AudioRingBuffer::bootMuteRacePossible())
+    {
+        mRingBuffer->startPlayback();
+        return;
+    }
+
     std::cout << "Mute hack wait" << std::endl;
-    mLcd.setLineOne("Mute hack wait");
-    mRingBuffer.setAlsaMute(false);
-    mRingBuffer.sleepUntilMutedOrMax(5000);
+    if (mLcd)
+        mLcd->setLineOne("Mute hack wait");
+    mMuteRacePhase = StartupTrace::beginPhase("mute race wait");
+    mMuteRaceUnmuteApplied = false;
+    connect(mRingBuffer.data(), &AudioRingBuffer::alsaMuteApplied, this, &StreamManager::onAlsaMuteApplied);
+    connect(mRingBuffer.data(), &AudioRingBuffer::alsaMuteChanged, this, &StreamManager::onAlsaMuteChanged);
+    mMuteRaceTimer.start();
+}
+
+/**
+ * @brief StreamManager::onAlsaMuteApplied notes that the mixer thread made our unmute, so the mute that follows is the race.
+ *
+ * The mixer thread only reports changes, so whether the mixer was unmuted already or not, this is when to start looking.
+ */
+void StreamManager::onAlsaMuteApplied(bool muted)
+{
+    if (!muted)
+        mMuteRaceUnmuteApplied = true;
+}
+
+/**
+ * @brief StreamManager::onAlsaMuteChanged ends the wait on the first mute after our unmute was applied.
+ *
+ * A mute reported before that is the state the mixer thread found at boot, which our unmute undoes.
+ */
+void StreamManager::onAlsaMuteChanged(bool muted)
+{
+    if (muted && mMuteRaceUnmuteApplied)
+        onMuteRaceDone();
+}
+
+void StreamManager::onMuteRaceDone()
+{
+    disconnect(mRingBuffer.data(), &AudioRingBuffer::alsaMuteApplied, this, &StreamManager::onAlsaMuteApplied);
+    disconnect(mRingBuffer.data(), &AudioRingBuffer::alsaMuteChanged, this, &StreamManager::onAlsaMuteChanged);
+    mMuteRaceTimer.stop();
+    StartupTrace::endPhase(mMuteRacePhase);
     std::cout << "Mute hack done" << std::endl;
 
-    mRingBuffer.startThreads();
+    mRingBuffer->startPlayback();
+}
+
+void StreamManager::onReloadPollTimer()
+{
+    const unsigned int requests = RuntimeConfig::reloadRequests();
+    if (requests == mReloadRequestsSeen)
+        return;
+
+    mReloadRequestsSeen = requests;
+    reloadConfig();
+}
+
+void StreamManager::onConfigFileChanged()
+{
+    mReloadDelayTimer.start();
+}
+
+/**
+ * @brief StreamManager::reloadConfig reads the config file again, and applies what changed in the least disruptive way.
+ *
+ * Values changed through the control socket, like the volume, stay as they are, unless the file changes them too. A file
+ * with invalid values is not applied at all.
+ */
+void StreamManager::reloadConfig()
+{
+    if (QFileInfo(mSettings.configPath).exists() && !mConfigWatcher.files().contains(mSettings.configPath))
+        mConfigWatcher.addPath(mSettings.configPath);
+
+    // Restarting the pipeline in the middle of the boot mute race would start playback twice; try again later.
+    if (mMuteRaceTimer.isActive())
+    {
+        mReloadDelayTimer.start();
+        return;
+    }
+
+    RuntimeConfig config;
+    try
+    {
+        config = mSettings.loadRuntimeConfig();
+    }
+    catch (AnnotatedException &ex)
+    {
+        std::cerr << "Config not reloaded: " << ex.what() << std::endl;
+        return;
+    }
+
+    const RuntimeConfig loaded = config;
+    const RuntimeConfig &effective = mRingBuffer->config();
+    if (config.volume == mLoadedConfig.volume)
+        config.volume = effective.volume;
+    if (config.upmixStereo == mLoadedConfig.upmixStereo)
+        config.upmixStereo = effective.upmixStereo;
+    mLoadedConfig = loaded;
+
+    const ConfigChange change = mRingBuffer->applyConfig(config);
+    std::cout << "Config reloaded, " << RuntimeConfig::describe(change) << "." << std::endl;
+    if (change == ConfigChange::None)
+        return;
+
+    if (change == ConfigChange::Pipeline)
+        restartPipeline(config);
+
+    mSettings.runtime = mRingBuffer->config();
+    std::cout << "Effective config: " << qPrintable(mSettings.runtime.describe()) << std::endl;
+}
+
+/**
+ * @brief StreamManager::restartPipeline stops everything and builds it again with the new config, or the old one if that fails.
+ */
+void StreamManager::restartPipeline(const RuntimeConfig &config)
+{
+    const RuntimeConfig previous = mRingBuffer->config();
+    const bool userMuted = mRingBuffer->userMuted();
+
+    try
+    {
+        mSettings.runtime = config;
+        makeRingBuffer();
+    }
+    catch (std::exception &ex)
+    {
+        std::cerr << "Can't build the pipeline with the new config, going back to the old one: " << ex.what() << std::endl;
+        mSettings.runtime = previous;
+        makeRingBuffer();
+    }
+
+    if (mControlServer)
+        mControlServer->setRingBuffer(*mRingBuffer);
+
+    mRingBuffer->setUserMute(userMuted);
+    mRingBuffer->setAlsaMute(false);
+    mRingBuffer->startCapture();
+    mRingBuffer->startPlayback();
 }
 
 void StreamManager::onError(const QString &error)
@@ -80,7 +263,8 @@ void StreamManager::onNewCodecName(const QString &name)
 #ifdef QT_DEBUG
     std::cout << qPrintable(name) << std::endl;
 #endif
-    mLcd.setLineOne(name);
+    if (mLcd)
+        mLcd->setLineOne(name);
 }
 
 void StreamManager::onSecondLineInfo(const QString &line)
@@ -88,6 +272,7 @@ void StreamManager::onSecondLineInfo(const QString &line)
     if (mIpDisplayExpired || mIpAddrSetAt.addSecs(5) < QDateTime::currentDateTime())
     {
         mIpDisplayExpired = true;
-        mLcd.setLineTwo(line);
+        if (mLcd)
+            mLcd->setLineTwo(line);
     }
 }
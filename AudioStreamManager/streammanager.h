@@ -22,23 +22,45 @@
 
 #include <QObject>
 #include <QDateTime>
+#include <QTimer>
+#include <QScopedPointer>
+#include <QFileSystemWatcher>
 #include "audioringbuffer.h"
 #include "gpiofunctions.h"
 #include "lcdi2c.h"
+#include "settings.h"
+#include "controlserver.h"
+
+#define MUTE_RACE_MAX_WAIT_MS 5000
+#define CONFIG_RELOAD_POLL_MS 1000 // How often to look for a SIGHUP.
+#define CONFIG_RELOAD_DELAY_MS 200 // Editors write files in steps; reload when it's quiet.
 
 class StreamManager : public QObject
 {
     Q_OBJECT
-    GpIOFunctions mGpIOFunctions;
-    AudioRingBuffer mRingBuffer;
-    LCDi2c &mLcd;
+    Settings mSettings;
+    RuntimeConfig mLoadedConfig; // As last read from the file, without changes made through the control socket.
+    QScopedPointer<GpIOFunctions> mGpIOFunctions;
+    QScopedPointer<AudioRingBuffer> mRingBuffer;
+    LCDi2c *mLcd; // Only one pipeline has the display.
+    unsigned int mReloadRequestsSeen;
     QDateTime mIpAddrSetAt;
     bool mIpDisplayExpired;
+    QTimer mMuteRaceTimer;
+    int mMuteRacePhase = -1;
+    bool mMuteRaceUnmuteApplied = false;
+    QScopedPointer<ControlServer> mControlServer;
+    QFileSystemWatcher mConfigWatcher;
+    QTimer mReloadPollTimer;
+    QTimer mReloadDelayTimer;
 
     void setIpAddressOnLcd();
+    void makeRingBuffer();
+    void reloadConfig();
+    void restartPipeline(const RuntimeConfig &config);
 
 public:
-    explicit StreamManager(LCDi2c &lcd, QObject *parent = nullptr);
+    explicit StreamManager(LCDi2c *lcd, const Settings &settings, QObject *parent = nullptr);
     ~StreamManager();
     void start();
 
@@ -50,6 +72,11 @@ private slots:
     void onError(const QString &error);
     void onNewCodecName(const QString &name);
     void onSecondLineInfo(const QString &line);
+    void onAlsaMuteChanged(bool muted);
+    void onAlsaMuteApplied(bool muted);
+    void onMuteRaceDone();
+    void onReloadPollTimer();
+    void onConfigFileChanged();
 };
 
 
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "tracer.h"
+#include <QFile>
+#include <QDir>
+#include <QDateTime>
+#include <QTextStream>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+struct TraceRing
+{
+    TraceRecord records[TRACE_RING_EVENTS];
+    std::atomic<uint64_t> writeIndex;
+    char name[TRACE_THREAD_NAME_LENGTH];
+    std::atomic<int> tid;
+    std::atomic<bool> owned; // Cleared when the thread exits, so the next thread with the same name can have it.
+};
+
+/**
+ * @brief Gives the ring up when its thread exits.
+ */
+struct TraceRingOwner
+{
+    TraceRing *ring = nullptr;
+    ~TraceRingOwner() { if (ring) ring->owned = false; }
+};
+
+static std::atomic<bool> tracingEnabled(false);
+static std::atomic<TraceRing*> rings[TRACE_MAX_THREADS];
+static std::atomic<int> ringCount(0);
+static thread_local TraceRing *threadRing = nullptr;
+static thread_local TraceRingOwner threadRingOwner;
+static std::atomic<bool> dumpRequested(false);
+
+static const char *eventName(TraceEvent event)
+{
+    switch (event)
+    {
+    case TraceEvent::CapturePeriod: return "capture period";
+    case TraceEvent::RingAcquire: return "ring acquire";
+    case TraceEvent::Demux: return "demux";
+    case TraceEvent::Decode: return "decode";
+    case TraceEvent::Convert: return "convert";
+    case TraceEvent::Write: return "write";
+    case TraceEvent::Xrun: return "xrun";
+    case TraceEvent::FormatSwitch: return "format switch";
+    default: return "unknown";
+    }
+}
+
+void Tracer::setEnabled(bool enabled)
+{
+    tracingEnabled = enabled;
+}
+
+bool Tracer::enabled()
+{
+    return tracingEnabled.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Tracer::requestDump asks for a dump by whoever calls takeDumpRequest(). It's async-signal-safe.
+ */
+void Tracer::requestDump()
+{
+    dumpRequested = true;
+}
+
+bool Tracer::takeDumpRequest()
+{
+    return dumpRequested.exchange(false);
+}
+
+uint64_t Tracer::nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Tracer::registerCurrentThread gives the calling thread its ring. Calling it again from the same thread does nothing.
+ *
+ * Rings are never freed, because a ring must stay valid for dump(). Pipelines that are built again start their threads
+ * again, so a thread first gets the ring of an exited thread with the same name, if there is one. That ring goes on
+ * after the events of the old thread, which did the same job, so they end up in one row of the trace.
+ */
+void Tracer::registerCurrentThread(const char *name)
+{
+    if (threadRing)
+        return;
+
+    const int tid = static_cast<int>(syscall(SYS_gettid));
+    const int count = std::min(ringCount.load(), TRACE_MAX_THREADS);
+    for (int t = 0; t < count; t++)
+    {
+        TraceRing *ring = rings[t];
+        bool owned = false;
+        if (ring && strncmp(ring->name, name, TRACE_THREAD_NAME_LENGTH - 1) == 0 && ring->owned.compare_exchange_strong(owned, true))
+        {
+            ring->tid = tid;
+            threadRing = ring;
+            threadRingOwner.ring = ring;
+            return;
+        }
+    }
+
+    const int index = ringCount.load();
+    if (index >= TRACE_MAX_THREADS)
+        return;
+
+    TraceRing *ring = new TraceRing;
+    memset(ring->records, 0, sizeof(ring->records)); // Also makes sure the pages are there before the audio starts.
+    ring->writeIndex = 0;
+    strncpy(ring->name, name, TRACE_THREAD_NAME_LENGTH - 1);
+    ring->name[TRACE_THREAD_NAME_LENGTH - 1] = 0;
+    ring->tid = tid;
+    ring->owned = true;
+
+    int expected = index;
+    while (!ringCount.compare_exchange_weak(expected, expected + 1))
+    {
+        if (expected >= TRACE_MAX_THREADS)
+        {
+            delete ring;
+            return;
+        }
+    }
+    rings[expected] = ring;
+    threadRing = ring;
+    threadRingOwner.ring = ring;
+}
+
+void Tracer::record(TraceEvent event, uint64_t startNs, uint64_t endNs, int32_t arg)
+{
+    TraceRing *ring = threadRing;
+    if (!ring || !enabled())
+        return;
+
+    const uint64_t index = ring->writeIndex.load(std::memory_order_relaxed);
+    TraceRecord &r = ring->records[index % TRACE_RING_EVENTS];
+    r.startNs = startNs;
+    r.durationNs = static_cast<uint32_t>(std::min<uint64_t>(endNs - startNs, 0xFFFFFFFFULL));
+    r.event = event;
+    r.arg = arg;
+    ring->writeIndex.store(index + 1, std::memory_order_release);
+}
+
+void Tracer::instant(TraceEvent event, int32_t arg)
+{
+    if (!enabled())
+        return;
+
+    const uint64_t now = nowNs();
+    record(event, now, now, arg);
+}
+
+/**
+ * @brief Tracer::dump writes the events of the last seconds of all threads to a new file.
+ * @return the file name, or an empty string when it couldn't be written.
+ */
+QString Tracer::dump(const QString &directory, const QString &reason, int seconds)
+{
+    const QString path = QDir(directory).filePath(QString("trace-%1-%2.json")
+                                                  .arg(QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss")).arg(reason));
+    QFile file(path);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate))
+        return QString();
+
+    const uint64_t now = nowNs();
+    const uint64_t fromNs = now - static_cast<uint64_t>(seconds) * 1000000000ULL;
+
+    QTextStream out(&file);
+    out << "{\"traceEvents\":[\n";
+    bool first = true;
+
+    const int count = std::min(ringCount.load(), TRACE_MAX_THREADS);
+    std::vector<TraceRecord> copy(TRACE_RING_EVENTS);
+
+    for (int t = 0; t < count; t++)
+    {
+        const TraceRing *ring = rings[t];
+        if (!ring)
+            continue;
+
+        out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring->tid.load()
+            << ",\"args\":{\"name\":\"" << ring->name << "\"}}";
+        first = false;
+
+        const uint64_t end = ring->writeIndex.load(std::memory_order_acquire);
+        const uint64_t begin = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+        for (uint64_t i = begin; i < end; i++)
+            copy[i - begin] = ring->records[i % TRACE_RING_EVENTS];
+
+        // What the thread wrote while we copied may have overwritten the oldest part of the copy. It may also have been
+        // writing event 'after' itself, into the slot of event after - TRACE_RING_EVENTS, so that one is left out too.
+        const uint64_t after = ring->writeIndex.load(std::memory_order_acquire);
+        const uint64_t validFrom = after >= TRACE_RING_EVENTS ? std::max(begin, after - TRACE_RING_EVENTS + 1) : begin;
+
+        for (uint64_t i = validFrom; i < end; i++)
+        {
+            const TraceRecord &r = copy[i - begin];
+            if (r.startNs < fromNs)
+                continue;
+
+            out << ",\n{\"name\":\"" << eventName(r.event) << "\",\"pid\":1,\"tid\":" << ring->tid.load()
+                << ",\"ts\":" << QString::number(r.startNs / 1000.0, 'f', 3);
+            if (r.durationNs > 0)
+                out << ",\"ph\":\"X\",\"dur\":" << QString::number(r.durationNs / 1000.0, 'f', 3);
+            else
+                out << ",\"ph\":\"i\",\"s\":\"t\"";
+            out << ",\"args\":{\"arg\":" << r.arg << "}}";
+        }
+    }
+
+    out << "\n]}\n";
+    out.flush();
+    return file.error() == QFile::NoError ? path : QString();
+}
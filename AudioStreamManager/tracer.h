@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <QString>
+#include <atomic>
+#include <stdint.h>
+
+#define TRACE_RING_EVENTS 16384 // Per thread; must be a power of two. At ~2000 events/s, that's 8 s.
+#define TRACE_MAX_THREADS 64 // Rings are only allocated for threads that register.
+#define TRACE_THREAD_NAME_LENGTH 16 // Like the kernel's thread names, so keep names within 15 characters.
+
+enum class TraceEvent : uint16_t
+{
+    CapturePeriod,
+    RingAcquire,
+    Demux,
+    Decode,
+    Convert,
+    Write,
+    Xrun,
+    FormatSwitch,
+    Count
+};
+
+struct TraceRecord
+{
+    uint64_t startNs;
+    uint32_t durationNs; // 0 is an instant event.
+    TraceEvent event;
+    int32_t arg;
+};
+
+/**
+ * @brief The Tracer class records fixed-size binary events in per-thread lock-free rings, and dumps them as Chrome trace JSON.
+ *
+ * Every thread that traces calls registerCurrentThread() once, when it starts; it gets its own ring, so recording is a few
+ * stores by the only writer of that ring. When tracing is off, record() is one relaxed atomic load.
+ *
+ * dump() runs in the main thread, and copies from rings that are still being written. Events that may have been
+ * overwritten while copying are left out, based on the write index before and after.
+ *
+ * The JSON opens in chrome://tracing and ui.perfetto.dev.
+ */
+class Tracer
+{
+public:
+    static void setEnabled(bool enabled);
+    static bool enabled();
+    static void requestDump();
+    static bool takeDumpRequest();
+    static void registerCurrentThread(const char *name);
+    static void record(TraceEvent event, uint64_t startNs, uint64_t endNs, int32_t arg = 0);
+    static void instant(TraceEvent event, int32_t arg = 0);
+    static uint64_t nowNs();
+    static QString dump(const QString &directory, const QString &reason, int seconds);
+};
+
+/**
+ * @brief The TraceScope class records an event for its own lifetime.
+ */
+class TraceScope
+{
+    const TraceEvent mEvent;
+    const uint64_t mStartNs;
+    int32_t mArg = 0;
+
+public:
+    TraceScope(TraceEvent event) : mEvent(event), mStartNs(Tracer::enabled() ? Tracer::nowNs() : 0) {}
+    ~TraceScope() { if (mStartNs) Tracer::record(mEvent, mStartNs, Tracer::nowNs(), mArg); }
+    void setArg(int32_t arg) { mArg = arg; }
+};
+
+#endif // TRACER_H
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include "xrunrecovery.h"
+#include <QMutexLocker>
+#include <QDateTime>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#include "speakerlayout.h"
+#include "tracer.h"
+
+static qint64 clockUs(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return static_cast<qint64>(ts.tv_sec) * 1000000LL + ts.tv_nsec / 1000;
+}
+
+XrunRecovery::XrunRecovery() :
+    mHistory(XRUN_HISTORY_SIZE),
+    mXruns(0),
+    mSilence(new int16_t[XRUN_SILENCE_FRAMES * MAX_OUTPUT_CHANNELS])
+{
+    memset(mSilence, 0, XRUN_SILENCE_FRAMES * MAX_OUTPUT_CHANNELS * sizeof(int16_t));
+}
+
+XrunRecovery::~XrunRecovery()
+{
+    delete[] mSilence;
+}
+
+/**
+ * @brief XrunRecovery::recover recovers a PCM with snd_pcm_recover(), and restarts it.
+ * @param error the error returned by a read or write, or -EPIPE when poll said the device is in error.
+ * @param record whether it's a real dropout. The playback device running out after a transition is not.
+ * @param prefill for playback: fill the buffer with silence, so playing continues right away.
+ * @return false when the device couldn't be recovered.
+ *
+ * A suspended device (-ESTRPIPE) is resumed; snd_pcm_recover() falls back to preparing it when the driver can't resume.
+ */
+bool XrunRecovery::recover(snd_pcm_t *pcm, int error, const char *stream, bool record, bool prefill)
+{
+    if (record)
+        Tracer::instant(TraceEvent::Xrun, snd_pcm_stream(pcm));
+
+    const qint64 startUs = clockUs(CLOCK_REALTIME);
+
+    // The trigger timestamp of a stopped device is the moment of the xrun. The default timestamps are gettimeofday() ones.
+    qint64 stoppedUs = 0;
+    snd_pcm_status_t *status;
+    snd_pcm_status_alloca(&status);
+    if (snd_pcm_status(pcm, status) == 0 && snd_pcm_status_get_state(status) == SND_PCM_STATE_XRUN)
+    {
+        snd_timestamp_t trigger;
+        snd_pcm_status_get_trigger_tstamp(status, &trigger);
+        stoppedUs = static_cast<qint64>(trigger.tv_sec) * 1000000LL + trigger.tv_usec;
+    }
+
+    int ret = snd_pcm_recover(pcm, error, 1);
+
+    if (ret == 0)
+    {
+        if (snd_pcm_stream(pcm) == SND_PCM_STREAM_CAPTURE)
+            ret = snd_pcm_start(pcm);
+        else if (prefill)
+            prefillSilence(pcm);
+    }
+
+    if (record)
+    {
+        const qint64 nowUs = clockUs(CLOCK_REALTIME);
+        const qint64 gapUs = nowUs - (stoppedUs > 0 && stoppedUs <= startUs ? stoppedUs : startUs);
+
+        XrunEvent event;
+        event.wallClockMs = startUs / 1000;
+        event.stream = stream;
+        event.error = error;
+        event.gapUs = static_cast<int>(gapUs);
+        event.recovered = ret == 0;
+
+        QMutexLocker locker(&mMutex);
+        mHistory[mNextEvent] = event;
+        mNextEvent = (mNextEvent + 1) % XRUN_HISTORY_SIZE;
+        mXruns++;
+    }
+
+    return ret == 0;
+}
+
+void XrunRecovery::prefillSilence(snd_pcm_t *pcm)
+{
+    snd_pcm_uframes_t bufferSize = 0;
+    snd_pcm_uframes_t periodSize = 0;
+    if (snd_pcm_get_params(pcm, &bufferSize, &periodSize) < 0 || bufferSize <= periodSize)
+        return;
+
+    const ssize_t frameBytes = snd_pcm_frames_to_bytes(pcm, 1);
+    if (frameBytes <= 0)
+        return;
+
+    const snd_pcm_uframes_t chunkFrames = XRUN_SILENCE_FRAMES * MAX_OUTPUT_CHANNELS * sizeof(int16_t) / frameBytes;
+    snd_pcm_uframes_t left = bufferSize - periodSize;
+
+    while (left > 0)
+    {
+        snd_pcm_sframes_t ret = snd_pcm_writei(pcm, mSilence, std::min(left, chunkFrames));
+        if (ret <= 0)
+            return;
+        left -= ret;
+    }
+}
+
+quint64 XrunRecovery::xrunCount() const
+{
+    return mXruns;
+}
+
+/**
+ * @brief XrunRecovery::history gives the last xruns, oldest first.
+ */
+QList<XrunEvent> XrunRecovery::history(int last)
+{
+    QMutexLocker locker(&mMutex);
+
+    last = std::min(last, static_cast<int>(std::min<quint64>(mXruns, XRUN_HISTORY_SIZE)));
+
+    QList<XrunEvent> result;
+    for (int i = last; i > 0; i--)
+        result.append(mHistory.at((mNextEvent - i + XRUN_HISTORY_SIZE) % XRUN_HISTORY_SIZE));
+    return result;
+}
+
+QString XrunRecovery::describe(const XrunEvent &event)
+{
+    return QString("%1 %2 xrun (%3), gap of %4 ms%5")
+            .arg(QDateTime::fromMSecsSinceEpoch(event.wallClockMs).toString("yyyy-MM-dd hh:mm:ss.zzz"))
+            .arg(event.stream).arg(snd_strerror(event.error)).arg(event.gapUs / 1000.0, 0, 'f', 1)
+            .arg(event.recovered ? "" : ", not recovered");
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2018  Wiebe Cazemier <wiebe@halfgaar.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * https://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef XRUNRECOVERY_H
+#define XRUNRECOVERY_H
+
+#include <QMutex>
+#include <QList>
+#include <QVector>
+#include <QString>
+#include <atomic>
+#include <alsa/asoundlib.h>
+
+#define XRUN_HISTORY_SIZE 64
+#define XRUN_SILENCE_FRAMES 1024
+
+struct XrunEvent
+{
+    qint64 wallClockMs; // To correlate with the system log.
+    const char *stream;
+    int error;
+    int gapUs; // From the moment the device stopped, until it runs again.
+    bool recovered;
+};
+
+/**
+ * @brief The XrunRecovery class gets capture and playback going again after an xrun or suspend, and remembers when it happened.
+ *
+ * It's called from the reactor thread, so it doesn't sleep. After a playback underrun in the middle of a path, the device is
+ * filled with silence up to its buffer size minus a period, so it has a cushion again instead of running dry right away.
+ *
+ * The history is read by the main thread; it's a mutex, but only xruns take it.
+ */
+class XrunRecovery
+{
+    QMutex mMutex;
+    QVector<XrunEvent> mHistory;
+    int mNextEvent = 0;
+    std::atomic<quint64> mXruns;
+    int16_t *mSilence;
+
+    void prefillSilence(snd_pcm_t *pcm);
+
+public:
+    XrunRecovery();
+    ~XrunRecovery();
+
+    bool recover(snd_pcm_t *pcm, int error, const char *stream, bool record, bool prefill);
+    quint64 xrunCount() const;
+    QList<XrunEvent> history(int last);
+    static QString describe(const XrunEvent &event);
+};
+
+#endif // XRUNRECOVERY_H